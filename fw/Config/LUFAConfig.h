@@ -66,7 +66,10 @@
 //		#define NO_SOF_EVENTS
 
 		/* USB Device Mode Driver Related Tokens: */
+		/* The baked variant mixes descriptors in RAM and in FLASH. */
+		#if !defined(BAKED_DESCRIPTORS)
 		#define USE_RAM_DESCRIPTORS
+		#endif
 //		#define USE_FLASH_DESCRIPTORS
 //		#define USE_EEPROM_DESCRIPTORS
 		#define NO_INTERNAL_SERIAL
@@ -8,43 +8,182 @@
 #include <LUFA/Drivers/Peripheral/Serial.h>
 #include "../include/protocol.h"
 
-#define MAX_CONTROL_TRANSFER_SIZE MAX_PACKET_VALUE_SIZE
+#ifdef BAKED_DESCRIPTORS
+// generated by serialusb --export-descriptors, see the baked target in the makefile
+#include BAKED_DESCRIPTORS
+// the baked set leaves room for a smaller uploaded set, used when the host has a different one
+#define DESCRIPTORS_SIZE 256
+#else
+#define DESCRIPTORS_SIZE MAX_DESCRIPTORS_SIZE
+#endif
+
+// control transfers are received from the host in fragments of at most this size
+#define MAX_CONTROL_FRAGMENT_SIZE MAX_PACKET_VALUE_SIZE
 
 #define USART_DOUBLE_SPEED false
 
+// the ring indexes are 8-bit, so that they wrap around with the ring
+#define RX_RING_SIZE 256
+
+// must be a power of 2, and at least the size of an OUT packet
+#define TX_RING_SIZE 128
+
+// the atmega32u4 has 832 bytes of endpoint memory, shared by all endpoints including the control endpoint
+#define ENDPOINT_DPRAM_SIZE 832
+
 /*
- * The access to these variables is synchronized.
+ * Only used in the main.
  */
-static uint8_t control[MAX_CONTROL_TRANSFER_SIZE];
+static uint8_t control[MAX_CONTROL_FRAGMENT_SIZE];
 
-static s_endpointPacket input;
-static uint8_t inputDataLen;
+/*
+ * IN packets wait here until their endpoint has a free bank.
+ * The host sends at most one packet per endpoint, and at most IN_SLOTS packets, before getting an ack.
+ */
+static struct {
+    uint8_t length; // value length (endpoint + data), 0 means the slot is free
+    s_endpointPacket packet;
+} inSlots[IN_SLOTS];
 
-static uint8_t descriptors[MAX_DESCRIPTORS_SIZE];
+static uint8_t descriptors[DESCRIPTORS_SIZE];
 static s_descriptorIndex descIndex[MAX_DESCRIPTORS];
 static s_endpointConfig endpoints[MAX_ENDPOINTS];
 
-/*
- * Only used in the serial interrupt.
- */
 static uint8_t * pdesc = descriptors;
 static uint8_t * pindex = (uint8_t *)descIndex;
+// once a part of the descriptors is dropped, the next parts would be stored at the wrong offset
+static uint8_t descriptorsDropped = 0;
 
-/*
- * Only used in the main.
- */
 static uint8_t outEndpoints[MAX_ENDPOINTS];
-static uint8_t selectedOutEndpoint = 0;
+static uint8_t selectedOutEndpoint = 0; // the first endpoint to check, so that all endpoints get the serial link in turn
 static uint8_t outEndpointNumber = 0;
 
 /*
+ * The OUT endpoints holding a packet (one bit per endpoint number), set by the endpoint interrupt.
+ * The interrupt of an endpoint is disabled until its packet is forwarded.
+ */
+static volatile uint8_t outReady = 0;
+static uint16_t controlDataLength = 0; // bytes written into the data stage of the control IN transfer
+
+static uint8_t started = 0;
+
+/*
+ * The last uploaded set (descriptors, index and endpoints) is kept in the EEPROM, if it fits.
+ * The header is invalidated before the set is written, and written last.
+ */
+#define EEPROM_VALID 0xA5
+
+typedef struct {
+    uint32_t hash;
+    uint16_t descriptorsSize;
+    uint16_t indexSize;
+    uint8_t valid; // EEPROM_VALID once the whole set is written
+} s_eepromHeader;
+
+static s_eepromHeader EEMEM eepromHeader;
+static uint8_t EEMEM eepromData[E2END + 1 - sizeof(s_eepromHeader)];
+
+static uint32_t offeredHash = 0;
+static uint8_t hashOffered = 0;
+
+#ifdef BAKED_DESCRIPTORS
+static uint8_t useBaked = 0; // the host has the baked set
+#endif
+
+/*
+ * An EEPROM write takes 3.3 ms, so the set is saved one byte per main loop pass, after the USB start.
+ */
+static struct {
+    enum {
+        EEPROM_IDLE,
+        EEPROM_INVALIDATE,
+        EEPROM_DATA,
+        EEPROM_HEADER,
+    } state;
+    uint16_t offset;
+    uint16_t size;
+    s_eepromHeader header;
+} eepromSave = { .state = EEPROM_IDLE };
+static uint8_t controlReply = 0;
+static uint8_t controlStall = 0;
+static uint8_t controlReplyLen = 0;
+static uint8_t controlFragment = 0; // the reply is followed by other fragments
+
+// the host has to reply within this number of timer ticks (50 ms)
+#define CONTROL_TIMEOUT (50000 / TIMER_TICK_US)
+
+/*
+ * The control requests forwarded to the host are processed in the main loop,
+ * so that the other endpoints keep being serviced while waiting for the host.
+ * The control endpoint NAKs the data and status stages until they are processed.
+ */
+static enum {
+    CONTROL_IDLE,
+    CONTROL_OUT_DATA,   // forwarding the data stage of an OUT transfer to the host
+    CONTROL_WAIT_REPLY, // waiting for the host to reply
+    CONTROL_IN_DATA,    // writing a reply fragment into the control endpoint
+    CONTROL_STATUS,     // waiting for the status stage of an IN transfer
+} controlState = CONTROL_IDLE;
+
+static uint16_t controlRemaining = 0; // bytes of the data stage of the OUT transfer still to forward
+static uint8_t controlOffset = 0; // bytes of the reply fragment already written
+static bool controlFlush = false; // the last packet of the data stage still has to be sent
+static uint16_t controlStart = 0; // timer value when the setup packet was received
+static uint16_t controlWaitStart = 0; // timer value when the wait for the host started
+static s_controlTiming controlTiming;
+
+static struct {
+    enum {
+        PARSER_TYPE,
+        PARSER_LENGTH,
+        PARSER_VALUE,
+    } state;
+    uint8_t type;
+    uint8_t length;
+    uint8_t remaining;
+    uint8_t * start; // NULL if the value is dropped
+    uint8_t * target;
+    uint8_t slot; // the IN slot being filled
+} parser = { .state = PARSER_TYPE };
+
+/*
+ * The serial interrupt only pushes the received bytes into this ring, and the packets are parsed in the main,
+ * so that the serial interrupt is short and never delays the USB handling.
  * These variables are used in both the main and the serial interrupt,
- * therefore they have to be declared as volatile.
+ * therefore the indexes have to be declared as volatile.
+ */
+static uint8_t rxRing[RX_RING_SIZE];
+static volatile uint8_t rxHead = 0; // written by the serial interrupt
+static volatile uint8_t rxTail = 0; // written by the main
+
+/*
+ * The bytes to send are queued into this ring, which is drained by the serial data register empty interrupt,
+ * so that the main can keep servicing the endpoints while the serial link is busy.
+ * The indexes are free-running and masked when accessing the ring.
+ */
+static uint8_t txRing[TX_RING_SIZE];
+static volatile uint8_t txHead = 0; // written by the main
+static volatile uint8_t txTail = 0; // written by the serial interrupt
+
+// the statistics are sent every second
+#define STATS_PERIOD (1000000 / TIMER_TICK_US)
+
+/*
+ * The runtime statistics, reset each time they are sent.
+ * The serial counters are updated by the serial interrupt, and are read with the interrupts disabled.
+ */
+static s_firmwareStats stats;
+static uint16_t statsStart = 0;
+
+// the NAK flags are sampled once per frame, so that the counts don't depend on the main loop speed
+#define NAK_SAMPLE_PERIOD (1000 / TIMER_TICK_US)
+
+static uint16_t nakSampleStart = 0;
+
+/*
+ * The high word of the firmware time, incremented by the timer overflow interrupt.
  */
-static volatile uint8_t started = 0;
-static volatile uint8_t controlReply = 0;
-static volatile uint8_t controlStall = 0;
-static volatile uint8_t controlReplyLen = 0;
+static volatile uint16_t timerHigh = 0;
 
 static inline void forceHardReset(void) {
 
@@ -53,79 +192,372 @@ static inline void forceHardReset(void) {
     while(1); // wait for watchdog to reset processor
 }
 
-static inline int8_t Serial_BlockingReceiveByte(void) {
+ISR(TIMER1_OVF_vect) {
 
-    while(!Serial_IsCharReceived()) {}
-    return UDR1;
+    ++timerHigh;
+}
+
+/*
+ * Get the firmware time, in TIMER_TICK_US units.
+ */
+static s_timestamp get_timestamp(void) {
+
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t low = TCNT1;
+    uint16_t high = timerHigh;
+    if ((TIFR1 & (1 << TOV1)) && low < 0x8000) {
+        ++high; // the timer overflowed, but the interrupt is not processed yet
+    }
+    SREG = sreg;
+    return ((s_timestamp)high << 16) | low;
 }
 
-static inline void send_control_header(void) {
+ISR(USB_COM_vect) {
+
+    uint8_t previous = UENUM;
+    uint8_t pending = UEINT & ~(1 << ENDPOINT_CONTROLEP);
 
-    uint8_t len = sizeof(USB_ControlRequest);
-    if( !(USB_ControlRequest.bmRequestType & REQDIR_DEVICETOHOST) ) {
-        len += USB_ControlRequest.wLength;
+    uint8_t number;
+    for (number = 1; pending; ++number) {
+        uint8_t mask = 1 << number;
+        if (pending & mask) {
+            UENUM = number;
+            UEIENX &= ~(1 << RXOUTE);
+            outReady |= mask;
+            pending &= ~mask;
+        }
     }
-    Serial_SendByte(E_TYPE_CONTROL);
-    Serial_SendByte(len);
-    Serial_SendData(&USB_ControlRequest, sizeof(USB_ControlRequest));
+
+    UENUM = previous;
 }
 
-#define READ_VALUE_INC(TARGET) \
-    while (value_len--) { \
-        *(TARGET++) = Serial_BlockingReceiveByte(); \
+ISR(USART1_UDRE_vect) {
+
+    uint8_t tail = txTail;
+    if (tail != txHead) {
+        UDR1 = txRing[tail & (TX_RING_SIZE - 1)];
+        txTail = ++tail;
+    }
+    if (tail == txHead) {
+        UCSR1B &= ~(1 << UDRIE1);
     }
+}
+
+static inline uint8_t serial_tx_free(void) {
+
+    return TX_RING_SIZE - (uint8_t)(txHead - txTail);
+}
+
+/*
+ * Queue a byte, and only wait if the ring is full.
+ */
+static void serial_send_byte(uint8_t byte) {
 
-#define READ_VALUE(TARGET) \
-    { \
-        uint8_t * ptr = TARGET; \
-        READ_VALUE_INC(ptr) \
+    while (serial_tx_free() == 0) {}
+
+    uint8_t head = txHead;
+    txRing[head & (TX_RING_SIZE - 1)] = byte;
+    txHead = head + 1;
+
+    UCSR1B |= (1 << UDRIE1);
+}
+
+static void serial_send_data(const void * data, uint8_t length) {
+
+    const uint8_t * ptr = data;
+    while (length--) {
+        serial_send_byte(*(ptr++));
     }
+}
+
+static inline void send_control_header(s_timestamp timestamp) {
+
+    serial_send_byte(E_TYPE_CONTROL);
+    serial_send_byte(sizeof(timestamp) + sizeof(USB_ControlRequest));
+    serial_send_data(&timestamp, sizeof(timestamp));
+    serial_send_data(&USB_ControlRequest, sizeof(USB_ControlRequest));
+}
 
 static inline void ack(const uint8_t type) {
-    Serial_SendByte(type);
-    Serial_SendByte(BYTE_LEN_0_BYTE);
+    serial_send_byte(type);
+    serial_send_byte(BYTE_LEN_0_BYTE);
+}
+
+static inline void ack_in(const uint8_t endpoint, s_timestamp timestamp) {
+    serial_send_byte(E_TYPE_IN);
+    serial_send_byte(sizeof(timestamp) + 1);
+    serial_send_data(&timestamp, sizeof(timestamp));
+    serial_send_byte(endpoint);
 }
 
 
 ISR(USART1_RX_vect) {
 
-    uint8_t packet_type = UDR1;
-    uint8_t value_len = Serial_BlockingReceiveByte();
-    static const void * labels[] = { &&l_descriptors, &&l_index, &&l_endpoints, &&l_reset, &&l_control, &&l_control_stall, &&l_in };
-    if(packet_type > E_TYPE_IN) {
+    uint8_t status = UCSR1A; // has to be read before the data register
+    uint8_t byte = UDR1;
+    if (status & (1 << FE1)) {
+        ++stats.framingErrors;
+    }
+    if (status & (1 << DOR1)) {
+        ++stats.overrunErrors;
+    }
+    if (status & (1 << UPE1)) {
+        ++stats.parityErrors;
+    }
+    uint8_t head = rxHead;
+    if ((uint8_t)(head + 1) == rxTail) {
+        ++stats.rxOverflows;
+        return;
+    }
+    rxRing[head] = byte;
+    rxHead = head + 1;
+}
+
+/*
+ * Get the buffer the value of a packet is written to, or NULL if the value has to be dropped.
+ */
+static uint8_t * get_target(uint8_t type, uint8_t length) {
+
+    switch (type) {
+    case E_TYPE_DESCRIPTORS:
+        return !descriptorsDropped && pdesc + length <= descriptors + sizeof(descriptors) ? pdesc : NULL;
+    case E_TYPE_INDEX:
+        return pindex + length <= (uint8_t *)descIndex + sizeof(descIndex) ? pindex : NULL;
+    case E_TYPE_ENDPOINTS:
+        return length <= sizeof(endpoints) ? (uint8_t *)&endpoints : NULL;
+    case E_TYPE_CONTROL:
+    case E_TYPE_CONTROL_STALL:
+    case E_TYPE_CONTROL_DATA:
+        return length <= sizeof(control) ? control : NULL;
+    case E_TYPE_HASH:
+        return length == sizeof(offeredHash) ? (uint8_t *)&offeredHash : NULL;
+    case E_TYPE_IN:
+        if (length == 0 || length > sizeof(inSlots->packet)) {
+            return NULL;
+        }
+        for (parser.slot = 0; parser.slot < IN_SLOTS; ++parser.slot) {
+            if (inSlots[parser.slot].length == 0) {
+                return (uint8_t *)&inSlots[parser.slot].packet;
+            }
+        }
+        return NULL;
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Load the set with the given hash: the baked set, or the set saved in the EEPROM.
+ */
+static bool load_descriptors(uint32_t hash) {
+
+#ifdef BAKED_DESCRIPTORS
+    if (hash == BAKED_HASH) {
+        memcpy_P(endpoints, bakedEndpoints, sizeof(endpoints));
+        useBaked = 1;
+        return true;
+    }
+#endif
+
+    s_eepromHeader header;
+    eeprom_read_block(&header, &eepromHeader, sizeof(header));
+
+    if (header.valid != EEPROM_VALID || header.hash != hash
+            || header.descriptorsSize > sizeof(descriptors) || header.indexSize > sizeof(descIndex)
+            || header.descriptorsSize + header.indexSize + sizeof(endpoints) > sizeof(eepromData)) {
+        return false;
+    }
+
+    const uint8_t * src = eepromData;
+    eeprom_read_block(descriptors, src, header.descriptorsSize);
+    src += header.descriptorsSize;
+    eeprom_read_block(descIndex, src, header.indexSize);
+    src += header.indexSize;
+    eeprom_read_block(endpoints, src, sizeof(endpoints));
+
+    pdesc = descriptors + header.descriptorsSize;
+    pindex = (uint8_t *)descIndex + header.indexSize;
+
+    return true;
+}
+
+/*
+ * Start saving the uploaded set into the EEPROM, if it fits.
+ */
+static void save_descriptors(void) {
+
+    uint16_t descriptorsSize = pdesc - descriptors;
+    uint16_t indexSize = pindex - (uint8_t *)descIndex;
+    uint16_t size = descriptorsSize + indexSize + sizeof(endpoints);
+
+    if (size > sizeof(eepromData)) {
+        return;
+    }
+
+    eepromSave.header.hash = offeredHash;
+    eepromSave.header.descriptorsSize = descriptorsSize;
+    eepromSave.header.indexSize = indexSize;
+    eepromSave.header.valid = EEPROM_VALID;
+    eepromSave.size = size;
+    eepromSave.offset = 0;
+    eepromSave.state = EEPROM_INVALIDATE;
+}
+
+static uint8_t get_saved_byte(uint16_t offset) {
+
+    uint16_t descriptorsSize = eepromSave.header.descriptorsSize;
+    uint16_t indexSize = eepromSave.header.indexSize;
+
+    if (offset < descriptorsSize) {
+        return descriptors[offset];
+    }
+    offset -= descriptorsSize;
+    if (offset < indexSize) {
+        return ((uint8_t *)descIndex)[offset];
+    }
+    return ((uint8_t *)endpoints)[offset - indexSize];
+}
+
+/*
+ * Write the next byte of the set being saved, if the EEPROM is ready.
+ */
+static void eeprom_task(void) {
+
+    if (eepromSave.state == EEPROM_IDLE || !eeprom_is_ready()) {
         return;
     }
-    goto *labels[packet_type];
-    l_descriptors:
-    READ_VALUE_INC(pdesc)
-    ack(E_TYPE_DESCRIPTORS);
-    return;
-    l_index:
-    READ_VALUE_INC(pindex)
-    ack(E_TYPE_INDEX);
-    return;
-    l_endpoints:
-    READ_VALUE((uint8_t*)&endpoints)
-    ack(E_TYPE_ENDPOINTS);
-    started = 1;
-    return;
-    l_reset:
-    forceHardReset();
-    return;
-    l_control:
-    controlReplyLen = value_len;
-    READ_VALUE(control)
-    controlReply = 1;
-    return;
-    l_control_stall:
-    READ_VALUE(control)
-    controlReply = 1;
-    controlStall = 1;
-    return;
-    l_in:
-    inputDataLen = value_len - 1;
-    READ_VALUE((uint8_t*)&input)
-    return;
+
+    switch (eepromSave.state) {
+    case EEPROM_INVALIDATE:
+        eeprom_update_byte(&eepromHeader.valid, 0xFF);
+        eepromSave.state = EEPROM_DATA;
+        break;
+    case EEPROM_DATA:
+        eeprom_update_byte(eepromData + eepromSave.offset, get_saved_byte(eepromSave.offset));
+        if (++eepromSave.offset == eepromSave.size) {
+            eepromSave.offset = 0;
+            eepromSave.state = EEPROM_HEADER;
+        }
+        break;
+    case EEPROM_HEADER:
+        eeprom_update_byte((uint8_t *)&eepromHeader + eepromSave.offset, ((uint8_t *)&eepromSave.header)[eepromSave.offset]);
+        if (++eepromSave.offset == sizeof(eepromSave.header)) {
+            eepromSave.state = EEPROM_IDLE;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void process_packet(void) {
+
+    uint8_t length = parser.length;
+    bool stored = parser.start != NULL;
+
+    switch (parser.type) {
+    case E_TYPE_DESCRIPTORS:
+        if (stored) {
+            pdesc += length;
+        } else {
+            descriptorsDropped = 1;
+        }
+        ack(E_TYPE_DESCRIPTORS);
+        break;
+    case E_TYPE_INDEX:
+        if (stored) {
+            pindex += length;
+        }
+        ack(E_TYPE_INDEX);
+        break;
+    case E_TYPE_ENDPOINTS:
+        ack(E_TYPE_ENDPOINTS);
+        if (hashOffered && !started) {
+            save_descriptors();
+        }
+        started = 1;
+        break;
+    case E_TYPE_HASH:
+        if (stored && !started) {
+            bool loaded = load_descriptors(offeredHash);
+            s_hashReply reply = { .loaded = loaded, .descriptorsSize = sizeof(descriptors) };
+            serial_send_byte(E_TYPE_HASH);
+            serial_send_byte(sizeof(reply));
+            serial_send_data(&reply, sizeof(reply));
+            hashOffered = !loaded;
+            started = loaded;
+        }
+        break;
+    case E_TYPE_RESET:
+        forceHardReset();
+        break;
+    case E_TYPE_CONTROL:
+        controlReplyLen = length;
+        controlReply = 1;
+        break;
+    case E_TYPE_CONTROL_STALL:
+        controlReply = 1;
+        controlStall = 1;
+        break;
+    case E_TYPE_IN:
+        if (stored) {
+            inSlots[parser.slot].length = length;
+        } else {
+            ++stats.droppedInPackets;
+        }
+        break;
+    case E_TYPE_CONTROL_DATA:
+        controlReplyLen = length;
+        controlFragment = 1;
+        controlReply = 1;
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Parse the bytes received by the serial interrupt.
+ * This has to be called from any loop waiting for a packet.
+ */
+static void serial_task(void) {
+
+    uint8_t tail = rxTail;
+
+    while (tail != rxHead) {
+
+        uint8_t byte = rxRing[tail++];
+        rxTail = tail;
+
+        switch (parser.state) {
+        case PARSER_TYPE:
+            parser.type = byte;
+            parser.state = PARSER_LENGTH;
+            break;
+        case PARSER_LENGTH:
+            parser.length = byte;
+            parser.remaining = byte;
+            parser.start = get_target(parser.type, byte);
+            parser.target = parser.start;
+            if (byte == 0) {
+                parser.state = PARSER_TYPE;
+                process_packet();
+            } else {
+                parser.state = PARSER_VALUE;
+            }
+            break;
+        case PARSER_VALUE:
+            if (parser.target != NULL) {
+                *(parser.target++) = byte;
+            }
+            if (--parser.remaining == 0) {
+                parser.state = PARSER_TYPE;
+                process_packet();
+            }
+            break;
+        }
+    }
 }
 
 void serial_init(void) {
@@ -147,11 +579,17 @@ void SetupHardware(void) {
 
     GlobalInterruptEnable();
 
+    // tell the host the firmware has (re)started and needs the descriptors
+    ack(E_TYPE_RESET);
+
     LEDs_Init();
 
-    while(!started) {}
+    while(!started) {
+        serial_task();
+    }
 
     TCCR1B |= (1 << CS12); // Set up timer at FCPU /256
+    TIMSK1 |= (1 << TOIE1); // Enable the overflow interrupt, to extend the timer to 32 bits
 
     USB_Init();
 }
@@ -164,31 +602,94 @@ void EVENT_USB_Device_Disconnect(void) {
 
 }
 
+/*
+ * The DPRAM is allocated in banks of a power of two bytes, from 8 bytes.
+ */
+static uint16_t get_bank_size(uint16_t size) {
+
+    uint16_t bank = 8;
+    while (bank < size) {
+        bank <<= 1;
+    }
+    return bank;
+}
+
 void EVENT_USB_Device_ConfigurationChanged(void) {
 
+    // the target host may configure the device several times (e.g. after a reboot)
+    outEndpointNumber = 0;
+    selectedOutEndpoint = 0;
+    outReady = 0;
+
+    // single banks first, the remaining DPRAM gives a second bank to the first endpoints that fit
+    uint16_t dpram = ENDPOINT_DPRAM_SIZE - USB_Device_ControlEndpointSize;
+
     uint8_t i;
     for (i = 0; i < sizeof(endpoints) / sizeof(*endpoints) && endpoints[i].number; ++i) {
-        if(endpoints[i].type == EP_TYPE_INTERRUPT) {
-            Endpoint_ConfigureEndpoint(endpoints[i].number, endpoints[i].type, endpoints[i].size, 1);
+        if(endpoints[i].type == EP_TYPE_INTERRUPT || endpoints[i].type == EP_TYPE_BULK) {
+            uint16_t bank = get_bank_size(endpoints[i].size);
+            dpram = dpram > bank ? dpram - bank : 0;
         }
-        //TODO MLA: other endpoint types
+    }
+
+    for (i = 0; i < sizeof(endpoints) / sizeof(*endpoints) && endpoints[i].number; ++i) {
+        if(endpoints[i].type == EP_TYPE_INTERRUPT || endpoints[i].type == EP_TYPE_BULK) {
+            uint8_t banks = 1;
+            uint16_t bank = get_bank_size(endpoints[i].size);
+            if (dpram >= bank) {
+                banks = 2;
+                dpram -= bank;
+            }
+            if (!Endpoint_ConfigureEndpoint(endpoints[i].number, endpoints[i].type, endpoints[i].size, banks) && banks == 2) {
+                Endpoint_ConfigureEndpoint(endpoints[i].number, endpoints[i].type, endpoints[i].size, 1);
+            }
+        }
+        //TODO MLA: isochronous endpoints
         if((endpoints[i].number & ENDPOINT_DIR_MASK) == ENDPOINT_DIR_OUT) {
             outEndpoints[outEndpointNumber++] = i;
         }
     }
+
+    // configuring an endpoint clears its interrupt enables, so the OUT interrupts are enabled once all are configured
+    for (i = 0; i < outEndpointNumber; ++i) {
+        s_endpointConfig * endpoint = endpoints + outEndpoints[i];
+        if(endpoint->type == EP_TYPE_INTERRUPT || endpoint->type == EP_TYPE_BULK) {
+            Endpoint_SelectEndpoint(endpoint->number);
+            UEIENX |= (1 << RXOUTE);
+        }
+    }
 }
 
 uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue, const uint16_t wIndex,
-        const void** const DescriptorAddress) {
+        const void** const DescriptorAddress
+#ifdef BAKED_DESCRIPTORS
+        , uint8_t* const DescriptorMemorySpace
+#endif
+        ) {
 
     uint8_t i;
     for (i = 0; i < sizeof(descIndex) / sizeof(*descIndex) && descIndex[i].wValue; ++i) {
-        if(wValue == descIndex[i].wValue && wIndex == descIndex[i].wIndex) {
+        if(wValue == descIndex[i].wValue && wIndex == descIndex[i].wIndex
+                && descIndex[i].offset + descIndex[i].wLength <= pdesc - descriptors) {
             *DescriptorAddress = descriptors + descIndex[i].offset;
+#ifdef BAKED_DESCRIPTORS
+            *DescriptorMemorySpace = MEMSPACE_RAM;
+#endif
             return descIndex[i].wLength;
         }
     }
 
+#ifdef BAKED_DESCRIPTORS
+    for (i = 0; useBaked && i < sizeof(bakedIndex) / sizeof(*bakedIndex); ++i) {
+        if(wValue == pgm_read_word(&bakedIndex[i].wValue) && wIndex == pgm_read_word(&bakedIndex[i].wIndex)) {
+            *DescriptorAddress = bakedDescriptors + pgm_read_word(&bakedIndex[i].offset);
+            *DescriptorMemorySpace = MEMSPACE_FLASH;
+            return pgm_read_word(&bakedIndex[i].wLength);
+        }
+    }
+#endif
+
+    // not uploaded: the request is forwarded to the host, see EVENT_USB_Device_UnhandledControlRequest
     return 0;
 }
 
@@ -197,91 +698,292 @@ bool EVENT_USB_Device_ControlRequest(void) {
     return false;
 }
 
-bool EVENT_USB_Device_UnhandledControlRequest(void) {
+static inline bool control_aborted(void) {
 
-    if (USB_ControlRequest.wLength > MAX_CONTROL_TRANSFER_SIZE) {
-        Serial_SendByte(E_TYPE_DEBUG);
-        Serial_SendByte(sizeof(USB_ControlRequest));
-        Serial_SendData(&USB_ControlRequest, sizeof(USB_ControlRequest));
-        return false;
+    uint8_t state = USB_DeviceState;
+    return state == DEVICE_STATE_Unattached || state == DEVICE_STATE_Suspended || Endpoint_IsSETUPReceived();
+}
+
+static void wait_control_reply(void) {
+
+    controlWaitStart = TCNT1;
+    controlState = CONTROL_WAIT_REPLY;
+}
+
+/*
+ * Tell the host how long the control request took.
+ */
+static void end_control(uint8_t status) {
+
+    controlTiming.status = status;
+    controlTiming.total = TCNT1 - controlStart;
+
+    serial_send_byte(E_TYPE_CONTROL_TIMING);
+    serial_send_byte(sizeof(controlTiming));
+    serial_send_data(&controlTiming, sizeof(controlTiming));
+
+    controlState = CONTROL_IDLE;
+}
+
+/*
+ * Forward a packet of the data stage of a control OUT transfer to the host.
+ */
+static void forward_control_data(void) {
+
+    if (!Endpoint_IsOUTReceived() || serial_tx_free() < sizeof(s_header) + USB_Device_ControlEndpointSize) {
+        return;
     }
 
-    controlReply = 0;
-    controlStall = 0;
+    uint8_t length = Endpoint_BytesInEndpoint();
+    if (length > controlRemaining) {
+        length = controlRemaining;
+    }
+    controlRemaining -= length;
 
-    if (USB_ControlRequest.bmRequestType & REQDIR_DEVICETOHOST) {
-        send_control_header();
-    } else {
-        static uint8_t buffer[MAX_CONTROL_TRANSFER_SIZE];
-        Endpoint_ClearSETUP();
-        uint8_t ErrorCode =  Endpoint_Read_Control_Stream_LE(buffer, USB_ControlRequest.wLength);
-        if (ErrorCode != ENDPOINT_RWSTREAM_NoError) {
-            Endpoint_StallTransaction();
-            return true;
+    serial_send_byte(E_TYPE_CONTROL_DATA);
+    serial_send_byte(length);
+    while (length--) {
+        serial_send_byte(Endpoint_Read_8());
+    }
+
+    Endpoint_ClearOUT();
+
+    if (controlRemaining == 0) {
+        wait_control_reply();
+    }
+}
+
+/*
+ * Write the reply fragment into the data stage of a control IN transfer, as far as the endpoint allows.
+ * Full packets are sent right away, the last packet is sent in the status stage.
+ * Returns true once the fragment is consumed.
+ */
+static bool write_control_data(void) {
+
+    if (Endpoint_IsOUTReceived()) {
+        return true; // the target host ended the data stage
+    }
+
+    if (Endpoint_IsINReady()) {
+
+        uint16_t bytesInEndpoint = Endpoint_BytesInEndpoint();
+
+        while (controlOffset < controlReplyLen && controlDataLength < USB_ControlRequest.wLength
+                && bytesInEndpoint < USB_Device_ControlEndpointSize) {
+            Endpoint_Write_8(control[controlOffset++]);
+            ++controlDataLength;
+            ++bytesInEndpoint;
+        }
+
+        if (bytesInEndpoint == USB_Device_ControlEndpointSize) {
+            Endpoint_ClearIN();
         }
-        send_control_header();
-        Serial_SendData(buffer, USB_ControlRequest.wLength);
     }
 
-    TCNT1 = 0;
-    while (!controlReply && TCNT1 < 3125) {} // wait up to 50 ms
+    return controlOffset == controlReplyLen || controlDataLength == USB_ControlRequest.wLength;
+}
+
+/*
+ * Process the reply of the host.
+ */
+static void process_control_reply(void) {
 
     if (!controlReply) {
-      Endpoint_ClearSETUP();
-      Endpoint_ClearStatusStage();
-      return true;
+        if ((uint16_t)(TCNT1 - controlWaitStart) >= CONTROL_TIMEOUT) {
+            if (controlDataLength || (USB_ControlRequest.bmRequestType & REQDIR_DEVICETOHOST)) {
+                Endpoint_StallTransaction();
+            } else {
+                Endpoint_ClearIN();
+            }
+            ++stats.controlTimeouts;
+            end_control(E_CONTROL_TIMEOUT);
+        }
+        return;
+    }
+
+    if (controlTiming.reply == 0) {
+        controlTiming.reply = TCNT1 - controlStart;
     }
 
     if (controlStall) {
-        Endpoint_ClearSETUP();
         Endpoint_StallTransaction();
-        return true;
+        end_control(E_CONTROL_STALLED);
+        return;
+    }
+
+    if (!(USB_ControlRequest.bmRequestType & REQDIR_DEVICETOHOST)) {
+        Endpoint_ClearIN();
+        end_control(E_CONTROL_COMPLETED);
+        return;
     }
 
-    if(USB_ControlRequest.bmRequestType & REQDIR_DEVICETOHOST) {
-        Endpoint_ClearSETUP();
-        Endpoint_Write_Control_Stream_LE(control, controlReplyLen);
+    controlOffset = 0;
+    controlState = CONTROL_IN_DATA;
+}
+
+/*
+ * Send the last packet of the data stage (a zero-length packet if the data stage
+ * ends with a full packet before wLength bytes), and complete the status stage.
+ */
+static void end_control_data(void) {
+
+    if (Endpoint_IsOUTReceived()) {
         Endpoint_ClearOUT();
+        end_control(E_CONTROL_COMPLETED);
+        return;
+    }
+
+    if (controlFlush && Endpoint_IsINReady()) {
+        if (Endpoint_BytesInEndpoint() || controlDataLength < USB_ControlRequest.wLength) {
+            Endpoint_ClearIN();
+        }
+        controlFlush = false;
+    }
+}
+
+bool EVENT_USB_Device_UnhandledControlRequest(void) {
+
+    // a new SETUP packet aborts the request in progress, whose timing is reported before it is overwritten
+    if (controlState != CONTROL_IDLE) {
+        end_control(E_CONTROL_ABORTED);
+    }
+
+    s_timestamp timestamp = get_timestamp();
+
+    controlStart = timestamp;
+
+    controlReply = 0;
+    controlStall = 0;
+    controlFragment = 0;
+    controlDataLength = 0;
+
+    controlTiming.bmRequestType = USB_ControlRequest.bmRequestType;
+    controlTiming.bRequest = USB_ControlRequest.bRequest;
+    controlTiming.reply = 0;
+
+    send_control_header(timestamp);
+
+    Endpoint_ClearSETUP();
+
+    if (!(USB_ControlRequest.bmRequestType & REQDIR_DEVICETOHOST) && USB_ControlRequest.wLength) {
+        controlRemaining = USB_ControlRequest.wLength;
+        controlState = CONTROL_OUT_DATA;
     } else {
-        Endpoint_ClearIN();
+        wait_control_reply();
     }
 
     return true;
 }
 
+/*
+ * Advance the control request forwarded to the host, without waiting.
+ */
+static void control_task(void) {
+
+    if (controlState == CONTROL_IDLE) {
+        return;
+    }
+
+    Endpoint_SelectEndpoint(ENDPOINT_CONTROLEP);
+
+    if (control_aborted()) {
+        end_control(E_CONTROL_ABORTED);
+        return;
+    }
+
+    switch (controlState) {
+    case CONTROL_OUT_DATA:
+        forward_control_data();
+        break;
+    case CONTROL_WAIT_REPLY:
+        process_control_reply();
+        break;
+    case CONTROL_IN_DATA:
+        if (write_control_data()) {
+            if (controlFragment) {
+                controlFragment = 0;
+                controlReply = 0;
+                ack(E_TYPE_CONTROL_DATA); // request the next fragment
+                wait_control_reply();
+            } else {
+                controlFlush = true;
+                controlState = CONTROL_STATUS;
+            }
+        }
+        break;
+    case CONTROL_STATUS:
+        end_control_data();
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Move the queued IN packets into their endpoints, and ack each one as soon as it is in a bank,
+ * so that the host can send the next packet while the target host reads the previous one.
+ */
 void SendNextInput(void) {
 
-    if (input.endpoint) {
+    uint8_t i;
+    for (i = 0; i < IN_SLOTS; ++i) {
+
+        if (inSlots[i].length == 0) {
+            continue;
+        }
 
-        Endpoint_SelectEndpoint(input.endpoint);
+        uint8_t endpoint = inSlots[i].packet.endpoint;
+
+        Endpoint_SelectEndpoint(endpoint);
 
         if (Endpoint_IsINReady()) {
 
-            Endpoint_Write_Stream_LE(input.data, inputDataLen, NULL);
+            Endpoint_Write_Stream_LE(inSlots[i].packet.data, inSlots[i].length - 1, NULL);
 
             Endpoint_ClearIN();
 
-            input.endpoint = 0;
+            s_timestamp timestamp = get_timestamp();
+
+            inSlots[i].length = 0;
 
-            ack(E_TYPE_IN);
+            ack_in(endpoint, timestamp);
         }
     }
 }
 
+/*
+ * Forward the packets of all the OUT endpoints flagged by the endpoint interrupt.
+ */
 void ReceiveNextOutput(void) {
 
-    if (outEndpointNumber > 0) {
+    static struct {
+        struct {
+            uint8_t type;
+            uint8_t length;
+        } header;
+        s_timestamp timestamp;
+        s_endpointPacket value;
+    } packet = { .header.type = E_TYPE_OUT };
 
-        static struct {
-            struct {
-                uint8_t type;
-                uint8_t length;
-            } header;
-            s_endpointPacket value;
-        } packet = { .header.type = E_TYPE_OUT };
+    uint8_t n;
+    for (n = 0; n < outEndpointNumber && outReady; ++n) {
 
-        s_endpointConfig * endpoint = endpoints + outEndpoints[selectedOutEndpoint++];
-        if (selectedOutEndpoint == outEndpointNumber) {
+        s_endpointConfig * endpoint = endpoints + outEndpoints[selectedOutEndpoint];
+        uint8_t mask = 1 << (endpoint->number & ENDPOINT_EPNUM_MASK);
+
+        if (!(outReady & mask)) {
+            if (++selectedOutEndpoint == outEndpointNumber) {
+                selectedOutEndpoint = 0;
+            }
+            continue;
+        }
+
+        // leave the data in the endpoint (NAKing the host) until the packet can be queued without waiting
+        if (serial_tx_free() < sizeof(packet.header) + sizeof(packet.timestamp) + 1 + endpoint->size) {
+            return;
+        }
+
+        if (++selectedOutEndpoint == outEndpointNumber) {
             selectedOutEndpoint = 0;
         }
 
@@ -302,14 +1004,75 @@ void ReceiveNextOutput(void) {
 
             Endpoint_ClearOUT();
 
+            packet.timestamp = get_timestamp();
+
             if (length) {
-                packet.header.length = length + 1;
-                Serial_SendData(&packet, sizeof(packet.header) + packet.header.length);
+                packet.header.length = sizeof(packet.timestamp) + 1 + length;
+                serial_send_data(&packet, sizeof(packet.header) + packet.header.length);
             }
         }
+
+        // the interrupt fires again right away if the other bank already holds a packet
+        uint8_t sreg = SREG;
+        cli();
+        outReady &= ~mask;
+        SREG = sreg;
+        UEIENX |= (1 << RXOUTE);
+    }
+}
+
+/*
+ * Count the sampling periods in which the NAK flag of an endpoint got set:
+ * for an IN endpoint the target host polled an empty endpoint, for an OUT endpoint the firmware is too slow.
+ */
+static void count_naks(uint16_t now) {
+
+    if (USB_DeviceState != DEVICE_STATE_Configured || (uint16_t)(now - nakSampleStart) < NAK_SAMPLE_PERIOD) {
+        return;
+    }
+
+    nakSampleStart = now;
+
+    uint8_t i;
+    for (i = 0; i < sizeof(endpoints) / sizeof(*endpoints) && endpoints[i].number; ++i) {
+        Endpoint_SelectEndpoint(endpoints[i].number);
+        uint8_t flag = (endpoints[i].number & ENDPOINT_DIR_MASK) == ENDPOINT_DIR_IN ? (1 << NAKINI) : (1 << NAKOUTI);
+        if (UEINTX & flag) {
+            UEINTX = ~flag; // writing 1 to the other flags has no effect
+            ++stats.naks[i].count;
+        }
     }
 }
 
+/*
+ * Send the statistics once per period, if the serial link has room for them.
+ */
+static void stats_task(uint16_t now) {
+
+    if ((uint16_t)(now - statsStart) < STATS_PERIOD || serial_tx_free() < sizeof(s_header) + sizeof(stats)) {
+        return;
+    }
+
+    statsStart = now;
+
+    s_firmwareStats report;
+
+    uint8_t sreg = SREG;
+    cli();
+    report = stats;
+    memset(&stats, 0x00, sizeof(stats));
+    SREG = sreg;
+
+    uint8_t i;
+    for (i = 0; i < sizeof(endpoints) / sizeof(*endpoints); ++i) {
+        report.naks[i].endpoint = endpoints[i].number;
+    }
+
+    serial_send_byte(E_TYPE_STATS);
+    serial_send_byte(sizeof(report));
+    serial_send_data(&report, sizeof(report));
+}
+
 void ENDPOINT_Task(void) {
 
     if (USB_DeviceState != DEVICE_STATE_Configured) {
@@ -325,8 +1088,22 @@ int main(void) {
 
     SetupHardware();
 
+    uint16_t loopStart = TCNT1;
+
     for (;;) {
+        serial_task();
+        control_task();
         ENDPOINT_Task();
         USB_USBTask();
+        eeprom_task();
+
+        uint16_t now = TCNT1;
+        if ((uint16_t)(now - loopStart) > stats.maxLoopTime) {
+            stats.maxLoopTime = now - loopStart;
+        }
+        loopStart = now;
+
+        count_naks(now);
+        stats_task(now);
     }
 }
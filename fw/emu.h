@@ -9,6 +9,7 @@
 #include <avr/io.h>
 #include <avr/wdt.h>
 #include <avr/power.h>
+#include <avr/eeprom.h>
 #include <stdbool.h>
 #include <string.h>
 
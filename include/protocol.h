@@ -47,18 +47,99 @@ typedef struct PACKED {
   uint8_t data[MAX_PAYLOAD_SIZE_EP];
 } s_endpointPacket; // should not exceed 255 bytes
 
+/*
+ * The firmware queues up to IN_SLOTS E_TYPE_IN packets, at most one per endpoint,
+ * and acks each one with an E_TYPE_IN packet holding a timestamp and the endpoint, once it is written into the endpoint.
+ */
+#define IN_SLOTS 3
+
 typedef enum {
   E_TYPE_DESCRIPTORS,
   E_TYPE_INDEX,
   E_TYPE_ENDPOINTS,
-  E_TYPE_RESET,
+  E_TYPE_RESET, // host -> firmware: reset request, firmware -> host: (re)start notification
   E_TYPE_CONTROL,
   E_TYPE_CONTROL_STALL,
   E_TYPE_IN,
   E_TYPE_OUT,
   E_TYPE_DEBUG,
+  E_TYPE_CONTROL_DATA,
+  E_TYPE_CONTROL_TIMING,
+  E_TYPE_HASH,
+  E_TYPE_STATS,
 } e_packetType;
 
+/*
+ * Before uploading the descriptors, the host sends the 32-bit hash of the descriptors, the index and the endpoints
+ * in an E_TYPE_HASH packet. If the firmware has the same set in its EEPROM, it loads it and replies with an
+ * E_TYPE_HASH packet holding 1, and the upload is skipped. Otherwise it replies with 0, the host uploads the set,
+ * and the firmware saves it with the hash once the endpoints are received.
+ * The reply also holds the size of the descriptor buffer of the firmware: if the set doesn't fit, the host builds
+ * a smaller set and sends its hash again. The descriptors that are not uploaded are requested on demand.
+ */
+typedef struct PACKED {
+  uint8_t loaded;
+  uint16_t descriptorsSize;
+} s_hashReply;
+
+/*
+ * Control transfers are not limited by the packet size:
+ * - firmware -> host: E_TYPE_CONTROL carries the setup packet, and the data stage of an OUT transfer
+ *   follows in E_TYPE_CONTROL_DATA packets (one per control endpoint packet), until wLength bytes are sent.
+ * - host -> firmware: the data stage of an IN transfer is split into E_TYPE_CONTROL_DATA packets,
+ *   and the last part is sent in an E_TYPE_CONTROL packet. The firmware acks each E_TYPE_CONTROL_DATA
+ *   packet with an empty E_TYPE_CONTROL_DATA packet, once it is written into the control endpoint.
+ */
+
+// the firmware timer runs at 16 MHz / 256
+#define TIMER_TICK_US 16
+
+/*
+ * firmware -> host: the E_TYPE_OUT and E_TYPE_CONTROL packets, and the E_TYPE_IN acks,
+ * start with the firmware time of the event, in TIMER_TICK_US units since the firmware started.
+ * It wraps around after about 19 hours.
+ * - E_TYPE_OUT: the packet was read from the endpoint
+ * - E_TYPE_CONTROL: the setup packet was received
+ * - E_TYPE_IN: the packet was written into the endpoint
+ */
+typedef uint32_t s_timestamp;
+
+typedef enum {
+  E_CONTROL_COMPLETED,
+  E_CONTROL_STALLED,
+  E_CONTROL_TIMEOUT, // the host did not reply in time
+  E_CONTROL_ABORTED, // a new setup packet was received, or the device was suspended or detached
+} e_controlStatus;
+
+/*
+ * firmware -> host: sent at the end of each control request forwarded to the host.
+ * The times are in TIMER_TICK_US units, and wrap around after about 1 second.
+ */
+typedef struct PACKED {
+  uint8_t bmRequestType;
+  uint8_t bRequest;
+  uint8_t status; // e_controlStatus
+  uint16_t reply; // from the setup packet to the first reply of the host
+  uint16_t total; // from the setup packet to the end of the status stage
+} s_controlTiming;
+
+/*
+ * firmware -> host: sent every second, the counters are reset after each report.
+ */
+typedef struct PACKED {
+  uint16_t framingErrors; // USART
+  uint16_t overrunErrors; // USART
+  uint16_t parityErrors; // USART
+  uint16_t rxOverflows; // bytes dropped because the serial receive ring was full
+  uint16_t droppedInPackets; // E_TYPE_IN packets without a free slot
+  uint16_t controlTimeouts; // the host did not reply in time
+  uint16_t maxLoopTime; // longest main loop iteration, in TIMER_TICK_US units
+  struct PACKED {
+    uint8_t endpoint; // 0 means unused
+    uint16_t count; // 1 ms periods in which the NAK flag got set (NAK IN: no data, NAK OUT: no free bank)
+  } naks[MAX_ENDPOINTS];
+} s_firmwareStats;
+
 #define BYTE_LEN_0_BYTE   0x00
 #define BYTE_LEN_1_BYTE   0x01
 
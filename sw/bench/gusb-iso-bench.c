@@ -0,0 +1,340 @@
+/*
+ Copyright (c) 2016 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+/*
+ * Benchmark of the isochronous transfers of gusb, without the proxy and the serial link.
+ * The IN endpoint is kept streaming, and the OUT endpoint is kept fed with packets of zeros.
+ * The packet rate, the bandwidth and the packet errors are printed every second.
+ */
+
+#include <gusb.h>
+#include <gpoll.h>
+#include <gtimer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+
+#define OUT_PACKETS 8 // packets per write
+#define OUT_WRITES 4 // writes kept queued
+
+typedef struct {
+  unsigned int packets;
+  unsigned long long bytes;
+  unsigned int empty;
+  unsigned int errors;
+} s_counters;
+
+static unsigned short vendor = 0;
+static unsigned short product = 0;
+static int interface = -1;
+static int altSetting = 0;
+static unsigned char in = 0;
+static unsigned char out = 0;
+static unsigned int duration = 10; // seconds
+static int eventThreadCpu = -2;
+
+static int usb = -1;
+static volatile int done = 0;
+
+static unsigned int outSize = 0; // bytes per write
+static unsigned char * outBuffer = NULL;
+static unsigned int outPackets = 0; // completed packets of the current write
+
+static s_counters second[2]; // in, out
+static s_counters total[2];
+static unsigned int seconds = 0;
+
+static void usage() {
+
+  printf("Usage: sudo gusb-iso-bench --device vid:pid [--alt interface:setting] [--in endpoint] [--out endpoint]"
+      " [--duration seconds] [--event-thread[=cpu]]\n");
+}
+
+static int args_read(int argc, char * argv[]) {
+
+  struct option long_options[] = {
+    { "help", no_argument, 0, 'h' },
+    { "device", required_argument, 0, 'd' },
+    { "alt", required_argument, 0, 'a' },
+    { "in", required_argument, 0, 'i' },
+    { "out", required_argument, 0, 'o' },
+    { "duration", required_argument, 0, 'D' },
+    { "event-thread", optional_argument, 0, 't' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "a:d:D:hi:o:t::", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'a':
+      if (sscanf(optarg, "%d:%d", &interface, &altSetting) != 2) {
+        usage();
+        return -1;
+      }
+      break;
+    case 'd':
+      if (sscanf(optarg, "%hx:%hx", &vendor, &product) != 2) {
+        usage();
+        return -1;
+      }
+      break;
+    case 'D':
+      duration = strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+      usage();
+      exit(0);
+    case 'i':
+      in = strtoul(optarg, NULL, 16) | USB_DIR_IN;
+      break;
+    case 'o':
+      out = strtoul(optarg, NULL, 16) & ~USB_DIR_IN;
+      break;
+    case 't':
+      eventThreadCpu = optarg != NULL ? atoi(optarg) : -1;
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (vendor == 0 || (in == 0 && out == 0)) {
+    usage();
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Packets of isochronous endpoints can be up to 3 transactions per microframe.
+ */
+static unsigned int get_packet_size(unsigned char address) {
+
+  s_usb_descriptors * descriptors = gusb_get_usb_descriptors(usb);
+
+  unsigned int i;
+  for (i = 0; i < descriptors->nbEndpoints; ++i) {
+    struct p_endpoint * pEndpoint = descriptors->endpoints + i;
+    if (pEndpoint->configurationIndex != 0 || pEndpoint->descriptor->bEndpointAddress != address) {
+      continue;
+    }
+    struct p_altInterface * pAltInterface = descriptors->configurations[0].interfaces[pEndpoint->interfaceIndex].altInterfaces
+        + pEndpoint->altInterfaceIndex;
+    if (interface >= 0 && (pAltInterface->descriptor->bInterfaceNumber != interface
+        || pAltInterface->descriptor->bAlternateSetting != altSetting)) {
+      continue;
+    }
+    if ((pEndpoint->descriptor->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) != USB_ENDPOINT_XFER_ISOC) {
+      fprintf(stderr, "endpoint 0x%02x is not isochronous\n", address);
+      return 0;
+    }
+    unsigned short wMaxPacketSize = pEndpoint->descriptor->wMaxPacketSize;
+    return (wMaxPacketSize & 0x07ff) * (1 + ((wMaxPacketSize >> 11) & 0x03));
+  }
+
+  fprintf(stderr, "endpoint 0x%02x not found\n", address);
+  return 0;
+}
+
+static void count_packet(s_counters * counters, int status) {
+
+  if (status < 0) {
+    ++counters->errors;
+    return;
+  }
+  ++counters->packets;
+  counters->bytes += status;
+  if (status == 0) {
+    ++counters->empty;
+  }
+}
+
+static int usb_read_callback(int user, unsigned char endpoint, const void * buf, int status) {
+
+  count_packet(second, status);
+
+  return 0;
+}
+
+static int usb_write_callback(int user, unsigned char endpoint, int status) {
+
+  if (endpoint == 0) {
+    return 0;
+  }
+
+  count_packet(second + 1, status);
+
+  if (++outPackets == OUT_PACKETS) {
+    outPackets = 0;
+    if (!done && gusb_write(usb, out, outBuffer, outSize) < 0) {
+      done = 1;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int usb_close_callback(int user) {
+
+  done = 1;
+  return 1;
+}
+
+static void print_counters(const char * name, const s_counters * counters, unsigned int elapsed) {
+
+  printf("%s: %u packets (%u/s), %llu bytes (%.1f kB/s), %u empty, %u errors\n", name, counters->packets,
+      counters->packets / elapsed, counters->bytes, counters->bytes / 1000.0 / elapsed, counters->empty, counters->errors);
+}
+
+static int timer_read(int user) {
+
+  ++seconds;
+
+  unsigned int i;
+  for (i = 0; i < 2; ++i) {
+    if (i == 0 ? in != 0 : out != 0) {
+      print_counters(i == 0 ? "IN" : "OUT", second + i, 1);
+    }
+    total[i].packets += second[i].packets;
+    total[i].bytes += second[i].bytes;
+    total[i].empty += second[i].empty;
+    total[i].errors += second[i].errors;
+  }
+  memset(second, 0x00, sizeof(second));
+
+  if (seconds == duration) {
+    done = 1;
+  }
+
+  return done;
+}
+
+static int timer_close(int user) {
+
+  done = 1;
+  return 1;
+}
+
+static void print_endpoint_stats(unsigned char endpoint, const s_gusb_endpoint_stats * stats) {
+
+  printf("endpoint 0x%02x: %u packets submitted, %u packets completed (%llu bytes), %u timeouts, %u errors, %u cancelled\n",
+      endpoint, stats->submitted, stats->completed, stats->bytes, stats->timeouts, stats->errors, stats->cancelled);
+}
+
+static void terminate(int sig) {
+
+  done = 1;
+}
+
+static int start() {
+
+  if (interface >= 0 && gusb_set_alt_setting(usb, interface, altSetting) < 0) {
+    return -1;
+  }
+
+  if (out != 0) {
+    unsigned int packetSize = get_packet_size(out);
+    if (packetSize == 0) {
+      return -1;
+    }
+    outSize = packetSize * OUT_PACKETS;
+    outBuffer = calloc(outSize, sizeof(unsigned char));
+    if (outBuffer == NULL) {
+      fprintf(stderr, "calloc failed\n");
+      return -1;
+    }
+  }
+
+  if (in != 0 && get_packet_size(in) == 0) {
+    return -1;
+  }
+
+  if (eventThreadCpu >= -1 && gusb_start_event_thread(eventThreadCpu) < 0) {
+    return -1;
+  }
+
+  if (gusb_register(usb, 0, usb_read_callback, usb_write_callback, usb_close_callback, gpoll_register_fd) < 0) {
+    return -1;
+  }
+
+  if (in != 0 && gusb_poll(usb, in) < 0) {
+    return -1;
+  }
+
+  unsigned int i;
+  for (i = 0; out != 0 && i < OUT_WRITES; ++i) {
+    if (gusb_write(usb, out, outBuffer, outSize) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int main(int argc, char * argv[]) {
+
+  (void) signal(SIGINT, terminate);
+  (void) signal(SIGTERM, terminate);
+
+  if (args_read(argc, argv) < 0) {
+    return -1;
+  }
+
+  usb = gusb_open_ids(vendor, product);
+  if (usb < 0) {
+    fprintf(stderr, "can't open device %04x:%04x\n", vendor, product);
+    return -1;
+  }
+
+  int ret = start();
+
+  int timer = -1;
+  if (ret == 0) {
+    timer = gtimer_start(0, 1000000, timer_read, timer_close, gpoll_register_fd);
+    if (timer < 0) {
+      ret = -1;
+    }
+  }
+
+  while (ret == 0 && !done) {
+    gpoll();
+  }
+
+  if (timer >= 0) {
+    gtimer_close(timer);
+  }
+
+  s_gusb_stats stats;
+  int hasStats = (gusb_get_stats(usb, &stats) == 0);
+
+  gusb_close(usb);
+  free(outBuffer);
+
+  if (seconds > 0) {
+    printf("total over %us:\n", seconds);
+    if (in != 0) {
+      print_counters("IN", total, seconds);
+    }
+    if (out != 0) {
+      print_counters("OUT", total + 1, seconds);
+    }
+  }
+
+  if (hasStats) {
+    if (in != 0) {
+      print_endpoint_stats(in, stats.in + (in & USB_ENDPOINT_NUMBER_MASK) - 1);
+    }
+    if (out != 0) {
+      print_endpoint_stats(out, stats.out + (out & USB_ENDPOINT_NUMBER_MASK) - 1);
+    }
+  }
+
+  return ret;
+}
@@ -0,0 +1,535 @@
+/*
+ Copyright (c) 2016 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+/*
+ * Benchmark of the hidraw backend of gusb against a virtual HID device created through /dev/uhid,
+ * so that it needs no hardware (the uhid module has to be loaded).
+ *
+ * The device runs in its own thread, like a real device would run on its own: hidraw feature requests
+ * block until it replies. It sends a 64-byte input report every period, holding a sequence number
+ * and a CLOCK_MONOTONIC timestamp, and timestamps the output reports it receives.
+ * The benchmark keeps the IN endpoint polled, writes an output report for each input report,
+ * and gets a feature report every 100ms. The latencies are measured from one side to the other.
+ */
+
+#include "../lib/gasync/src/usb/gusbhid.h"
+#include <gtimer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <linux/uhid.h>
+
+#define REPORT_SIZE 64
+
+#define IN_ENDPOINT 0x81
+#define OUT_ENDPOINT 0x02
+
+#define CONTROL_PERIOD 100000 // microseconds
+
+#define NODE_TIMEOUT 2000 // milliseconds to wait for the hidraw node
+
+// vendor-defined 64-byte input, output and feature reports, without report IDs
+static const unsigned char reportDescriptor[] = {
+  0x06, 0x00, 0xff, 0x09, 0x01, 0xa1, 0x01,
+  0x15, 0x00, 0x26, 0xff, 0x00, 0x75, 0x08, 0x95, REPORT_SIZE,
+  0x09, 0x01, 0x81, 0x02,
+  0x09, 0x01, 0x91, 0x02,
+  0x09, 0x01, 0xb1, 0x02,
+  0xc0,
+};
+
+typedef struct {
+  unsigned int count;
+  unsigned long long sum; // nanoseconds
+  unsigned long long max;
+} s_latency;
+
+static unsigned int period = 1000; // microseconds
+static unsigned int duration = 10; // seconds
+
+static volatile int done = 0;
+
+static char uniq[64];
+
+static struct {
+  int fd; // /dev/uhid
+  int timer;
+  uint32_t sequence;
+  unsigned int outputs;
+  s_latency out; // from gusbhid_write to the uhid output event
+  unsigned int features;
+  unsigned int errors;
+} device = { .fd = -1, .timer = -1 };
+
+static struct {
+  uint32_t nextSequence;
+  unsigned int reports;
+  unsigned int lost;
+  s_latency in; // from the uhid input event to the read callback
+  int controlPending;
+  unsigned long long controlStart;
+  unsigned int stalls;
+  s_latency control; // from gusbhid_control to its completion
+  unsigned int errors;
+} host = { };
+
+static unsigned int seconds = 0;
+
+static unsigned long long now() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void add_latency(s_latency * latency, unsigned long long value) {
+
+  ++latency->count;
+  latency->sum += value;
+  if (value > latency->max) {
+    latency->max = value;
+  }
+}
+
+static void print_latency(const char * name, const s_latency * latency) {
+
+  if (latency->count == 0) {
+    return;
+  }
+
+  printf("%s latency: %u, average %lluus, max %lluus\n", name, latency->count, latency->sum / latency->count / 1000,
+      latency->max / 1000);
+}
+
+static void write_stamp(unsigned char * report, uint32_t sequence) {
+
+  unsigned long long stamp = now();
+  memcpy(report, &sequence, sizeof(sequence));
+  memcpy(report + sizeof(sequence), &stamp, sizeof(stamp));
+}
+
+static void read_stamp(const unsigned char * report, uint32_t * sequence, unsigned long long * stamp) {
+
+  memcpy(sequence, report, sizeof(*sequence));
+  memcpy(stamp, report + sizeof(*sequence), sizeof(*stamp));
+}
+
+static void usage() {
+
+  printf("Usage: sudo hidraw-uhid-bench [--period us] [--duration seconds]\n");
+}
+
+static int args_read(int argc, char * argv[]) {
+
+  struct option long_options[] = {
+    { "help", no_argument, 0, 'h' },
+    { "period", required_argument, 0, 'p' },
+    { "duration", required_argument, 0, 'D' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "D:hp:", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'D':
+      duration = strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+      usage();
+      exit(0);
+    case 'p':
+      period = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (period == 0) {
+    usage();
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Device side.
+ */
+
+static int uhid_write(const struct uhid_event * event) {
+
+  if (write(device.fd, event, sizeof(*event)) != sizeof(*event)) {
+    fprintf(stderr, "uhid write failed: %m\n");
+    ++device.errors;
+    return -1;
+  }
+  return 0;
+}
+
+static int device_create() {
+
+  device.fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+  if (device.fd < 0) {
+    fprintf(stderr, "can't open /dev/uhid: %m\n");
+    return -1;
+  }
+
+  struct uhid_event event = { .type = UHID_CREATE2 };
+  snprintf((char *) event.u.create2.name, sizeof(event.u.create2.name), "serialusb uhid bench");
+  snprintf((char *) event.u.create2.uniq, sizeof(event.u.create2.uniq), "%s", uniq);
+  event.u.create2.rd_size = sizeof(reportDescriptor);
+  event.u.create2.bus = BUS_USB;
+  event.u.create2.vendor = 0x1234;
+  event.u.create2.product = 0x0002;
+  memcpy(event.u.create2.rd_data, reportDescriptor, sizeof(reportDescriptor));
+
+  return uhid_write(&event);
+}
+
+static void device_destroy() {
+
+  if (device.fd >= 0) {
+    struct uhid_event event = { .type = UHID_DESTROY };
+    uhid_write(&event);
+    close(device.fd);
+    device.fd = -1;
+  }
+}
+
+static void device_send_input() {
+
+  struct uhid_event event = { .type = UHID_INPUT2 };
+  event.u.input2.size = REPORT_SIZE;
+  write_stamp(event.u.input2.data, device.sequence++);
+  uhid_write(&event);
+}
+
+static void device_process_event() {
+
+  struct uhid_event event;
+  ssize_t ret = read(device.fd, &event, sizeof(event));
+  if (ret < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      fprintf(stderr, "uhid read failed: %m\n");
+      ++device.errors;
+    }
+    return;
+  }
+
+  switch (event.type) {
+  case UHID_OUTPUT:
+    // the data starts with the report ID, which is 0 as the device has no report IDs
+    if (event.u.output.size >= 1 + sizeof(uint32_t) + sizeof(unsigned long long)) {
+      uint32_t sequence;
+      unsigned long long stamp;
+      read_stamp(event.u.output.data + 1, &sequence, &stamp);
+      add_latency(&device.out, now() - stamp);
+      ++device.outputs;
+    }
+    break;
+  case UHID_GET_REPORT:
+    {
+      struct uhid_event reply = { .type = UHID_GET_REPORT_REPLY };
+      reply.u.get_report_reply.id = event.u.get_report.id;
+      reply.u.get_report_reply.err = 0;
+      reply.u.get_report_reply.size = 1 + REPORT_SIZE; // the report ID comes first
+      write_stamp(reply.u.get_report_reply.data + 1, device.features++);
+      uhid_write(&reply);
+    }
+    break;
+  case UHID_SET_REPORT:
+    {
+      struct uhid_event reply = { .type = UHID_SET_REPORT_REPLY };
+      reply.u.set_report_reply.id = event.u.set_report.id;
+      reply.u.set_report_reply.err = 0;
+      uhid_write(&reply);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static void * device_main(void * arg) {
+
+  struct pollfd pfd[2] = {
+    { .fd = device.fd, .events = POLLIN },
+    { .fd = device.timer, .events = POLLIN },
+  };
+
+  while (!done) {
+    if (poll(pfd, 2, 100) < 0) {
+      continue;
+    }
+    if (pfd[1].revents & POLLIN) {
+      uint64_t expirations;
+      if (read(device.timer, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+        device_send_input();
+      }
+    }
+    if (pfd[0].revents & POLLIN) {
+      device_process_event();
+    }
+  }
+
+  return NULL;
+}
+
+static int device_start_timer() {
+
+  device.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (device.timer < 0) {
+    fprintf(stderr, "timerfd_create failed: %m\n");
+    return -1;
+  }
+
+  struct timespec value = { .tv_sec = period / 1000000, .tv_nsec = (period % 1000000) * 1000 };
+  struct itimerspec spec = { .it_interval = value, .it_value = value };
+  if (timerfd_settime(device.timer, 0, &spec, NULL) < 0) {
+    fprintf(stderr, "timerfd_settime failed: %m\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * The hidraw node of the device is found from its uniq, which shows up in the uevent file of the HID device.
+ * It is created asynchronously, after UHID_CREATE2.
+ */
+static int find_node(char * node, size_t size) {
+
+  char line[128];
+  snprintf(line, sizeof(line), "HID_UNIQ=%s\n", uniq);
+
+  unsigned int waited;
+  for (waited = 0; waited < NODE_TIMEOUT; waited += 10) {
+
+    // the device events have to be processed for the node to be created
+    struct pollfd pfd = { .fd = device.fd, .events = POLLIN };
+    if (poll(&pfd, 1, 10) > 0) {
+      device_process_event();
+    }
+
+    DIR * dir = opendir("/sys/class/hidraw");
+    if (dir == NULL) {
+      continue;
+    }
+
+    int found = 0;
+    struct dirent * entry;
+    while (!found && (entry = readdir(dir)) != NULL) {
+      if (strncmp(entry->d_name, "hidraw", sizeof("hidraw") - 1)) {
+        continue;
+      }
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent", entry->d_name);
+      FILE * fp = fopen(path, "r");
+      if (fp == NULL) {
+        continue;
+      }
+      char buf[256];
+      while (!found && fgets(buf, sizeof(buf), fp) != NULL) {
+        found = !strcmp(buf, line);
+      }
+      fclose(fp);
+      if (found) {
+        snprintf(node, size, "/dev/%s", entry->d_name);
+      }
+    }
+    closedir(dir);
+
+    if (found && access(node, R_OK | W_OK) == 0) {
+      return 0;
+    }
+  }
+
+  fprintf(stderr, "no hidraw node for the uhid device\n");
+  return -1;
+}
+
+/*
+ * Host side, driven by gpoll like the proxy.
+ */
+
+static void host_complete(int user, unsigned char endpoint, const void * buf, int status,
+    const struct timeval * submitted) {
+
+  if (endpoint == IN_ENDPOINT) {
+    if (status >= (int) (sizeof(uint32_t) + sizeof(unsigned long long))) {
+      uint32_t sequence;
+      unsigned long long stamp;
+      read_stamp(buf, &sequence, &stamp);
+      add_latency(&host.in, now() - stamp);
+      if (host.reports > 0 && sequence != host.nextSequence) {
+        host.lost += sequence - host.nextSequence;
+      }
+      host.nextSequence = sequence + 1;
+      ++host.reports;
+      unsigned char report[REPORT_SIZE] = { };
+      write_stamp(report, sequence);
+      if (gusbhid_write(0, OUT_ENDPOINT, report, sizeof(report)) < 0) {
+        ++host.errors;
+      }
+    } else {
+      ++host.errors;
+    }
+    if (!done && gusbhid_poll(0, IN_ENDPOINT) < 0) {
+      ++host.errors;
+    }
+  } else if (endpoint == 0) {
+    host.controlPending = 0;
+    if (status < 0) {
+      ++host.stalls;
+    } else {
+      add_latency(&host.control, now() - host.controlStart);
+    }
+  } else if (status < 0) {
+    ++host.errors;
+  }
+}
+
+static int host_close(int user) {
+
+  done = 1;
+  return 1;
+}
+
+static int control_timer_read(int user) {
+
+  if (host.controlPending) {
+    return 0;
+  }
+
+  struct usb_ctrlrequest request = {
+    .bRequestType = USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+    .bRequest = 0x01, // GET_REPORT
+    .wValue = 0x0300, // feature report 0
+    .wIndex = 0,
+    .wLength = REPORT_SIZE,
+  };
+
+  host.controlPending = 1;
+  host.controlStart = now();
+  if (gusbhid_control(0, &request, sizeof(request)) < 0) {
+    host.controlPending = 0;
+    ++host.errors;
+  }
+
+  return 0;
+}
+
+static int second_timer_read(int user) {
+
+  printf("%us: %u input reports, %u lost\n", ++seconds, host.reports, host.lost);
+
+  if (seconds == duration) {
+    done = 1;
+  }
+
+  return done;
+}
+
+static int timer_close(int user) {
+
+  done = 1;
+  return 1;
+}
+
+static void terminate(int sig) {
+
+  done = 1;
+}
+
+int main(int argc, char * argv[]) {
+
+  (void) signal(SIGINT, terminate);
+  (void) signal(SIGTERM, terminate);
+
+  if (args_read(argc, argv) < 0) {
+    return -1;
+  }
+
+  snprintf(uniq, sizeof(uniq), "serialusb-bench-%d", (int) getpid());
+
+  char node[sizeof("/dev/") + NAME_MAX];
+  if (device_create() < 0 || find_node(node, sizeof(node)) < 0 || device_start_timer() < 0) {
+    device_destroy();
+    return -1;
+  }
+
+  printf("virtual device on %s, one input report every %uus\n", node, period);
+
+  s_gusbhid_interface interface = { .number = 0, .in = IN_ENDPOINT, .inSize = REPORT_SIZE, .out = OUT_ENDPOINT, .node = node };
+  if (gusbhid_open(0, 0, 0, &interface, 1, host_complete) < 0) {
+    device_destroy();
+    return -1;
+  }
+
+  int ret = gusbhid_register(0, host_close, gpoll_register_fd);
+  if (ret == 0) {
+    ret = gusbhid_poll(0, IN_ENDPOINT);
+  }
+
+  int controlTimer = -1;
+  int secondTimer = -1;
+  if (ret == 0) {
+    controlTimer = gtimer_start(0, CONTROL_PERIOD, control_timer_read, timer_close, gpoll_register_fd);
+    secondTimer = gtimer_start(0, 1000000, second_timer_read, timer_close, gpoll_register_fd);
+    if (controlTimer < 0 || secondTimer < 0) {
+      ret = -1;
+    }
+  }
+
+  pthread_t thread;
+  if (ret == 0 && pthread_create(&thread, NULL, device_main, NULL) != 0) {
+    fprintf(stderr, "pthread_create failed\n");
+    ret = -1;
+  } else if (ret == 0) {
+    while (!done) {
+      gpoll();
+    }
+    pthread_join(thread, NULL);
+  }
+
+  done = 1;
+
+  if (controlTimer >= 0) {
+    gtimer_close(controlTimer);
+  }
+  if (secondTimer >= 0) {
+    gtimer_close(secondTimer);
+  }
+
+  gusbhid_close(0);
+  device_destroy();
+  close(device.timer);
+
+  printf("input reports: %u sent, %u received, %u lost\n", device.sequence, host.reports, host.lost);
+  printf("output reports: %u received\n", device.outputs);
+  printf("feature reports: %u received, %u stalled\n", host.control.count, host.stalls);
+  print_latency("IN", &host.in);
+  print_latency("OUT", &device.out);
+  print_latency("control", &host.control);
+  if (host.errors || device.errors) {
+    printf("errors: %u host, %u device\n", host.errors, device.errors);
+  }
+
+  return ret;
+}
@@ -0,0 +1,1095 @@
+/*
+ Copyright (c) 2015 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+/*
+ * A model of the emu firmware (fw/emu.c) running on the host, on a pseudo terminal.
+ * It follows the serial protocol of the firmware, throttled to the simulated baud rate,
+ * and replaces the target host with a simple one: it enumerates the device once the endpoints are received,
+ * polls the IN endpoints every frame, periodically sends a control request that has to be forwarded,
+ * and optionally fills the OUT endpoints.
+ * This allows running serialusb without the firmware: serialusb --port <pty>
+ */
+
+#define _GNU_SOURCE
+
+#include <protocol.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <getopt.h>
+
+#define PRINT_ERROR_ERRNO(msg) fprintf(stderr, "%s:%d %s: %s failed with error: %m\n", __FILE__, __LINE__, __func__, msg);
+#define PRINT_ERROR_OTHER(msg) fprintf(stderr, "%s:%d %s: %s\n", __FILE__, __LINE__, __func__, msg);
+
+// the USB frame period of a full speed device, the IN endpoints are polled once per frame
+#define FRAME_PERIOD 1000 // microseconds
+
+// the main loop sleeps this long when there is nothing to do
+#define LOOP_PERIOD 100 // microseconds
+
+// the largest burst the serial link can carry after an idle period, in bytes
+#define LINK_MAX_BURST 16
+
+// same values as the firmware, see fw/emu.c and fw/Config/LUFAConfig.h
+#define TX_RING_SIZE 128
+#define CONTROL_ENDPOINT_SIZE 8
+#define ENDPOINT_DPRAM_SIZE 832
+#define CONTROL_TIMEOUT (50000 / TIMER_TICK_US)
+#define STATS_PERIOD (1000000 / TIMER_TICK_US)
+
+// the atmega32u4 EEPROM (1 Kbyte) minus the header of the saved set
+#define EEPROM_DATA_SIZE (1024 - 9)
+
+#define EP_TYPE_BULK 0x02
+#define EP_TYPE_INTERRUPT 0x03
+#define ENDPOINT_DIR_IN 0x80
+#define ENDPOINT_EPNUM_MASK 0x0f
+
+#define REQDIR_DEVICETOHOST 0x80
+#define REQ_GET_STATUS 0x00
+#define REQ_CLEAR_FEATURE 0x01
+#define REQ_SET_FEATURE 0x03
+#define REQ_SET_ADDRESS 0x05
+#define REQ_GET_DESCRIPTOR 0x06
+#define REQ_GET_CONFIGURATION 0x08
+#define REQ_SET_CONFIGURATION 0x09
+
+#define DTYPE_DEVICE 0x01
+#define DTYPE_CONFIGURATION 0x02
+#define DTYPE_STRING 0x03
+#define DTYPE_HID_REPORT 0x22
+
+typedef struct PACKED {
+  uint8_t bmRequestType;
+  uint8_t bRequest;
+  uint16_t wValue;
+  uint16_t wIndex;
+  uint16_t wLength;
+} s_setup;
+
+static unsigned int baudrate = USART_BAUDRATE;
+static unsigned int controlPeriod = 100000; // microseconds, 0 means no periodic control request
+static unsigned int outPeriod = 0; // microseconds, 0 means no OUT packet
+static char * linkPath = NULL;
+
+static volatile int done = 0;
+
+static int master = -1;
+
+static uint64_t startTime = 0; // microseconds
+
+static uint8_t descriptors[MAX_DESCRIPTORS_SIZE];
+static s_descriptorIndex descIndex[MAX_DESCRIPTORS];
+static s_endpointConfig endpoints[MAX_ENDPOINTS];
+
+static uint8_t * pdesc = descriptors;
+static uint8_t * pindex = (uint8_t *)descIndex;
+// once a part of the descriptors is dropped, the next parts would be stored at the wrong offset
+static uint8_t descriptorsDropped = 0;
+
+static uint8_t control[MAX_PACKET_VALUE_SIZE];
+
+static struct {
+  uint8_t length; // value length (endpoint + data), 0 means the slot is free
+  s_endpointPacket packet;
+} inSlots[IN_SLOTS];
+
+/*
+ * The banks of the configured endpoints: IN banks are filled by the firmware and emptied by the target host,
+ * OUT banks are filled by the target host and emptied by the firmware.
+ */
+static struct {
+  uint8_t banks; // 0 if the endpoint is not configured
+  uint8_t full; // number of banks holding a packet
+  uint8_t sequence; // first byte of the generated OUT packets
+} banks[MAX_ENDPOINTS];
+
+static uint8_t selectedOutEndpoint = 0;
+
+static uint8_t started = 0;
+static uint8_t configured = 0;
+
+/*
+ * The EEPROM of the firmware, kept across the firmware restarts, but not across the emulator runs.
+ */
+static struct {
+  uint8_t valid;
+  uint32_t hash;
+  uint16_t descriptorsSize;
+  uint16_t indexSize;
+  uint8_t descriptors[MAX_DESCRIPTORS_SIZE];
+  s_descriptorIndex descIndex[MAX_DESCRIPTORS];
+  s_endpointConfig endpoints[MAX_ENDPOINTS];
+} eeprom = {};
+
+static uint32_t offeredHash = 0;
+static uint8_t hashOffered = 0;
+
+/*
+ * The control request of the target host, when it is forwarded to the host.
+ */
+static struct {
+  enum {
+    CONTROL_IDLE,
+    CONTROL_OUT_DATA,   // forwarding the data stage of an OUT transfer to the host
+    CONTROL_WAIT_REPLY, // waiting for the host to reply
+  } state;
+  s_setup setup;
+  uint16_t remaining; // bytes of the data stage of the OUT transfer still to forward
+  uint16_t received; // bytes of the data stage of the IN transfer received from the host
+  uint16_t start; // timer value when the setup packet was received
+  uint16_t waitStart; // timer value when the wait for the host started
+  s_controlTiming timing;
+} controlRequest = { .state = CONTROL_IDLE };
+
+/*
+ * The requests the target host sends when the device is connected.
+ */
+static s_setup enumeration[MAX_DESCRIPTORS + 8];
+static unsigned int nbEnumeration = 0;
+static unsigned int enumerationIndex = 0;
+
+static uint64_t nextFrame = 0;
+static uint64_t nextOut = 0;
+static uint64_t nextControl = 0;
+
+static struct {
+  enum {
+    PARSER_TYPE,
+    PARSER_LENGTH,
+    PARSER_VALUE,
+  } state;
+  uint8_t type;
+  uint8_t length;
+  uint8_t remaining;
+  uint8_t * start; // NULL if the value is dropped
+  uint8_t * target;
+  uint8_t slot; // the IN slot being filled
+} parser = { .state = PARSER_TYPE };
+
+static uint8_t txRing[TX_RING_SIZE];
+static uint8_t txHead = 0;
+static uint8_t txTail = 0;
+
+/*
+ * The serial link is throttled to the simulated baud rate, with 10 bits per byte (8 data bits, start and stop bits).
+ */
+static struct {
+  uint64_t last; // microseconds
+  unsigned int rxCredit; // bytes that can be read
+  unsigned int txCredit; // bytes that can be written
+} serialLink = {};
+
+static s_firmwareStats stats;
+static uint16_t statsStart = 0;
+
+/*
+ * The totals printed when the emulator exits.
+ */
+static struct {
+  unsigned int restarts;
+  unsigned long long rxBytes;
+  unsigned long long txBytes;
+  unsigned int localRequests;
+  unsigned int forwardedRequests[E_CONTROL_ABORTED + 1]; // per e_controlStatus
+  unsigned long long inPackets;
+  unsigned long long inBytes;
+  unsigned long long outPackets;
+  unsigned long long outBytes;
+  unsigned long long naks[MAX_ENDPOINTS];
+} totals = {};
+
+static uint64_t get_time(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Get the firmware time, in TIMER_TICK_US units.
+ */
+static s_timestamp get_timestamp(void) {
+
+  return (get_time() - startTime) / TIMER_TICK_US;
+}
+
+static void link_update(void) {
+
+  uint64_t now = get_time();
+  unsigned int bytes = (now - serialLink.last) * baudrate / 10 / 1000000;
+  if (bytes == 0) {
+    return;
+  }
+  serialLink.last += (uint64_t) bytes * 10 * 1000000 / baudrate;
+  serialLink.rxCredit = serialLink.rxCredit + bytes < LINK_MAX_BURST ? serialLink.rxCredit + bytes : LINK_MAX_BURST;
+  serialLink.txCredit = serialLink.txCredit + bytes < LINK_MAX_BURST ? serialLink.txCredit + bytes : LINK_MAX_BURST;
+}
+
+/*
+ * Write the queued bytes the serial link can carry.
+ */
+static void link_write(void) {
+
+  link_update();
+
+  while (serialLink.txCredit && txTail != txHead) {
+    uint8_t tail = txTail & (TX_RING_SIZE - 1);
+    unsigned int length = (uint8_t)(txHead - txTail);
+    if (length > (unsigned int)(TX_RING_SIZE - tail)) {
+      length = TX_RING_SIZE - tail;
+    }
+    if (length > serialLink.txCredit) {
+      length = serialLink.txCredit;
+    }
+    ssize_t ret = write(master, txRing + tail, length);
+    if (ret < 0) {
+      if (errno != EAGAIN) {
+        PRINT_ERROR_ERRNO("write")
+      }
+      return;
+    }
+    txTail += ret;
+    serialLink.txCredit -= ret;
+    totals.txBytes += ret;
+  }
+}
+
+static inline uint8_t serial_tx_free(void) {
+
+  return TX_RING_SIZE - (uint8_t)(txHead - txTail);
+}
+
+/*
+ * Queue a byte, and only wait if the ring is full.
+ */
+static void serial_send_byte(uint8_t byte) {
+
+  while (serial_tx_free() == 0 && !done) {
+    usleep(10 * 1000000 / baudrate);
+    link_write();
+  }
+
+  txRing[txHead & (TX_RING_SIZE - 1)] = byte;
+  ++txHead;
+}
+
+static void serial_send_data(const void * data, uint8_t length) {
+
+  const uint8_t * ptr = data;
+  while (length--) {
+    serial_send_byte(*(ptr++));
+  }
+}
+
+static inline void ack(const uint8_t type) {
+  serial_send_byte(type);
+  serial_send_byte(BYTE_LEN_0_BYTE);
+}
+
+static inline void ack_in(const uint8_t endpoint, s_timestamp timestamp) {
+  serial_send_byte(E_TYPE_IN);
+  serial_send_byte(sizeof(timestamp) + 1);
+  serial_send_data(&timestamp, sizeof(timestamp));
+  serial_send_byte(endpoint);
+}
+
+/*
+ * Get the buffer the value of a packet is written to, or NULL if the value has to be dropped.
+ */
+static uint8_t * get_target(uint8_t type, uint8_t length) {
+
+  switch (type) {
+  case E_TYPE_DESCRIPTORS:
+    return !descriptorsDropped && pdesc + length <= descriptors + sizeof(descriptors) ? pdesc : NULL;
+  case E_TYPE_INDEX:
+    return pindex + length <= (uint8_t *)descIndex + sizeof(descIndex) ? pindex : NULL;
+  case E_TYPE_ENDPOINTS:
+    return length <= sizeof(endpoints) ? (uint8_t *)&endpoints : NULL;
+  case E_TYPE_CONTROL:
+  case E_TYPE_CONTROL_STALL:
+  case E_TYPE_CONTROL_DATA:
+    return length <= sizeof(control) ? control : NULL;
+  case E_TYPE_HASH:
+    return length == sizeof(offeredHash) ? (uint8_t *)&offeredHash : NULL;
+  case E_TYPE_IN:
+    if (length == 0 || length > sizeof(inSlots->packet)) {
+      return NULL;
+    }
+    for (parser.slot = 0; parser.slot < IN_SLOTS; ++parser.slot) {
+      if (inSlots[parser.slot].length == 0) {
+        return (uint8_t *)&inSlots[parser.slot].packet;
+      }
+    }
+    return NULL;
+  default:
+    return NULL;
+  }
+}
+
+static bool load_descriptors(uint32_t hash) {
+
+  if (!eeprom.valid || eeprom.hash != hash) {
+    return false;
+  }
+
+  memcpy(descriptors, eeprom.descriptors, eeprom.descriptorsSize);
+  memcpy(descIndex, eeprom.descIndex, eeprom.indexSize);
+  memcpy(endpoints, eeprom.endpoints, sizeof(endpoints));
+
+  pdesc = descriptors + eeprom.descriptorsSize;
+  pindex = (uint8_t *)descIndex + eeprom.indexSize;
+
+  return true;
+}
+
+static void save_descriptors(void) {
+
+  uint16_t descriptorsSize = pdesc - descriptors;
+  uint16_t indexSize = pindex - (uint8_t *)descIndex;
+
+  if (descriptorsSize + indexSize + sizeof(endpoints) > EEPROM_DATA_SIZE) {
+    return;
+  }
+
+  memcpy(eeprom.descriptors, descriptors, descriptorsSize);
+  memcpy(eeprom.descIndex, descIndex, indexSize);
+  memcpy(eeprom.endpoints, endpoints, sizeof(endpoints));
+  eeprom.descriptorsSize = descriptorsSize;
+  eeprom.indexSize = indexSize;
+  eeprom.hash = offeredHash;
+  eeprom.valid = 1;
+}
+
+/*
+ * Find an uploaded descriptor, returns NULL if the request has to be forwarded to the host.
+ */
+static const s_descriptorIndex * find_descriptor(uint16_t wValue, uint16_t wIndex) {
+
+  unsigned int i;
+  for (i = 0; i < sizeof(descIndex) / sizeof(*descIndex) && descIndex[i].wValue; ++i) {
+    if (wValue == descIndex[i].wValue && wIndex == descIndex[i].wIndex
+        && descIndex[i].offset + descIndex[i].wLength <= pdesc - descriptors) {
+      return descIndex + i;
+    }
+  }
+  return NULL;
+}
+
+static void add_request(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength) {
+
+  if (nbEnumeration < sizeof(enumeration) / sizeof(*enumeration)) {
+    enumeration[nbEnumeration++] = (s_setup) { bmRequestType, bRequest, wValue, wIndex, wLength };
+  }
+}
+
+/*
+ * Build the requests of the target host: the uploaded descriptors, the strings referenced
+ * by the device descriptor (which may have to be forwarded), and the configuration change.
+ */
+static void usb_start(void) {
+
+  nbEnumeration = 0;
+  enumerationIndex = 0;
+
+  add_request(0x00, REQ_SET_ADDRESS, 1, 0, 0);
+
+  unsigned int i;
+  for (i = 0; i < sizeof(descIndex) / sizeof(*descIndex) && descIndex[i].wValue; ++i) {
+    uint8_t bmRequestType = (descIndex[i].wValue >> 8) == DTYPE_HID_REPORT ? 0x81 : 0x80;
+    add_request(bmRequestType, REQ_GET_DESCRIPTOR, descIndex[i].wValue, descIndex[i].wIndex, descIndex[i].wLength);
+  }
+
+  const s_descriptorIndex * device = find_descriptor(DTYPE_DEVICE << 8, 0);
+  const s_descriptorIndex * langId0 = find_descriptor(DTYPE_STRING << 8, 0);
+  if (device != NULL && device->wLength >= 17) {
+    uint16_t langId = 0x0409;
+    if (langId0 != NULL && langId0->wLength >= 4) {
+      memcpy(&langId, descriptors + langId0->offset + 2, sizeof(langId));
+    }
+    for (i = 14; i <= 16; ++i) { // iManufacturer, iProduct, iSerialNumber
+      uint8_t index = descriptors[device->offset + i];
+      if (index && find_descriptor((DTYPE_STRING << 8) | index, langId) == NULL) {
+        add_request(0x80, REQ_GET_DESCRIPTOR, (DTYPE_STRING << 8) | index, langId, 255);
+      }
+    }
+  }
+
+  add_request(0x00, REQ_SET_CONFIGURATION, 1, 0, 0);
+
+  uint64_t now = get_time();
+  nextFrame = now + FRAME_PERIOD;
+  nextOut = now + outPeriod;
+  nextControl = now + controlPeriod;
+}
+
+/*
+ * The DPRAM is allocated in banks of a power of two bytes, from 8 bytes.
+ */
+static uint16_t get_bank_size(uint16_t size) {
+
+  uint16_t bank = 8;
+  while (bank < size) {
+    bank <<= 1;
+  }
+  return bank;
+}
+
+/*
+ * Same bank allocation as the firmware: single banks first, the remaining DPRAM gives
+ * a second bank to the first endpoints that fit.
+ */
+static void configure_endpoints(void) {
+
+  uint16_t dpram = ENDPOINT_DPRAM_SIZE - CONTROL_ENDPOINT_SIZE;
+
+  unsigned int i;
+  for (i = 0; i < sizeof(endpoints) / sizeof(*endpoints) && endpoints[i].number; ++i) {
+    if (endpoints[i].type == EP_TYPE_INTERRUPT || endpoints[i].type == EP_TYPE_BULK) {
+      uint16_t bank = get_bank_size(endpoints[i].size);
+      dpram = dpram > bank ? dpram - bank : 0;
+    }
+  }
+
+  memset(banks, 0x00, sizeof(banks));
+  selectedOutEndpoint = 0;
+
+  for (i = 0; i < sizeof(endpoints) / sizeof(*endpoints) && endpoints[i].number; ++i) {
+    if (endpoints[i].type == EP_TYPE_INTERRUPT || endpoints[i].type == EP_TYPE_BULK) {
+      banks[i].banks = 1;
+      uint16_t bank = get_bank_size(endpoints[i].size);
+      if (dpram >= bank) {
+        banks[i].banks = 2;
+        dpram -= bank;
+      }
+    }
+  }
+
+  configured = 1;
+}
+
+/*
+ * The standard requests the firmware (LUFA) processes without the host.
+ */
+static bool process_local_request(const s_setup * setup) {
+
+  switch (setup->bRequest) {
+  case REQ_GET_STATUS:
+    return setup->bmRequestType == 0x80 || setup->bmRequestType == 0x82;
+  case REQ_CLEAR_FEATURE:
+  case REQ_SET_FEATURE:
+    return setup->bmRequestType == 0x00 || setup->bmRequestType == 0x02;
+  case REQ_SET_ADDRESS:
+  case REQ_GET_CONFIGURATION:
+    return setup->bmRequestType == 0x00 || setup->bmRequestType == 0x80;
+  case REQ_SET_CONFIGURATION:
+    if (setup->bmRequestType != 0x00) {
+      return false;
+    }
+    configure_endpoints();
+    return true;
+  case REQ_GET_DESCRIPTOR:
+    return (setup->bmRequestType == 0x80 || setup->bmRequestType == 0x81)
+        && find_descriptor(setup->wValue, setup->wIndex) != NULL;
+  default:
+    return false;
+  }
+}
+
+static void end_control(uint8_t status) {
+
+  controlRequest.timing.status = status;
+  controlRequest.timing.total = (uint16_t)get_timestamp() - controlRequest.start;
+
+  serial_send_byte(E_TYPE_CONTROL_TIMING);
+  serial_send_byte(sizeof(controlRequest.timing));
+  serial_send_data(&controlRequest.timing, sizeof(controlRequest.timing));
+
+  ++totals.forwardedRequests[status];
+
+  controlRequest.state = CONTROL_IDLE;
+}
+
+static void wait_control_reply(void) {
+
+  controlRequest.waitStart = get_timestamp();
+  controlRequest.state = CONTROL_WAIT_REPLY;
+}
+
+/*
+ * The target host sends a control request: it is either processed locally or forwarded to the host.
+ */
+static void send_control_request(const s_setup * setup) {
+
+  if (process_local_request(setup)) {
+    ++totals.localRequests;
+    return;
+  }
+
+  s_timestamp timestamp = get_timestamp();
+
+  controlRequest.setup = *setup;
+  controlRequest.start = timestamp;
+  controlRequest.received = 0;
+  controlRequest.timing.bmRequestType = setup->bmRequestType;
+  controlRequest.timing.bRequest = setup->bRequest;
+  controlRequest.timing.reply = 0;
+
+  serial_send_byte(E_TYPE_CONTROL);
+  serial_send_byte(sizeof(timestamp) + sizeof(*setup));
+  serial_send_data(&timestamp, sizeof(timestamp));
+  serial_send_data(setup, sizeof(*setup));
+
+  if (!(setup->bmRequestType & REQDIR_DEVICETOHOST) && setup->wLength) {
+    controlRequest.remaining = setup->wLength;
+    controlRequest.state = CONTROL_OUT_DATA;
+  } else {
+    wait_control_reply();
+  }
+}
+
+/*
+ * Process a reply of the host to the forwarded control request.
+ */
+static void process_control_reply(uint8_t type, uint8_t length) {
+
+  if (controlRequest.state != CONTROL_WAIT_REPLY) {
+    return;
+  }
+
+  if (controlRequest.timing.reply == 0) {
+    controlRequest.timing.reply = (uint16_t)get_timestamp() - controlRequest.start;
+  }
+
+  if (type == E_TYPE_CONTROL_STALL) {
+    end_control(E_CONTROL_STALLED);
+    return;
+  }
+
+  if (controlRequest.setup.bmRequestType & REQDIR_DEVICETOHOST) {
+    uint16_t remaining = controlRequest.setup.wLength - controlRequest.received;
+    controlRequest.received += length < remaining ? length : remaining;
+  }
+
+  if (type == E_TYPE_CONTROL_DATA) {
+    ack(E_TYPE_CONTROL_DATA); // request the next fragment
+    wait_control_reply();
+    return;
+  }
+
+  end_control(E_CONTROL_COMPLETED);
+}
+
+/*
+ * Forward the data stage of the control OUT transfer, one control endpoint packet at a time,
+ * and detect the host timeout.
+ */
+static void control_task(void) {
+
+  switch (controlRequest.state) {
+  case CONTROL_OUT_DATA:
+    if (serial_tx_free() >= sizeof(s_header) + CONTROL_ENDPOINT_SIZE) {
+      uint8_t length = controlRequest.remaining < CONTROL_ENDPOINT_SIZE ? controlRequest.remaining : CONTROL_ENDPOINT_SIZE;
+      controlRequest.remaining -= length;
+      serial_send_byte(E_TYPE_CONTROL_DATA);
+      serial_send_byte(length);
+      while (length--) {
+        serial_send_byte(0x00);
+      }
+      if (controlRequest.remaining == 0) {
+        wait_control_reply();
+      }
+    }
+    break;
+  case CONTROL_WAIT_REPLY:
+    if ((uint16_t)((uint16_t)get_timestamp() - controlRequest.waitStart) >= CONTROL_TIMEOUT) {
+      ++stats.controlTimeouts;
+      end_control(E_CONTROL_TIMEOUT);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static void restart(void);
+
+static void process_packet(void) {
+
+  uint8_t length = parser.length;
+  bool stored = parser.start != NULL;
+
+  switch (parser.type) {
+  case E_TYPE_DESCRIPTORS:
+    if (stored) {
+      pdesc += length;
+    } else {
+      descriptorsDropped = 1;
+    }
+    ack(E_TYPE_DESCRIPTORS);
+    break;
+  case E_TYPE_INDEX:
+    if (stored) {
+      pindex += length;
+    }
+    ack(E_TYPE_INDEX);
+    break;
+  case E_TYPE_ENDPOINTS:
+    ack(E_TYPE_ENDPOINTS);
+    if (hashOffered && !started) {
+      save_descriptors();
+    }
+    if (!started) {
+      started = 1;
+      usb_start();
+    }
+    break;
+  case E_TYPE_HASH:
+    if (stored && !started) {
+      bool loaded = load_descriptors(offeredHash);
+      s_hashReply reply = { .loaded = loaded, .descriptorsSize = sizeof(descriptors) };
+      serial_send_byte(E_TYPE_HASH);
+      serial_send_byte(sizeof(reply));
+      serial_send_data(&reply, sizeof(reply));
+      hashOffered = !loaded;
+      if (loaded) {
+        started = 1;
+        usb_start();
+      }
+    }
+    break;
+  case E_TYPE_RESET:
+    restart();
+    break;
+  case E_TYPE_CONTROL:
+  case E_TYPE_CONTROL_STALL:
+  case E_TYPE_CONTROL_DATA:
+    process_control_reply(parser.type, length);
+    break;
+  case E_TYPE_IN:
+    if (stored) {
+      inSlots[parser.slot].length = length;
+    } else {
+      ++stats.droppedInPackets;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+ * Read and parse the bytes the serial link can carry.
+ */
+static void serial_task(void) {
+
+  link_update();
+
+  uint8_t buf[LINK_MAX_BURST];
+  ssize_t ret = read(master, buf, serialLink.rxCredit);
+  if (ret < 0) {
+    if (errno != EAGAIN) {
+      PRINT_ERROR_ERRNO("read")
+    }
+    return;
+  }
+
+  serialLink.rxCredit -= ret;
+  totals.rxBytes += ret;
+
+  ssize_t i;
+  for (i = 0; i < ret; ++i) {
+
+    uint8_t byte = buf[i];
+
+    switch (parser.state) {
+    case PARSER_TYPE:
+      parser.type = byte;
+      parser.state = PARSER_LENGTH;
+      break;
+    case PARSER_LENGTH:
+      parser.length = byte;
+      parser.remaining = byte;
+      parser.start = get_target(parser.type, byte);
+      parser.target = parser.start;
+      if (byte == 0) {
+        parser.state = PARSER_TYPE;
+        process_packet();
+      } else {
+        parser.state = PARSER_VALUE;
+      }
+      break;
+    case PARSER_VALUE:
+      if (parser.target != NULL) {
+        *(parser.target++) = byte;
+      }
+      if (--parser.remaining == 0) {
+        parser.state = PARSER_TYPE;
+        process_packet();
+      }
+      break;
+    }
+  }
+}
+
+/*
+ * Move the queued IN packets into their endpoints, and ack each one as soon as it is in a bank.
+ */
+static void SendNextInput(void) {
+
+  uint8_t i;
+  for (i = 0; i < IN_SLOTS; ++i) {
+
+    if (inSlots[i].length == 0) {
+      continue;
+    }
+
+    uint8_t endpoint = inSlots[i].packet.endpoint;
+
+    unsigned int j;
+    for (j = 0; j < MAX_ENDPOINTS && endpoints[j].number != endpoint; ++j) {}
+
+    // a packet for an endpoint that is not configured stays in its slot, as in the firmware
+    if (j < MAX_ENDPOINTS && banks[j].full < banks[j].banks) {
+
+      ++banks[j].full;
+
+      totals.inBytes += inSlots[i].length - 1;
+
+      inSlots[i].length = 0;
+
+      ack_in(endpoint, get_timestamp());
+    }
+  }
+}
+
+/*
+ * Forward the packets of all the OUT endpoints holding one, in turn.
+ */
+static void ReceiveNextOutput(void) {
+
+  static struct PACKED {
+    s_header header;
+    s_timestamp timestamp;
+    s_endpointPacket value;
+  } packet = { .header.type = E_TYPE_OUT };
+
+  uint8_t n;
+  for (n = 0; n < MAX_ENDPOINTS; ++n) {
+
+    uint8_t i = selectedOutEndpoint;
+
+    if (banks[i].full == 0 || (endpoints[i].number & ENDPOINT_DIR_IN)) {
+      selectedOutEndpoint = (selectedOutEndpoint + 1) % MAX_ENDPOINTS;
+      continue;
+    }
+
+    // leave the data in the endpoint until the packet can be queued without waiting
+    if (serial_tx_free() < sizeof(packet.header) + sizeof(packet.timestamp) + 1 + endpoints[i].size) {
+      return;
+    }
+
+    selectedOutEndpoint = (selectedOutEndpoint + 1) % MAX_ENDPOINTS;
+
+    --banks[i].full;
+
+    packet.timestamp = get_timestamp();
+    packet.value.endpoint = endpoints[i].number;
+    memset(packet.value.data, 0x00, endpoints[i].size);
+    packet.value.data[0] = banks[i].sequence++;
+    packet.header.length = sizeof(packet.timestamp) + 1 + endpoints[i].size;
+
+    serial_send_data(&packet, sizeof(packet.header) + packet.header.length);
+
+    ++totals.outPackets;
+    totals.outBytes += endpoints[i].size;
+  }
+}
+
+/*
+ * The target host: IN polling every frame, OUT packets and control requests.
+ */
+static void host_task(void) {
+
+  uint64_t now = get_time();
+
+  if (configured) {
+
+    unsigned int i;
+
+    for (; nextFrame <= now; nextFrame += FRAME_PERIOD) {
+      for (i = 0; i < MAX_ENDPOINTS; ++i) {
+        if (banks[i].banks == 0 || !(endpoints[i].number & ENDPOINT_DIR_IN)) {
+          continue;
+        }
+        if (banks[i].full) {
+          --banks[i].full;
+          ++totals.inPackets;
+        } else {
+          ++stats.naks[i].count;
+          ++totals.naks[i];
+        }
+      }
+    }
+
+    for (; outPeriod && nextOut <= now; nextOut += outPeriod) {
+      for (i = 0; i < MAX_ENDPOINTS; ++i) {
+        if (banks[i].banks == 0 || (endpoints[i].number & ENDPOINT_DIR_IN)) {
+          continue;
+        }
+        if (banks[i].full < banks[i].banks) {
+          ++banks[i].full;
+        } else {
+          ++stats.naks[i].count;
+          ++totals.naks[i];
+        }
+      }
+    }
+  }
+
+  if (controlRequest.state != CONTROL_IDLE) {
+    return;
+  }
+
+  if (enumerationIndex < nbEnumeration) {
+    send_control_request(enumeration + enumerationIndex++);
+  } else if (configured && controlPeriod && nextControl <= now) {
+    nextControl = now + controlPeriod;
+    // GET_STATUS for an interface is not processed by the firmware
+    s_setup setup = { 0x81, REQ_GET_STATUS, 0, 0, 2 };
+    send_control_request(&setup);
+  }
+}
+
+static void stats_task(uint16_t now) {
+
+  if ((uint16_t)(now - statsStart) < STATS_PERIOD || serial_tx_free() < sizeof(s_header) + sizeof(stats)) {
+    return;
+  }
+
+  statsStart = now;
+
+  s_firmwareStats report = stats;
+  memset(&stats, 0x00, sizeof(stats));
+
+  uint8_t i;
+  for (i = 0; i < sizeof(endpoints) / sizeof(*endpoints); ++i) {
+    report.naks[i].endpoint = endpoints[i].number;
+  }
+
+  serial_send_byte(E_TYPE_STATS);
+  serial_send_byte(sizeof(report));
+  serial_send_data(&report, sizeof(report));
+}
+
+/*
+ * Same as a firmware restart, except for the EEPROM.
+ */
+static void restart(void) {
+
+  pdesc = descriptors;
+  pindex = (uint8_t *)descIndex;
+  descriptorsDropped = 0;
+  memset(descIndex, 0x00, sizeof(descIndex));
+  memset(endpoints, 0x00, sizeof(endpoints));
+  memset(inSlots, 0x00, sizeof(inSlots));
+  memset(banks, 0x00, sizeof(banks));
+  memset(&stats, 0x00, sizeof(stats));
+  started = 0;
+  configured = 0;
+  hashOffered = 0;
+  nbEnumeration = 0;
+  enumerationIndex = 0;
+  controlRequest.state = CONTROL_IDLE;
+  parser.state = PARSER_TYPE;
+
+  ++totals.restarts;
+
+  // tell the host the firmware has (re)started and needs the descriptors
+  ack(E_TYPE_RESET);
+}
+
+static int open_pty(void) {
+
+  master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (master < 0) {
+    PRINT_ERROR_ERRNO("posix_openpt")
+    return -1;
+  }
+
+  if (grantpt(master) < 0 || unlockpt(master) < 0) {
+    PRINT_ERROR_ERRNO("grantpt")
+    return -1;
+  }
+
+  const char * name = ptsname(master);
+
+  // the slave side is kept open, so that serialusb can be restarted without closing the pty
+  int slave = open(name, O_RDWR | O_NOCTTY);
+  if (slave < 0) {
+    PRINT_ERROR_ERRNO("open")
+    return -1;
+  }
+
+  struct termios options;
+  if (tcgetattr(slave, &options) < 0) {
+    PRINT_ERROR_ERRNO("tcgetattr")
+    return -1;
+  }
+  cfmakeraw(&options);
+  if (tcsetattr(slave, TCSANOW, &options) < 0) {
+    PRINT_ERROR_ERRNO("tcsetattr")
+    return -1;
+  }
+
+  if (linkPath != NULL) {
+    unlink(linkPath);
+    if (symlink(name, linkPath) < 0) {
+      PRINT_ERROR_ERRNO("symlink")
+      return -1;
+    }
+  }
+
+  printf("emulated firmware on %s, %u bauds\n", linkPath != NULL ? linkPath : name, baudrate);
+  fflush(stdout);
+
+  return 0;
+}
+
+static void print_totals(void) {
+
+  printf("restarts: %u, serial link: %llu bytes received, %llu bytes sent\n", totals.restarts, totals.rxBytes, totals.txBytes);
+  printf("control requests: %u local, %u forwarded (%u stalled, %u timeouts, %u aborted)\n", totals.localRequests,
+      totals.forwardedRequests[E_CONTROL_COMPLETED] + totals.forwardedRequests[E_CONTROL_STALLED]
+          + totals.forwardedRequests[E_CONTROL_TIMEOUT] + totals.forwardedRequests[E_CONTROL_ABORTED],
+      totals.forwardedRequests[E_CONTROL_STALLED], totals.forwardedRequests[E_CONTROL_TIMEOUT],
+      totals.forwardedRequests[E_CONTROL_ABORTED]);
+  printf("IN: %llu packets (%llu bytes), OUT: %llu packets (%llu bytes)\n", totals.inPackets, totals.inBytes,
+      totals.outPackets, totals.outBytes);
+
+  unsigned int i;
+  for (i = 0; i < MAX_ENDPOINTS && endpoints[i].number; ++i) {
+    printf("endpoint 0x%02x: %u bank(s), NAKed %llu times\n", endpoints[i].number, banks[i].banks, totals.naks[i]);
+  }
+}
+
+static void usage(void) {
+  printf("Usage: serialusb-emu [--baudrate 500000] [--control-period ms] [--out-period ms] [--link path]\n");
+  printf("Then: serialusb --port <pty or link>\n");
+}
+
+static int args_read(int argc, char * argv[]) {
+
+  struct option long_options[] = {
+    { "help",           no_argument,       0, 'h' },
+    { "baudrate",       required_argument, 0, 'b' },
+    { "control-period", required_argument, 0, 'c' },
+    { "out-period",     required_argument, 0, 'o' },
+    { "link",           required_argument, 0, 'l' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "b:c:hl:o:", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'b':
+      baudrate = atoi(optarg);
+      break;
+    case 'c':
+      controlPeriod = atoi(optarg) * 1000;
+      break;
+    case 'h':
+      usage();
+      exit(0);
+      break;
+    case 'l':
+      linkPath = optarg;
+      break;
+    case 'o':
+      outPeriod = atoi(optarg) * 1000;
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (baudrate < 10) {
+    PRINT_ERROR_OTHER("invalid baudrate")
+    return -1;
+  }
+
+  return 0;
+}
+
+static void terminate(int sig) {
+  done = 1;
+}
+
+int main(int argc, char * argv[]) {
+
+  (void) signal(SIGINT, terminate);
+  (void) signal(SIGTERM, terminate);
+
+  if (args_read(argc, argv) < 0) {
+    return -1;
+  }
+
+  if (open_pty() < 0) {
+    return -1;
+  }
+
+  startTime = get_time();
+  serialLink.last = startTime;
+
+  restart();
+
+  uint16_t loopStart = get_timestamp();
+
+  while (!done) {
+
+    serial_task();
+    control_task();
+    if (started) {
+      host_task();
+      if (configured) {
+        SendNextInput();
+        ReceiveNextOutput();
+      }
+      uint16_t now = get_timestamp();
+      if ((uint16_t)(now - loopStart) > stats.maxLoopTime) {
+        stats.maxLoopTime = now - loopStart;
+      }
+      stats_task(now);
+    }
+    link_write();
+
+    // wait for the next byte time, the time spent waiting is not part of the main loop time
+    struct pollfd pfd = { .fd = master, .events = serialLink.rxCredit ? POLLIN : 0 };
+    struct timespec timeout = { .tv_nsec = LOOP_PERIOD * 1000 };
+    if (ppoll(&pfd, 1, &timeout, NULL) < 0 && errno != EINTR) {
+      PRINT_ERROR_ERRNO("ppoll")
+      break;
+    }
+
+    loopStart = get_timestamp();
+  }
+
+  if (linkPath != NULL) {
+    unlink(linkPath);
+  }
+
+  print_totals();
+
+  return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ Copyright (c) 2015 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#include <fwclock.h>
+#include <protocol.h>
+#include <string.h>
+
+/*
+ * The firmware timestamps are compared with the arrival time of the packets that carry them.
+ * The serial link and the USB to UART adapter add a variable delay, but the smallest delay
+ * is nearly constant, so that the minimum of each window is a good sample of the clock offset.
+ * The offset and the drift are fitted over the minima of the last windows.
+ * The estimated times include that smallest delay.
+ */
+
+#define WINDOW_US 1000000 // microseconds
+
+#define MAX_WINDOWS 16
+
+typedef struct {
+  double x; // firmware time since the first sample, in microseconds
+  double y; // host time minus firmware time, in microseconds
+} s_point;
+
+static struct {
+  int started;
+  uint64_t firmwareStart; // unwrapped timestamp of the first sample
+  uint64_t lastTimestamp; // unwrapped
+  long long hostStart; // microseconds
+  double windowStart;
+  int hasMinimum;
+  s_point minimum; // of the current window
+  s_point windows[MAX_WINDOWS];
+  unsigned int nbWindows;
+  unsigned int head;
+  double offset; // microseconds
+  double drift;
+} fwclock = {};
+
+void fwclock_reset() {
+
+  memset(&fwclock, 0x00, sizeof(fwclock));
+}
+
+/*
+ * Extend a 32-bit timestamp, assuming it is within half the wrap-around period of the last one.
+ */
+static uint64_t unwrap(uint32_t timestamp) {
+
+  uint64_t value = (fwclock.lastTimestamp & ~0xFFFFFFFFULL) | timestamp;
+  if (value + 0x80000000ULL < fwclock.lastTimestamp) {
+    value += 0x100000000ULL;
+  } else if (value > fwclock.lastTimestamp + 0x80000000ULL && value >= 0x100000000ULL) {
+    value -= 0x100000000ULL;
+  }
+  return value;
+}
+
+static double to_firmware_time(uint64_t timestamp) {
+
+  return (double)(long long)(timestamp - fwclock.firmwareStart) * TIMER_TICK_US;
+}
+
+/*
+ * Least squares fit over the window minima.
+ */
+static void fit() {
+
+  s_point points[MAX_WINDOWS + 1];
+  unsigned int nbPoints = 0;
+
+  unsigned int i;
+  for (i = 0; i < fwclock.nbWindows; ++i) {
+    points[nbPoints++] = fwclock.windows[(fwclock.head + i) % MAX_WINDOWS];
+  }
+  if (fwclock.hasMinimum) {
+    points[nbPoints++] = fwclock.minimum;
+  }
+
+  if (nbPoints == 0) {
+    return;
+  }
+
+  double mx = 0, my = 0;
+  for (i = 0; i < nbPoints; ++i) {
+    mx += points[i].x;
+    my += points[i].y;
+  }
+  mx /= nbPoints;
+  my /= nbPoints;
+
+  double sxy = 0, sxx = 0;
+  for (i = 0; i < nbPoints; ++i) {
+    sxy += (points[i].x - mx) * (points[i].y - my);
+    sxx += (points[i].x - mx) * (points[i].x - mx);
+  }
+
+  fwclock.drift = sxx > 0 ? sxy / sxx : 0;
+  fwclock.offset = my - fwclock.drift * mx;
+}
+
+void fwclock_add_sample(uint32_t timestamp, const struct timeval * arrival) {
+
+  long long host = arrival->tv_sec * 1000000LL + arrival->tv_usec;
+
+  if (!fwclock.started) {
+    fwclock.started = 1;
+    fwclock.firmwareStart = timestamp;
+    fwclock.lastTimestamp = timestamp;
+    fwclock.hostStart = host;
+  }
+
+  uint64_t value = unwrap(timestamp);
+  if (value > fwclock.lastTimestamp) {
+    fwclock.lastTimestamp = value;
+  }
+
+  s_point point = { .x = to_firmware_time(value) };
+  point.y = (host - fwclock.hostStart) - point.x;
+
+  if (fwclock.hasMinimum && point.x - fwclock.windowStart >= WINDOW_US) {
+    if (fwclock.nbWindows == MAX_WINDOWS) {
+      fwclock.head = (fwclock.head + 1) % MAX_WINDOWS;
+      --fwclock.nbWindows;
+    }
+    fwclock.windows[(fwclock.head + fwclock.nbWindows) % MAX_WINDOWS] = fwclock.minimum;
+    ++fwclock.nbWindows;
+    fwclock.hasMinimum = 0;
+    fwclock.windowStart = point.x;
+  }
+
+  if (!fwclock.hasMinimum || point.y < fwclock.minimum.y) {
+    fwclock.minimum = point;
+    fwclock.hasMinimum = 1;
+  }
+
+  fit();
+}
+
+/*
+ * Get the host time of a firmware timestamp.
+ * Returns -1 if no sample was received since the firmware started.
+ */
+int fwclock_to_host(uint32_t timestamp, struct timeval * tv) {
+
+  if (!fwclock.started) {
+    return -1;
+  }
+
+  double x = to_firmware_time(unwrap(timestamp));
+  long long host = fwclock.hostStart + (long long)(x + fwclock.offset + fwclock.drift * x);
+
+  tv->tv_sec = host / 1000000;
+  tv->tv_usec = host % 1000000;
+
+  return 0;
+}
+
+double fwclock_get_drift() {
+
+  return fwclock.drift;
+}
@@ -0,0 +1,21 @@
+/*
+ Copyright (c) 2015 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#ifndef FWCLOCK_H_
+#define FWCLOCK_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/*
+ * Estimate the host time of the firmware timestamps.
+ */
+
+void fwclock_reset();
+void fwclock_add_sample(uint32_t timestamp, const struct timeval * arrival);
+int fwclock_to_host(uint32_t timestamp, struct timeval * tv);
+double fwclock_get_drift();
+
+#endif /* FWCLOCK_H_ */
@@ -6,8 +6,16 @@
 #ifndef PROXY_H_
 #define PROXY_H_
 
+#include <gusb.h>
+
 int proxy_init();
 int proxy_start(char * port);
+int proxy_export_descriptors(const char * path);
 void proxy_stop();
+void proxy_set_lazy_descriptors(int enable);
+void proxy_set_event_thread(int cpu);
+void proxy_set_fast_attach(int enable);
+void proxy_set_usb_backend(e_gusb_backend backend);
+void proxy_set_simulated_device(const char * script);
 
 #endif /* PROXY_H_ */
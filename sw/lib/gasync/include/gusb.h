@@ -7,6 +7,8 @@
 #define GUSB_H_
 
 #include "gpoll.h"
+#include <sys/time.h>
+#include <stddef.h>
 
 #ifdef WIN32
 #define PACKED __attribute__((gcc_struct, packed))
@@ -102,7 +104,7 @@ struct usb_hid_descriptor {
   struct {
     unsigned char bReportDescriptorType;
     unsigned short wReportDescriptorLength;
-  } rdesc[0];
+  } PACKED rdesc[0];
 } PACKED;
 
 typedef enum {
@@ -140,12 +142,26 @@ struct p_other {
   unsigned char * data;
 };
 
+struct p_endpoint {
+  unsigned char configurationIndex;
+  unsigned char interfaceIndex;
+  unsigned char altInterfaceIndex;
+  struct usb_endpoint_descriptor * descriptor;
+};
+
+/*
+ * All the pointed data is stored in a single block (arena), which is freed when the device is closed.
+ */
 typedef struct {
     struct usb_device_descriptor device;
     struct p_configuration * configurations; //device.bNumConfigurations elements
     struct usb_string_descriptor langId0;
     unsigned int nbOthers;
     struct p_other * others; //nbOthers elements
+    unsigned int nbEndpoints;
+    struct p_endpoint * endpoints; //nbEndpoints elements, all the endpoints of the tree, in tree order
+    unsigned char * arena;
+    size_t arenaSize;
 } s_usb_descriptors;
 
 typedef struct {
@@ -155,11 +171,71 @@ typedef struct {
     int next;
 } s_usb_dev;
 
+typedef enum {
+  E_GUSB_BACKEND_LIBUSB,
+  E_GUSB_BACKEND_USBFS, // Linux only: the transfers are submitted and reaped directly through usbfs
+  E_GUSB_BACKEND_HIDRAW, // Linux only: the HID interfaces are accessed through hidraw, without detaching the kernel driver
+  E_GUSB_BACKEND_SIM, // Linux only: simulated device, the path is the script describing it (see gusbsim.h)
+} e_gusb_backend;
+
+typedef struct {
+  unsigned int open; // microseconds
+  unsigned int reset;
+  unsigned int configuration;
+  unsigned int claim; // includes the kernel driver detach
+  unsigned int descriptors;
+  unsigned int total;
+  int fast; // the reset and the configuration change were skipped
+} s_gusb_attach_times;
+
+#define GUSB_MAX_ENDPOINTS 15 // per direction, not counting the control endpoint
+#define GUSB_LATENCY_BUCKETS 12
+
+/*
+ * The counters of the isochronous endpoints are in packets.
+ */
+typedef struct {
+  unsigned int submitted;
+  unsigned int completed; // successful transfers
+  unsigned long long bytes;
+  unsigned int timeouts;
+  unsigned int stalls;
+  unsigned int errors;
+  unsigned int cancelled;
+  /*
+   * Submit-to-completion latency histogram (not for isochronous endpoints).
+   * Bucket 0 counts latencies below 125us, bucket i counts latencies in [125us << (i - 1), 125us << i),
+   * and the last bucket also counts all higher latencies.
+   */
+  unsigned int latency[GUSB_LATENCY_BUCKETS];
+  /*
+   * Inter-arrival times of successful transfers, for interrupt IN endpoints only.
+   * The arrivals only reflect the device rate if the endpoint is kept polled.
+   */
+  unsigned int expectedInterval; // microseconds, from bInterval and the device speed
+  unsigned int intervals; // number of measured intervals
+  unsigned long long intervalSum; // microseconds
+  unsigned int minInterval;
+  unsigned int maxInterval;
+  unsigned long long jitterSum; // sum of |interval - expectedInterval|, microseconds
+} s_gusb_endpoint_stats;
+
+typedef struct {
+  s_gusb_endpoint_stats control;
+  s_gusb_endpoint_stats in[GUSB_MAX_ENDPOINTS]; // indexed by endpoint number - 1
+  s_gusb_endpoint_stats out[GUSB_MAX_ENDPOINTS];
+} s_gusb_stats;
+
 int gusb_open_ids(unsigned short vendor, unsigned short product);
 s_usb_dev * gusb_enumerate(unsigned short vendor, unsigned short product);
 void gusb_free_enumeration(s_usb_dev * usb_devs);
 int gusb_open_path(const char * path);
+int gusb_open_path_backend(const char * path, e_gusb_backend backend);
 s_usb_descriptors * gusb_get_usb_descriptors(int device);
+int gusb_set_alt_setting(int device, unsigned char interface, unsigned char altSetting);
+void gusb_set_fast_attach(int enable);
+int gusb_get_attach_times(int device, s_gusb_attach_times * times);
+int gusb_get_stats(int device, s_gusb_stats * stats);
 int gusb_close(int device);
 int gusb_read_timeout(int device, unsigned char endpoint, void * buf, unsigned int count, unsigned int timeout);
 int gusb_register(int device, int user, USBASYNC_READ_CALLBACK fp_read, USBASYNC_WRITE_CALLBACK fp_write,
@@ -169,5 +245,7 @@ int gusb_write_timeout(int device, unsigned char endpoint, const void * buf, uns
     unsigned int timeout);
 int gusb_poll(int device, unsigned char endpoint);
 int gusb_handle_events(int unused);
+int gusb_start_event_thread(int cpu);
+void gusb_get_reap_time(struct timeval * tv);
 
 #endif /* GUSB_H_ */
@@ -3,20 +3,68 @@
  License: GPLv3
  */
 
+#ifndef WIN32
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
 #include <gusb.h>
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <sys/time.h>
+
+#ifndef WIN32
+#define USBASYNC_EVENT_THREAD
+#endif
+
+#ifndef WIN32
+#define USBASYNC_USBFS
+#include "gusbfs.h"
+#define USBASYNC_HIDRAW
+#include "gusbhid.h"
+#define USBASYNC_SIM
+#include "gusbsim.h"
+#endif
+
+#ifdef USBASYNC_EVENT_THREAD
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
 
 #include <libusb-1.0/libusb.h>
 
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+#define USBASYNC_HOTPLUG
+#endif
+
 #define USBASYNC_MAX_DEVICES 256
 
 #define USBASYNC_OUT_TIMEOUT 20 // milliseconds
 
+#define USBASYNC_BULK_OUT_TIMEOUT 1000 // milliseconds
+
+#define USBASYNC_ISO_OUT_TIMEOUT 1000 // milliseconds
+
+// isochronous IN endpoints are kept continuously queued with these transfers
+#define USBASYNC_ISO_TRANSFERS 4
+#define USBASYNC_ISO_PACKETS 8 // packets per transfer, i.e. 8 ms at full speed
+
 #define USBASYNC_DEFAULT_TIMEOUT 1000 // milliseconds
 
+// number of completions the event thread can queue before the gpoll thread processes them (power of 2)
+#define USBASYNC_RING_SIZE 256
+
+// number of preallocated transfers per endpoint and direction
+#define USBASYNC_POOL_SIZE 8
+
+// buffer size of the preallocated control transfers (setup + data stage)
+#define USBASYNC_CONTROL_BUFFER_SIZE (LIBUSB_CONTROL_SETUP_SIZE + 256)
+
 #define IS_ENDPOINT_IN(endpoint) ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
 #define IS_ENDPOINT_OUT(endpoint) ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
 #define IS_ENDPOINT_INTERRUPT(endpoint) ((endpoint & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_INTERRUPT)
@@ -27,26 +75,94 @@
 
 #define DEFAULT_STRING_BUFFER_SIZE 255
 
+#define ARENA_ALIGN(size) (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+#define USBASYNC_INDEX_SIZE 256 // maximum number of indexed devices
+#define USBASYNC_INDEX_BUCKETS 64 // must be a power of 2
+#define USBASYNC_PATH_SIZE ((1 + 7) * 3) // see make_path
+
+/*
+ * Transfers are taken from and given back to per-endpoint pools, so that no allocation is made in steady state.
+ * The pools are filled when the callbacks are registered, with buffers sized from wMaxPacketSize.
+ * If a pool is empty or if its buffers are too small, a transfer is allocated, and it is freed on completion.
+ */
+typedef struct {
+  struct libusb_transfer * transfers[USBASYNC_POOL_SIZE]; // available transfers
+  unsigned int nb_transfers;
+  unsigned int buffer_size;
+} s_transfer_pool;
+
+/*
+ * The data path of a device goes through a backend, which is chosen at open time.
+ */
+typedef struct {
+  // size is the buffer size (including the setup packet for control transfers), count the number of bytes to send
+  int (* submit)(int device, unsigned char type, unsigned char endpoint, const void * buf, unsigned int count, unsigned int size);
+  int (* transfer_timeout)(int device, unsigned char type, unsigned char endpoint, void * buf, unsigned int count, unsigned int timeout);
+  int (* register_fds)(int device, GPOLL_REGISTER_FD fp_register);
+  void (* close)(int device); // cancel the pending transfers and release the interfaces
+} s_backend;
+
+static const s_backend libusb_backend;
+#ifdef USBASYNC_USBFS
+static const s_backend usbfs_backend;
+static int usbfs_open(int device, libusb_device * dev);
+#endif
+#ifdef USBASYNC_HIDRAW
+static const s_backend hidraw_backend;
+static int hidraw_open(int device, libusb_device * dev);
+#endif
+#ifdef USBASYNC_SIM
+static int sim_open(const char * path);
+#endif
+
+typedef struct {
+  size_t used; // bytes of descriptors.arena
+  unsigned int maxOthers; // capacity of descriptors.others
+} s_arena;
+
 static struct {
   char * path;
+  e_gusb_backend backend_type;
+  s_gusb_attach_times attach_times;
+  s_gusb_stats stats;
+  unsigned int last_arrival[1 + 2 * GUSB_MAX_ENDPOINTS]; // control, in, out: reap time in microseconds, wraps around
+  const s_backend * backend;
   libusb_device_handle * devh;
   s_usb_descriptors descriptors;
+  s_arena arena;
   struct {
     struct {
       unsigned char type;
       unsigned short size;
+      unsigned char streaming; // number of queued isochronous transfers
+      s_transfer_pool pool;
     } in;
     struct {
       unsigned char type;
       unsigned short size;
+      s_transfer_pool pool;
     } out;
   } endpoints[LIBUSB_ENDPOINT_ADDRESS_MASK];
+  s_transfer_pool control_pool;
   struct {
     int user;
     USBASYNC_READ_CALLBACK fp_read;
     USBASYNC_WRITE_CALLBACK fp_write;
     USBASYNC_CLOSE_CALLBACK fp_close;
   } callback;
+  /*
+   * Submitted transfers are stored in slots, and the slot index is stored in the transfer,
+   * so that they can be tracked and cancelled without searching.
+   * The submission time of each transfer is kept in its slot, to measure its latency.
+   */
+  struct {
+    struct libusb_transfer ** slots;
+    struct timeval * submitted;
+    unsigned int * free_slots; // stack of the free slot indexes
+    unsigned int nb_free_slots;
+    unsigned int nb_slots; // the table only grows
+  } pending;
   int pending_transfers;
   int closing;
 } usbdevices[USBASYNC_MAX_DEVICES] = { };
@@ -74,47 +190,206 @@ static void print_error_libusb(const char * file, int line, const char * func, c
 
 static libusb_context* ctx = NULL;
 
-static struct libusb_transfer ** transfers = NULL;
-static unsigned int transfers_nb = 0;
+// completion time of the transfer being processed
+static struct timeval reap_time = {};
 
-static int add_transfer(struct libusb_transfer * transfer) {
-  unsigned int i;
-  for (i = 0; i < transfers_nb; ++i) {
-    if (transfers[i] == transfer) {
-      return 0;
+// skip the reset and the configuration change if the device is already configured
+static int fast_attach = 0;
+
+#ifdef USBASYNC_EVENT_THREAD
+/*
+ * In event thread mode, the libusb events are handled by a dedicated thread, which only timestamps
+ * the completed transfers and pushes them into a single-producer single-consumer ring.
+ * The ring is drained in the gpoll thread, when the eventfd gets readable.
+ */
+static struct {
+  int running;
+  volatile int stop;
+  pthread_t thread;
+  int fd; // eventfd
+  struct {
+    struct libusb_transfer * transfer;
+    struct timeval reaped;
+  } ring[USBASYNC_RING_SIZE];
+  unsigned int head; // written by the event thread
+  unsigned int tail; // written by the gpoll thread
+} event_thread = { .fd = -1 };
+#endif
+
+/*
+ * The user data of a transfer holds the device index in its lower bits,
+ * and the slot index + 1 in its upper bits (0 means the transfer is not tracked).
+ */
+#define TRANSFER_DEVICE(transfer) ((intptr_t) (transfer)->user_data & (USBASYNC_MAX_DEVICES - 1))
+#define TRANSFER_SLOT(transfer) (((intptr_t) (transfer)->user_data / USBASYNC_MAX_DEVICES) - 1)
+#define TRANSFER_USER_DATA(device, slot) ((void *) (intptr_t) ((device) + ((slot) + 1) * USBASYNC_MAX_DEVICES))
+
+static s_transfer_pool * get_pool(int device, unsigned char endpoint) {
+
+  unsigned char endpointIndex = endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK;
+  if (endpointIndex == 0) {
+    return &usbdevices[device].control_pool;
+  }
+  if (IS_ENDPOINT_IN(endpoint)) {
+    return &usbdevices[device].endpoints[endpointIndex - 1].in.pool;
+  }
+  return &usbdevices[device].endpoints[endpointIndex - 1].out.pool;
+}
+
+static int init_pool(s_transfer_pool * pool, unsigned int buffer_size) {
+
+  pool->buffer_size = buffer_size;
+
+  while (pool->nb_transfers < USBASYNC_POOL_SIZE) {
+
+    struct libusb_transfer * transfer = libusb_alloc_transfer(0);
+    if (transfer == NULL) {
+      PRINT_ERROR_ALLOC_FAILED("libusb_alloc_transfer")
+      return -1;
+    }
+
+    transfer->buffer = calloc(buffer_size, sizeof(unsigned char));
+    if (transfer->buffer == NULL) {
+      PRINT_ERROR_ALLOC_FAILED("calloc")
+      libusb_free_transfer(transfer);
+      return -1;
     }
+
+    pool->transfers[pool->nb_transfers++] = transfer;
   }
-  void * ptr = realloc(transfers, (transfers_nb + 1) * sizeof(*transfers));
-  if (ptr) {
-    transfers = ptr;
-    transfers[transfers_nb] = transfer;
-    transfers_nb++;
-    usbdevices[(intptr_t) transfer->user_data].pending_transfers++;
-    return 0;
-  } else {
+
+  return 0;
+}
+
+static void clean_pool(s_transfer_pool * pool) {
+
+  while (pool->nb_transfers) {
+    struct libusb_transfer * transfer = pool->transfers[--pool->nb_transfers];
+    free(transfer->buffer);
+    libusb_free_transfer(transfer);
+  }
+  pool->buffer_size = 0;
+}
+
+/*
+ * Get a transfer with a buffer of at least size bytes.
+ * Transfers that don't come from a pool are flagged with LIBUSB_TRANSFER_FREE_BUFFER.
+ */
+static struct libusb_transfer * acquire_transfer(int device, unsigned char endpoint, unsigned int size) {
+
+  s_transfer_pool * pool = get_pool(device, endpoint);
+
+  if (pool->nb_transfers && size <= pool->buffer_size) {
+    return pool->transfers[--pool->nb_transfers];
+  }
+
+  unsigned char * buf = calloc(size, sizeof(unsigned char));
+  if (buf == NULL) {
+
+    PRINT_ERROR_ALLOC_FAILED("calloc")
+    return NULL;
+  }
+
+  struct libusb_transfer * transfer = libusb_alloc_transfer(0);
+  if (transfer == NULL) {
+
+    PRINT_ERROR_ALLOC_FAILED("libusb_alloc_transfer")
+    free(buf);
+    return NULL;
+  }
+
+  transfer->buffer = buf;
+  transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+  return transfer;
+}
+
+static void release_transfer(int device, struct libusb_transfer * transfer) {
+
+  if (!(transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)) {
+    s_transfer_pool * pool = get_pool(device, transfer->endpoint);
+    if (pool->buffer_size && pool->nb_transfers < USBASYNC_POOL_SIZE) {
+      pool->transfers[pool->nb_transfers++] = transfer;
+      return;
+    }
+    // the pool was cleaned
+    free(transfer->buffer);
+  }
+
+  libusb_free_transfer(transfer);
+}
+
+static int add_slots(int device) {
+
+  unsigned int size = usbdevices[device].pending.nb_slots ? usbdevices[device].pending.nb_slots * 2 : 32;
+
+  void * ptr = realloc(usbdevices[device].pending.slots, size * sizeof(*usbdevices[device].pending.slots));
+  if (ptr == NULL) {
+    PRINT_ERROR_ALLOC_FAILED("realloc")
+    return -1;
+  }
+  usbdevices[device].pending.slots = ptr;
+
+  ptr = realloc(usbdevices[device].pending.free_slots, size * sizeof(*usbdevices[device].pending.free_slots));
+  if (ptr == NULL) {
+    PRINT_ERROR_ALLOC_FAILED("realloc")
+    return -1;
+  }
+  usbdevices[device].pending.free_slots = ptr;
+
+  ptr = realloc(usbdevices[device].pending.submitted, size * sizeof(*usbdevices[device].pending.submitted));
+  if (ptr == NULL) {
     PRINT_ERROR_ALLOC_FAILED("realloc")
     return -1;
   }
+  usbdevices[device].pending.submitted = ptr;
+
+  unsigned int slot;
+  for (slot = size; slot > usbdevices[device].pending.nb_slots; --slot) {
+    usbdevices[device].pending.slots[slot - 1] = NULL;
+    usbdevices[device].pending.free_slots[usbdevices[device].pending.nb_free_slots++] = slot - 1;
+  }
+  usbdevices[device].pending.nb_slots = size;
+
+  return 0;
 }
 
-static void remove_transfer(struct libusb_transfer * transfer) {
-  unsigned int i;
-  for (i = 0; i < transfers_nb; ++i) {
-    if (transfers[i] == transfer) {
-      memmove(transfers + i, transfers + i + 1, (transfers_nb - i - 1) * sizeof(*transfers));
-      transfers_nb--;
-      void * ptr = realloc(transfers, transfers_nb * sizeof(*transfers));
-      if (ptr || !transfers_nb) {
-        transfers = ptr;
-      } else {
-        PRINT_ERROR_ALLOC_FAILED("realloc")
-      }
-      usbdevices[(intptr_t) transfer->user_data].pending_transfers--;
-      free(transfer->buffer);
-      libusb_free_transfer(transfer);
-      break;
+static int add_transfer(struct libusb_transfer * transfer) {
+  int device = TRANSFER_DEVICE(transfer);
+  if (TRANSFER_SLOT(transfer) >= 0) {
+    return 0;
+  }
+  if (usbdevices[device].pending.nb_free_slots == 0) {
+    if (add_slots(device) < 0) {
+      return -1;
     }
   }
+  unsigned int slot = usbdevices[device].pending.free_slots[--usbdevices[device].pending.nb_free_slots];
+  usbdevices[device].pending.slots[slot] = transfer;
+  transfer->user_data = TRANSFER_USER_DATA(device, slot);
+  usbdevices[device].pending_transfers++;
+  return 0;
+}
+
+static const struct timeval * get_submit_time(struct libusb_transfer * transfer) {
+  int device = TRANSFER_DEVICE(transfer);
+  int slot = TRANSFER_SLOT(transfer);
+  if (slot < 0 || (unsigned int) slot >= usbdevices[device].pending.nb_slots) {
+    return NULL;
+  }
+  return usbdevices[device].pending.submitted + slot;
+}
+
+static void remove_transfer(struct libusb_transfer * transfer) {
+  int device = TRANSFER_DEVICE(transfer);
+  int slot = TRANSFER_SLOT(transfer);
+  if (slot >= 0 && (unsigned int) slot < usbdevices[device].pending.nb_slots
+      && usbdevices[device].pending.slots[slot] == transfer) {
+    usbdevices[device].pending.slots[slot] = NULL;
+    usbdevices[device].pending.free_slots[usbdevices[device].pending.nb_free_slots++] = slot;
+    usbdevices[device].pending_transfers--;
+  }
+  release_transfer(device, transfer);
 }
 
 void usbasync_init(void) __attribute__((constructor (101)));
@@ -126,14 +401,23 @@ void usbasync_init(void) {
   }
 }
 
+#ifdef USBASYNC_EVENT_THREAD
+static void stop_event_thread();
+#endif
+static void clean_index();
+
 void usbasync_clean(void) __attribute__((destructor (101)));
 void usbasync_clean(void) {
   int i;
   for (i = 0; i < USBASYNC_MAX_DEVICES; ++i) {
-    if (usbdevices[i].devh != NULL) {
+    if (usbdevices[i].path != NULL) {
       gusb_close(i);
     }
   }
+#ifdef USBASYNC_EVENT_THREAD
+  stop_event_thread();
+#endif
+  clean_index();
   libusb_exit(ctx);
 }
 
@@ -142,7 +426,7 @@ static inline int usbasync_check_device(int device, const char * file, unsigned
     fprintf(stderr, "%s:%d %s: invalid device\n", file, line, func);
     return -1;
   }
-  if (usbdevices[device].devh == NULL) {
+  if (usbdevices[device].backend == NULL) {
     fprintf(stderr, "%s:%d %s: no such device\n", file, line, func);
     return -1;
   }
@@ -230,7 +514,7 @@ static int add_device(const char * path, int print) {
     }
   }
   for (i = 0; i < USBASYNC_MAX_DEVICES; ++i) {
-    if (usbdevices[i].devh == NULL) {
+    if (usbdevices[i].path == NULL) {
       usbdevices[i].path = strdup(path);
       if (usbdevices[i].path != NULL) {
         return i;
@@ -243,126 +527,820 @@ static int add_device(const char * path, int print) {
   return -1;
 }
 
-static int submit_transfer(struct libusb_transfer * transfer) {
-  /*
-   * Don't submit the transfer if it can't be added in the 'transfers' table.
-   * Otherwise it would not be possible to cleanly cancel it.
-   */
-  int ret = add_transfer(transfer);
+/*
+ * The enumeration index maps the bus/port paths and the vendor/product ids to the connected devices.
+ * If libusb supports hotplug, the index is built once and then updated from the hotplug events,
+ * which are received when the libusb events are handled. Else it is rebuilt at each lookup.
+ *
+ * Entries are chained in hash buckets. Chain links hold the entry index + 1, so that 0 ends a chain.
+ */
+static struct {
+#ifdef USBASYNC_HOTPLUG
+  int hotplug;
+  libusb_hotplug_callback_handle handle;
+#endif
+#ifdef USBASYNC_EVENT_THREAD
+  pthread_mutex_t mutex; // hotplug events may be handled in the event thread
+#endif
+  struct {
+    libusb_device * dev; // referenced, NULL if the entry is free
+    struct libusb_device_descriptor desc;
+    char path[USBASYNC_PATH_SIZE];
+    unsigned int next_path;
+    unsigned int next_ids;
+  } entries[USBASYNC_INDEX_SIZE];
+  unsigned int path_buckets[USBASYNC_INDEX_BUCKETS];
+  unsigned int ids_buckets[USBASYNC_INDEX_BUCKETS];
+} usb_index = {
+#ifdef USBASYNC_EVENT_THREAD
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
 
-  if (ret != -1) {
-    ret = libusb_submit_transfer(transfer);
-    if (ret != LIBUSB_SUCCESS) {
-      PRINT_ERROR_LIBUSB("libusb_submit_transfer", ret)
-      remove_transfer(transfer);
-      return -1;
-    }
+#ifdef USBASYNC_EVENT_THREAD
+#define INDEX_LOCK() pthread_mutex_lock(&usb_index.mutex);
+#define INDEX_UNLOCK() pthread_mutex_unlock(&usb_index.mutex);
+#else
+#define INDEX_LOCK()
+#define INDEX_UNLOCK()
+#endif
+
+static unsigned int hash_path(const char * path) {
+
+  // FNV-1a
+  unsigned int hash = 2166136261u;
+  for (; *path != '\0'; ++path) {
+    hash = (hash ^ (unsigned char) *path) * 16777619u;
   }
-  return ret;
+  return hash & (USBASYNC_INDEX_BUCKETS - 1);
 }
 
-static void usb_callback(struct libusb_transfer* transfer) {
+static unsigned int hash_ids(unsigned short vendor, unsigned short product) {
 
-  int device = (intptr_t) transfer->user_data;
+  unsigned int hash = ((unsigned int) vendor << 16 | product) * 2654435761u;
+  return (hash >> 16) & (USBASYNC_INDEX_BUCKETS - 1);
+}
 
-  //make sure the device still exists, in case something went wrong
-  if(usbasync_check_device(device, __FILE__, __LINE__, __func__) < 0) {
-    remove_transfer(transfer);
-    return;
+static void index_remove(unsigned int entry) {
+
+  unsigned int * link = usb_index.path_buckets + hash_path(usb_index.entries[entry].path);
+  while (*link != entry + 1) {
+    link = &usb_index.entries[*link - 1].next_path;
   }
+  *link = usb_index.entries[entry].next_path;
 
-  int status;
-  switch (transfer->status) {
-  case LIBUSB_TRANSFER_COMPLETED:
-    status = transfer->actual_length;
-    break;
-  case LIBUSB_TRANSFER_TIMED_OUT:
-    status = E_TRANSFER_TIMED_OUT;
-    break;
-  case LIBUSB_TRANSFER_STALL:
-    status = E_TRANSFER_STALL;
-    break;
-  case LIBUSB_TRANSFER_CANCELLED:
-    break;
-  default:
-    status = E_TRANSFER_ERROR;
-    PRINT_TRANSFER_ERROR(transfer)
-    break;
+  link = usb_index.ids_buckets + hash_ids(usb_index.entries[entry].desc.idVendor, usb_index.entries[entry].desc.idProduct);
+  while (*link != entry + 1) {
+    link = &usb_index.entries[*link - 1].next_ids;
   }
-  if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
-    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
-      struct libusb_control_setup * setup = libusb_control_transfer_get_setup(transfer);
-      if(setup->bmRequestType & LIBUSB_ENDPOINT_IN) {
-        unsigned char * data = libusb_control_transfer_get_data(transfer);
-        usbdevices[device].callback.fp_read(usbdevices[device].callback.user, transfer->endpoint, data, status);
-      } else {
-        usbdevices[device].callback.fp_write(usbdevices[device].callback.user, transfer->endpoint, status);
-      }
-    } else {
-      if (IS_ENDPOINT_OUT(transfer->endpoint)) {
-        usbdevices[device].callback.fp_write(usbdevices[device].callback.user, transfer->endpoint, status);
-      } else {
-        usbdevices[device].callback.fp_read(usbdevices[device].callback.user, transfer->endpoint, transfer->buffer, status);
-      }
+  *link = usb_index.entries[entry].next_ids;
+
+  libusb_unref_device(usb_index.entries[entry].dev);
+  usb_index.entries[entry].dev = NULL;
+}
+
+static int index_find_path(const char * path) {
+
+  unsigned int link;
+  for (link = usb_index.path_buckets[hash_path(path)]; link != 0; link = usb_index.entries[link - 1].next_path) {
+    if (!strcmp(usb_index.entries[link - 1].path, path)) {
+      return link - 1;
     }
   }
-
-  remove_transfer(transfer);
+  return -1;
 }
 
-int gusb_poll(int device, unsigned char endpoint) {
+static void index_insert(libusb_device * dev) {
 
-  USBASYNC_CHECK_DEVICE(device, -1)
+  struct libusb_device_descriptor desc;
+  int ret = libusb_get_device_descriptor(dev, &desc);
+  if (ret != LIBUSB_SUCCESS) {
+    PRINT_ERROR_LIBUSB("libusb_get_device_descriptor", ret)
+    return;
+  }
 
-  unsigned char endpointIndex = GET_ENDPOINT(device, endpoint, LIBUSB_ENDPOINT_IN, 0)
-  if(endpointIndex == INVALID_ENDPOINT_INDEX) {
-  
-    return -1;
+  const char * path = make_path(dev);
+  if (path == NULL) {
+    return;
   }
 
-  if (usbdevices[device].callback.fp_read == NULL) {
+  // a re-enumerated device may arrive before the old one leaves
+  int entry = index_find_path(path);
+  if (entry >= 0) {
+    index_remove(entry);
+  }
 
-    PRINT_ERROR_OTHER("missing read callback")
-    return -1;
+  for (entry = 0; entry < USBASYNC_INDEX_SIZE; ++entry) {
+    if (usb_index.entries[entry].dev == NULL) {
+      break;
+    }
+  }
+  if (entry == USBASYNC_INDEX_SIZE) {
+    PRINT_ERROR_OTHER("too many devices")
+    return;
   }
-  
-  unsigned int size = usbdevices[device].endpoints[endpointIndex].in.size;
 
-  unsigned char * buf = calloc(size, sizeof(char));
-  if (buf == NULL) {
+  usb_index.entries[entry].dev = libusb_ref_device(dev);
+  usb_index.entries[entry].desc = desc;
+  // make_path always fits into USBASYNC_PATH_SIZE
+  memcpy(usb_index.entries[entry].path, path, strlen(path) + 1);
 
-    PRINT_ERROR_ALLOC_FAILED("calloc")
-    return -1;
-  }
+  unsigned int * bucket = usb_index.path_buckets + hash_path(path);
+  usb_index.entries[entry].next_path = *bucket;
+  *bucket = entry + 1;
 
-  struct libusb_transfer * transfer = libusb_alloc_transfer(0);
-  if (transfer == NULL) {
+  bucket = usb_index.ids_buckets + hash_ids(desc.idVendor, desc.idProduct);
+  usb_index.entries[entry].next_ids = *bucket;
+  *bucket = entry + 1;
+}
 
-    PRINT_ERROR_ALLOC_FAILED("libusb_alloc_transfer")
-    free(buf);
-    return -1;
-  }
+static void index_clear() {
 
-  switch (usbdevices[device].endpoints[endpointIndex].in.type) {
-  case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-    libusb_fill_interrupt_transfer(transfer, usbdevices[device].devh, endpoint, buf, size,
-        (libusb_transfer_cb_fn) usb_callback, (void *) (intptr_t) device, 0);
-    break;
-  default:
-    PRINT_ERROR_OTHER("unsupported endpoint type")
-    libusb_free_transfer(transfer);
-    free(buf);
-    return -1;
+  unsigned int entry;
+  for (entry = 0; entry < USBASYNC_INDEX_SIZE; ++entry) {
+    if (usb_index.entries[entry].dev != NULL) {
+      libusb_unref_device(usb_index.entries[entry].dev);
+      usb_index.entries[entry].dev = NULL;
+    }
   }
-
-  return submit_transfer(transfer);
+  memset(usb_index.path_buckets, 0x00, sizeof(usb_index.path_buckets));
+  memset(usb_index.ids_buckets, 0x00, sizeof(usb_index.ids_buckets));
 }
 
-int gusb_handle_events(int unused) {
-#ifndef WIN32
-  return libusb_handle_events(ctx);
-#else
-  if(ctx != NULL)
+#ifdef USBASYNC_HOTPLUG
+static int LIBUSB_CALL hotplug_callback(libusb_context * context __attribute__((unused)), libusb_device * dev,
+    libusb_hotplug_event event, void * user_data __attribute__((unused))) {
+
+  INDEX_LOCK()
+
+  if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+    index_insert(dev);
+  } else {
+    unsigned int entry;
+    for (entry = 0; entry < USBASYNC_INDEX_SIZE; ++entry) {
+      if (usb_index.entries[entry].dev == dev) {
+        index_remove(entry);
+        break;
+      }
+    }
+  }
+
+  INDEX_UNLOCK()
+
+  return 0;
+}
+#endif
+
+/*
+ * Make sure the index is up to date. This has to be called without holding the index lock.
+ */
+static int refresh_index() {
+
+  if (!ctx) {
+    PRINT_ERROR_OTHER("no libusb context")
+    return -1;
+  }
+
+#ifdef USBASYNC_HOTPLUG
+  if (!usb_index.hotplug && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    // the callback is called for each connected device before the registration returns
+    int ret = libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+        hotplug_callback, NULL, &usb_index.handle);
+    if (ret == LIBUSB_SUCCESS) {
+      usb_index.hotplug = 1;
+      return 0;
+    }
+    PRINT_ERROR_LIBUSB("libusb_hotplug_register_callback", ret)
+  }
+  /*
+   * The hotplug events are delivered by the event thread, or by gpoll through the libusb pollfds.
+   * Without the event thread, the caller may run before the pending events are handled,
+   * so the index is rebuilt from the device list, and the hotplug events keep it up to date in the loop.
+   */
+#ifdef USBASYNC_EVENT_THREAD
+  if (usb_index.hotplug && event_thread.running) {
+    return 0;
+  }
+#endif
+#endif
+
+  libusb_device ** devs;
+  ssize_t cnt = libusb_get_device_list(ctx, &devs);
+  if (cnt < 0) {
+    PRINT_ERROR_LIBUSB("libusb_get_device_list", cnt)
+    return -1;
+  }
+
+  INDEX_LOCK()
+
+  index_clear();
+
+  ssize_t dev_i;
+  for (dev_i = 0; dev_i < cnt; ++dev_i) {
+    index_insert(devs[dev_i]);
+  }
+
+  INDEX_UNLOCK()
+
+  libusb_free_device_list(devs, 1);
+
+  return 0;
+}
+
+static void clean_index() {
+
+#ifdef USBASYNC_HOTPLUG
+  if (usb_index.hotplug) {
+    libusb_hotplug_deregister_callback(ctx, usb_index.handle);
+    usb_index.hotplug = 0;
+  }
+#endif
+
+  INDEX_LOCK()
+  index_clear();
+  INDEX_UNLOCK()
+}
+
+static int submit_transfer(struct libusb_transfer * transfer) {
+  /*
+   * Don't submit the transfer if it can't be added in the 'transfers' table.
+   * Otherwise it would not be possible to cleanly cancel it.
+   */
+  int ret = add_transfer(transfer);
+
+  if (ret != -1) {
+    gettimeofday(usbdevices[TRANSFER_DEVICE(transfer)].pending.submitted + TRANSFER_SLOT(transfer), NULL);
+    ret = libusb_submit_transfer(transfer);
+    if (ret != LIBUSB_SUCCESS) {
+      PRINT_ERROR_LIBUSB("libusb_submit_transfer", ret)
+      remove_transfer(transfer);
+      return -1;
+    }
+  }
+  return ret;
+}
+
+static int get_status(enum libusb_transfer_status transferStatus, int actual_length) {
+
+  switch (transferStatus) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    return actual_length;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    return E_TRANSFER_TIMED_OUT;
+  case LIBUSB_TRANSFER_STALL:
+    return E_TRANSFER_STALL;
+  default:
+    return E_TRANSFER_ERROR;
+  }
+}
+
+static inline unsigned int get_microseconds(const struct timeval * tv) {
+
+  return tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static inline unsigned int get_stats_index(unsigned char endpoint) {
+
+  unsigned char number = endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK;
+  if (number == 0) {
+    return 0;
+  }
+  return IS_ENDPOINT_IN(endpoint) ? number : GUSB_MAX_ENDPOINTS + number;
+}
+
+static inline s_gusb_endpoint_stats * get_stats(int device, unsigned int index) {
+
+  if (index == 0) {
+    return &usbdevices[device].stats.control;
+  }
+  if (index <= GUSB_MAX_ENDPOINTS) {
+    return usbdevices[device].stats.in + index - 1;
+  }
+  return usbdevices[device].stats.out + index - GUSB_MAX_ENDPOINTS - 1;
+}
+
+/*
+ * Isochronous transfers are counted in packets, other transfers are counted once each.
+ */
+static void record_submission(int device, unsigned char endpoint, unsigned int packets) {
+
+  get_stats(device, get_stats_index(endpoint))->submitted += packets;
+}
+
+/*
+ * Count a completed transfer, or a packet of an isochronous transfer.
+ * Returns 1 if it succeeded.
+ */
+static int count_completion(s_gusb_endpoint_stats * stats, int status, int cancelled) {
+
+  if (cancelled) {
+    ++stats->cancelled;
+    return 0;
+  }
+
+  switch (status) {
+  case E_TRANSFER_TIMED_OUT:
+    ++stats->timeouts;
+    return 0;
+  case E_TRANSFER_STALL:
+    ++stats->stalls;
+    return 0;
+  case E_TRANSFER_ERROR:
+    ++stats->errors;
+    return 0;
+  default:
+    break;
+  }
+
+  ++stats->completed;
+  stats->bytes += status;
+
+  return 1;
+}
+
+/*
+ * Record the completion of a transfer, which happened at reap_time.
+ * submitted is the submission time of the transfer, NULL if it is not known.
+ */
+static void record_completion(int device, unsigned char endpoint, int status, int cancelled, const struct timeval * submitted) {
+
+  unsigned int index = get_stats_index(endpoint);
+  s_gusb_endpoint_stats * stats = get_stats(device, index);
+
+  unsigned int reaped = get_microseconds(&reap_time);
+
+  if (submitted != NULL) {
+    unsigned int latency = reaped - get_microseconds(submitted);
+    unsigned int bucket = 0;
+    while (bucket < GUSB_LATENCY_BUCKETS - 1 && latency >= (125u << bucket)) {
+      ++bucket;
+    }
+    ++stats->latency[bucket];
+  }
+
+  if (!count_completion(stats, status, cancelled) || stats->expectedInterval == 0) {
+    return;
+  }
+
+  unsigned int * lastArrival = usbdevices[device].last_arrival + index;
+  if (*lastArrival != 0) {
+    unsigned int interval = reaped - *lastArrival;
+    if (stats->intervals == 0 || interval < stats->minInterval) {
+      stats->minInterval = interval;
+    }
+    if (interval > stats->maxInterval) {
+      stats->maxInterval = interval;
+    }
+    ++stats->intervals;
+    stats->intervalSum += interval;
+    stats->jitterSum += interval > stats->expectedInterval ? interval - stats->expectedInterval : stats->expectedInterval - interval;
+  }
+  *lastArrival = reaped;
+}
+
+/*
+ * Reset the statistics, and compute the expected intervals of the interrupt IN endpoints.
+ * Devices without a libusb device (dev is NULL) are full speed.
+ */
+static void init_stats(int device, libusb_device * dev) {
+
+  memset(&usbdevices[device].stats, 0x00, sizeof(usbdevices[device].stats));
+  memset(usbdevices[device].last_arrival, 0x00, sizeof(usbdevices[device].last_arrival));
+
+  int highSpeed = dev != NULL && libusb_get_device_speed(dev) >= LIBUSB_SPEED_HIGH;
+
+  unsigned int i;
+  for (i = 0; i < usbdevices[device].descriptors.nbEndpoints; ++i) {
+    struct p_endpoint * pEndpoint = usbdevices[device].descriptors.endpoints + i;
+    if (pEndpoint->configurationIndex != 0 || pEndpoint->altInterfaceIndex != 0) {
+      continue;
+    }
+    struct usb_endpoint_descriptor * endpoint = pEndpoint->descriptor;
+    if ((endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_INTERRUPT
+        || !IS_ENDPOINT_IN(endpoint->bEndpointAddress) || endpoint->bInterval == 0) {
+      continue;
+    }
+    s_gusb_endpoint_stats * stats = get_stats(device, get_stats_index(endpoint->bEndpointAddress));
+    if (highSpeed) {
+      // 2^(bInterval-1) microframes
+      stats->expectedInterval = 125 << ((endpoint->bInterval > 16 ? 16 : endpoint->bInterval) - 1);
+    } else {
+      // bInterval frames
+      stats->expectedInterval = endpoint->bInterval * 1000;
+    }
+  }
+}
+
+int gusb_get_stats(int device, s_gusb_stats * stats) {
+
+  USBASYNC_CHECK_DEVICE(device, -1)
+
+  *stats = usbdevices[device].stats;
+
+  return 0;
+}
+
+/*
+ * Isochronous transfers report a status for each packet.
+ * IN transfers are submitted again, so that the endpoint stays continuously queued.
+ */
+static void iso_callback(int device, struct libusb_transfer* transfer) {
+
+  // the packets of a transfer share the same reap time, so there's no latency or interval to measure
+  s_gusb_endpoint_stats * stats = get_stats(device, get_stats_index(transfer->endpoint));
+
+  int packet;
+  for (packet = 0; packet < transfer->num_iso_packets; ++packet) {
+    struct libusb_iso_packet_descriptor * desc = transfer->iso_packet_desc + packet;
+    int status = get_status(desc->status, desc->actual_length);
+    count_completion(stats, status, 0);
+    if (IS_ENDPOINT_OUT(transfer->endpoint)) {
+      usbdevices[device].callback.fp_write(usbdevices[device].callback.user, transfer->endpoint, status);
+    } else {
+      usbdevices[device].callback.fp_read(usbdevices[device].callback.user, transfer->endpoint,
+          libusb_get_iso_packet_buffer_simple(transfer, packet), status);
+    }
+  }
+
+  if (IS_ENDPOINT_IN(transfer->endpoint) && !usbdevices[device].closing) {
+    int ret = libusb_submit_transfer(transfer);
+    if (ret == LIBUSB_SUCCESS) {
+      record_submission(device, transfer->endpoint, transfer->num_iso_packets);
+      return;
+    }
+    PRINT_ERROR_LIBUSB("libusb_submit_transfer", ret)
+  }
+
+  if (IS_ENDPOINT_IN(transfer->endpoint)) {
+    --usbdevices[device].endpoints[(transfer->endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK) - 1].in.streaming;
+  }
+
+  remove_transfer(transfer);
+}
+
+static void process_transfer(struct libusb_transfer* transfer) {
+
+  int device = TRANSFER_DEVICE(transfer);
+
+  //make sure the device still exists, in case something went wrong
+  if(usbasync_check_device(device, __FILE__, __LINE__, __func__) < 0) {
+    remove_transfer(transfer);
+    return;
+  }
+
+  if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS && transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+    iso_callback(device, transfer);
+    return;
+  }
+
+  int status = get_status(transfer->status, transfer->actual_length);
+  if (status == E_TRANSFER_ERROR && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+    PRINT_TRANSFER_ERROR(transfer)
+  }
+  if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+    if (IS_ENDPOINT_IN(transfer->endpoint)) {
+      --usbdevices[device].endpoints[(transfer->endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK) - 1].in.streaming;
+    }
+    // all the packets of the transfer failed
+    s_gusb_endpoint_stats * stats = get_stats(device, get_stats_index(transfer->endpoint));
+    int packet;
+    for (packet = 0; packet < transfer->num_iso_packets; ++packet) {
+      count_completion(stats, status, transfer->status == LIBUSB_TRANSFER_CANCELLED);
+    }
+  } else {
+    record_completion(device, transfer->endpoint, status, transfer->status == LIBUSB_TRANSFER_CANCELLED, get_submit_time(transfer));
+  }
+  if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+      struct libusb_control_setup * setup = libusb_control_transfer_get_setup(transfer);
+      if(setup->bmRequestType & LIBUSB_ENDPOINT_IN) {
+        unsigned char * data = libusb_control_transfer_get_data(transfer);
+        usbdevices[device].callback.fp_read(usbdevices[device].callback.user, transfer->endpoint, data, status);
+      } else {
+        usbdevices[device].callback.fp_write(usbdevices[device].callback.user, transfer->endpoint, status);
+      }
+    } else {
+      if (IS_ENDPOINT_OUT(transfer->endpoint)) {
+        usbdevices[device].callback.fp_write(usbdevices[device].callback.user, transfer->endpoint, status);
+      } else {
+        usbdevices[device].callback.fp_read(usbdevices[device].callback.user, transfer->endpoint, transfer->buffer, status);
+      }
+    }
+  }
+
+  remove_transfer(transfer);
+}
+
+#ifdef USBASYNC_EVENT_THREAD
+static void push_completion(struct libusb_transfer * transfer, const struct timeval * reaped) {
+
+  unsigned int head = event_thread.head;
+
+  // the ring is large enough for the usual number of pending transfers, wait if it's full
+  while (head - __atomic_load_n(&event_thread.tail, __ATOMIC_ACQUIRE) == USBASYNC_RING_SIZE) {
+    sched_yield();
+  }
+
+  event_thread.ring[head & (USBASYNC_RING_SIZE - 1)].transfer = transfer;
+  event_thread.ring[head & (USBASYNC_RING_SIZE - 1)].reaped = *reaped;
+  __atomic_store_n(&event_thread.head, head + 1, __ATOMIC_RELEASE);
+
+  uint64_t value = 1;
+  if (write(event_thread.fd, &value, sizeof(value)) != sizeof(value)) {
+    PRINT_ERROR_OTHER("failed to signal the completion")
+  }
+}
+
+/*
+ * Process the completions queued by the event thread.
+ */
+static int drain_completions(int unused) {
+
+  uint64_t value;
+  if (read(event_thread.fd, &value, sizeof(value)) < 0) {
+    // nothing to read, the ring may still be drained
+  }
+
+  unsigned int tail = event_thread.tail;
+  unsigned int head = __atomic_load_n(&event_thread.head, __ATOMIC_ACQUIRE);
+
+  while (tail != head) {
+    struct libusb_transfer * transfer = event_thread.ring[tail & (USBASYNC_RING_SIZE - 1)].transfer;
+    reap_time = event_thread.ring[tail & (USBASYNC_RING_SIZE - 1)].reaped;
+    ++tail;
+    __atomic_store_n(&event_thread.tail, tail, __ATOMIC_RELEASE);
+    process_transfer(transfer);
+  }
+
+  return 0;
+}
+
+static void * event_thread_main(void * arg) {
+
+  while (!event_thread.stop) {
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+    int ret = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    if (ret != LIBUSB_SUCCESS && ret != LIBUSB_ERROR_INTERRUPTED) {
+      PRINT_ERROR_LIBUSB("libusb_handle_events_timeout_completed", ret)
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+int gusb_start_event_thread(int cpu) {
+
+  if (event_thread.running) {
+    return 0;
+  }
+
+  event_thread.fd = eventfd(0, EFD_NONBLOCK);
+  if (event_thread.fd < 0) {
+    PRINT_ERROR_OTHER("eventfd failed")
+    return -1;
+  }
+
+  event_thread.stop = 0;
+  event_thread.running = 1;
+
+  int ret = pthread_create(&event_thread.thread, NULL, event_thread_main, NULL);
+  if (ret != 0) {
+    PRINT_ERROR_OTHER("pthread_create failed")
+    event_thread.running = 0;
+    close(event_thread.fd);
+    event_thread.fd = -1;
+    return -1;
+  }
+
+  if (cpu >= 0) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    ret = pthread_setaffinity_np(event_thread.thread, sizeof(cpuset), &cpuset);
+    if (ret != 0) {
+      PRINT_ERROR_OTHER("pthread_setaffinity_np failed")
+    }
+  }
+
+  return 0;
+}
+
+static void stop_event_thread() {
+
+  if (!event_thread.running) {
+    return;
+  }
+
+  event_thread.stop = 1;
+  pthread_join(event_thread.thread, NULL);
+  event_thread.running = 0;
+
+  drain_completions(0);
+
+  gpoll_remove_fd(event_thread.fd);
+  close(event_thread.fd);
+  event_thread.fd = -1;
+}
+
+/*
+ * Wait for completions while cancelling transfers: they are handled by the event thread.
+ */
+static int wait_completions() {
+
+  struct pollfd pfd = { .fd = event_thread.fd, .events = POLLIN };
+  if (poll(&pfd, 1, USBASYNC_DEFAULT_TIMEOUT) <= 0) {
+    return -1;
+  }
+  return drain_completions(0);
+}
+#else
+int gusb_start_event_thread(int cpu) {
+
+  PRINT_ERROR_OTHER("the event thread is not supported on this platform")
+  return -1;
+}
+#endif
+
+static void usb_callback(struct libusb_transfer* transfer) {
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+#ifdef USBASYNC_EVENT_THREAD
+  if (event_thread.running) {
+    push_completion(transfer, &now);
+    return;
+  }
+#endif
+
+  reap_time = now;
+  process_transfer(transfer);
+}
+
+void gusb_get_reap_time(struct timeval * tv) {
+
+  *tv = reap_time;
+}
+
+static struct libusb_transfer * alloc_iso_transfer(int device, unsigned char endpoint, unsigned int packetSize, unsigned int nbPackets, unsigned int timeout) {
+
+  unsigned char * buf = calloc(packetSize * nbPackets, sizeof(char));
+  if (buf == NULL) {
+
+    PRINT_ERROR_ALLOC_FAILED("calloc")
+    return NULL;
+  }
+
+  struct libusb_transfer * transfer = libusb_alloc_transfer(nbPackets);
+  if (transfer == NULL) {
+
+    PRINT_ERROR_ALLOC_FAILED("libusb_alloc_transfer")
+    free(buf);
+    return NULL;
+  }
+
+  libusb_fill_iso_transfer(transfer, usbdevices[device].devh, endpoint, buf, packetSize * nbPackets, nbPackets,
+      (libusb_transfer_cb_fn) usb_callback, (void *) (intptr_t) device, timeout);
+  libusb_set_iso_packet_lengths(transfer, packetSize);
+  // isochronous transfers are not pooled: IN transfers are submitted again, and OUT transfers have a variable number of packets
+  transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+  return transfer;
+}
+
+/*
+ * Keep USBASYNC_ISO_TRANSFERS transfers of USBASYNC_ISO_PACKETS packets queued on an isochronous IN endpoint.
+ * The read callback is called for each packet, and the transfers are submitted again until the device is closed.
+ */
+static int start_iso_stream(int device, unsigned char endpoint, unsigned char endpointIndex) {
+
+  unsigned int size = usbdevices[device].endpoints[endpointIndex].in.size;
+
+  while (usbdevices[device].endpoints[endpointIndex].in.streaming < USBASYNC_ISO_TRANSFERS) {
+
+    struct libusb_transfer * transfer = alloc_iso_transfer(device, endpoint, size, USBASYNC_ISO_PACKETS, 0);
+    if (transfer == NULL) {
+      return -1;
+    }
+
+    if (submit_transfer(transfer) == -1) {
+      return -1;
+    }
+
+    record_submission(device, endpoint, USBASYNC_ISO_PACKETS);
+
+    ++usbdevices[device].endpoints[endpointIndex].in.streaming;
+  }
+
+  return 0;
+}
+
+/*
+ * Split the data into packets of at most wMaxPacketSize bytes.
+ * The write callback is called for each packet.
+ */
+static int write_iso(int device, unsigned char endpoint, const void * buf, unsigned int count) {
+
+  unsigned int size = usbdevices[device].endpoints[(endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK) - 1].out.size;
+
+  if (count == 0 || size == 0) {
+
+    PRINT_ERROR_OTHER("incorrect transfer size")
+    return -1;
+  }
+
+  unsigned int nbPackets = (count + size - 1) / size;
+
+  struct libusb_transfer * transfer = alloc_iso_transfer(device, endpoint, size, nbPackets, USBASYNC_ISO_OUT_TIMEOUT);
+  if (transfer == NULL) {
+    return -1;
+  }
+
+  memcpy(transfer->buffer, buf, count);
+  transfer->length = count;
+  transfer->iso_packet_desc[nbPackets - 1].length = count - (nbPackets - 1) * size;
+
+  int ret = submit_transfer(transfer);
+  if (ret != -1) {
+    record_submission(device, endpoint, nbPackets);
+  }
+  return ret;
+}
+
+static int libusb_submit(int device, unsigned char type, unsigned char endpoint, const void * buf, unsigned int count, unsigned int size) {
+
+  if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+
+    if (IS_ENDPOINT_IN(endpoint)) {
+      return start_iso_stream(device, endpoint, (endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK) - 1);
+    }
+    return write_iso(device, endpoint, buf, count);
+  }
+
+  struct libusb_transfer * transfer = acquire_transfer(device, endpoint, size);
+  if (transfer == NULL) {
+    return -1;
+  }
+
+  if (count) {
+    memcpy(transfer->buffer, buf, count);
+  }
+
+  switch (type) {
+  case LIBUSB_TRANSFER_TYPE_CONTROL:
+    libusb_fill_control_transfer(transfer, usbdevices[device].devh,
+        transfer->buffer, (libusb_transfer_cb_fn) usb_callback, (void *) (intptr_t) device, 50);
+    break;
+  case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+    libusb_fill_interrupt_transfer(transfer, usbdevices[device].devh, endpoint, transfer->buffer, size,
+        (libusb_transfer_cb_fn) usb_callback, (void *) (intptr_t) device, IS_ENDPOINT_IN(endpoint) ? 0 : USBASYNC_OUT_TIMEOUT);
+    break;
+  case LIBUSB_TRANSFER_TYPE_BULK:
+    libusb_fill_bulk_transfer(transfer, usbdevices[device].devh, endpoint, transfer->buffer, size,
+        (libusb_transfer_cb_fn) usb_callback, (void *) (intptr_t) device, IS_ENDPOINT_IN(endpoint) ? 0 : USBASYNC_BULK_OUT_TIMEOUT);
+    break;
+  default:
+    PRINT_ERROR_OTHER("unsupported endpoint type")
+    release_transfer(device, transfer);
+    return -1;
+  }
+
+  return submit_transfer(transfer);
+}
+
+int gusb_poll(int device, unsigned char endpoint) {
+
+  USBASYNC_CHECK_DEVICE(device, -1)
+
+  unsigned char endpointIndex = GET_ENDPOINT(device, endpoint, LIBUSB_ENDPOINT_IN, 0)
+  if(endpointIndex == INVALID_ENDPOINT_INDEX) {
+  
+    return -1;
+  }
+
+  if (usbdevices[device].callback.fp_read == NULL) {
+
+    PRINT_ERROR_OTHER("missing read callback")
+    return -1;
+  }
+
+  unsigned char type = usbdevices[device].endpoints[endpointIndex].in.type;
+
+  int ret = usbdevices[device].backend->submit(device, type, endpoint, NULL, 0, usbdevices[device].endpoints[endpointIndex].in.size);
+  // isochronous packets are counted when their transfers are submitted
+  if (ret >= 0 && type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+    record_submission(device, endpoint, 1);
+  }
+  return ret;
+}
+
+int gusb_handle_events(int unused) {
+#ifndef WIN32
+  return libusb_handle_events(ctx);
+#else
+  if(ctx != NULL)
   {
     struct timeval tv = { 0 };
     int ret = libusb_handle_events_timeout(ctx, &tv);
@@ -379,18 +1357,9 @@ int gusb_handle_events(int unused) {
 #endif
 }
 
-static int transfer_timeout(int device, unsigned char endpointIndex, unsigned char direction, const void * buf, unsigned int count, unsigned int timeout) {
+static int libusb_transfer_timeout(int device, unsigned char type, unsigned char endpointAddress, void * buf, unsigned int count, unsigned int timeout) {
 
   int transfered = -1;
-  
-  uint8_t endpointAddress = (endpointIndex + 1) | direction;
-
-  uint8_t type;
-  if (direction == LIBUSB_ENDPOINT_IN) {
-    type = usbdevices[device].endpoints[endpointIndex].in.type;
-  } else {
-    type = usbdevices[device].endpoints[endpointIndex].out.type;
-  }
 
   int ret = -1;
   switch (type) {
@@ -403,6 +1372,15 @@ static int transfer_timeout(int device, unsigned char endpointIndex, unsigned ch
       return -1;
     }
     break;
+  case LIBUSB_TRANSFER_TYPE_BULK:
+    ret = libusb_bulk_transfer(usbdevices[device].devh, endpointAddress,
+      (void *) buf, count, &transfered, timeout);
+    if (ret != LIBUSB_SUCCESS && ret != LIBUSB_ERROR_TIMEOUT) {
+
+      PRINT_ERROR_LIBUSB("libusb_bulk_transfer", ret)
+      return -1;
+    }
+    break;
   default:
     PRINT_ERROR_OTHER("unsupported endpoint type")
     break;
@@ -421,7 +1399,8 @@ int gusb_write_timeout(int device, unsigned char endpoint, const void * buf, uns
     return -1;
   }
 
-  return transfer_timeout(device, endpointIndex, LIBUSB_ENDPOINT_OUT, buf, count, timeout);
+  return usbdevices[device].backend->transfer_timeout(device, usbdevices[device].endpoints[endpointIndex].out.type,
+      endpoint, (void *) buf, count, timeout);
 }
 
 int gusb_read_timeout(int device, unsigned char endpoint, void * buf, unsigned int count, unsigned int timeout) {
@@ -434,67 +1413,179 @@ int gusb_read_timeout(int device, unsigned char endpoint, void * buf, unsigned i
     return -1;
   }
 
-  return transfer_timeout(device, endpointIndex, LIBUSB_ENDPOINT_IN, buf, count, timeout);
+  return usbdevices[device].backend->transfer_timeout(device, usbdevices[device].endpoints[endpointIndex].in.type,
+      endpoint, buf, count, timeout);
 }
 
-static int get_configurations (int device) {
+static void * arena_alloc(int device, size_t size) {
 
-  s_usb_descriptors * descriptors = &usbdevices[device].descriptors;
+  s_arena * arena = &usbdevices[device].arena;
 
-  descriptors->configurations = calloc(descriptors->device.bNumConfigurations, sizeof(*descriptors->configurations));
-  if (descriptors->configurations == NULL) {
-    PRINT_ERROR_ALLOC_FAILED("calloc");
-    return -1;
+  size = ARENA_ALIGN(size);
+  if (arena->used + size > usbdevices[device].descriptors.arenaSize) {
+    PRINT_ERROR_OTHER("descriptor arena is too small")
+    return NULL;
   }
-  
+
+  void * ptr = usbdevices[device].descriptors.arena + arena->used;
+  arena->used += size;
+  return ptr;
+}
+
+#define FOR_EACH_DESCRIPTOR(configuration, header) \
+  for (header = (void *)(configuration) + (configuration)->bLength; \
+      (void *)(header + 1) <= (void *)(configuration) + (configuration)->wTotalLength && header->bLength > 0; \
+      header = (void *)header + header->bLength)
+
+/*
+ * Simulated devices get their descriptors from their script.
+ */
+static int get_descriptor_data (int device, unsigned char bmRequestType, unsigned short wValue, unsigned short wIndex,
+    unsigned char * data, unsigned short wLength) {
+
+#ifdef USBASYNC_SIM
+  if (usbdevices[device].backend_type == E_GUSB_BACKEND_SIM) {
+    int ret = gusbsim_get_descriptor(device, bmRequestType, wValue, wIndex, data, wLength);
+    return ret < 0 ? LIBUSB_ERROR_PIPE : ret;
+  }
+#endif
+
+  return libusb_control_transfer(usbdevices[device].devh, bmRequestType, LIBUSB_REQUEST_GET_DESCRIPTOR, wValue, wIndex,
+      data, wLength, USBASYNC_DEFAULT_TIMEOUT);
+}
+
+/*
+ * Fetch the configuration descriptors into temporary buffers, which are moved to the arena later.
+ */
+static int get_configurations (int device, unsigned char ** raw) {
+
+  s_usb_descriptors * descriptors = &usbdevices[device].descriptors;
+
   unsigned char index;
   for (index = 0; index < descriptors->device.bNumConfigurations; ++index) {
   
     struct usb_config_descriptor descriptor;
     
-    int ret = libusb_control_transfer(usbdevices[device].devh, LIBUSB_ENDPOINT_IN,
-        LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_CONFIG << 8) | index, 0, (unsigned char *)&descriptor,
-        sizeof(descriptor), USBASYNC_DEFAULT_TIMEOUT);
+    int ret = get_descriptor_data(device, LIBUSB_ENDPOINT_IN, (LIBUSB_DT_CONFIG << 8) | index, 0,
+        (unsigned char *)&descriptor, sizeof(descriptor));
     
     if (ret < 0) {
       PRINT_ERROR_LIBUSB("libusb_control_transfer", ret)
       return -1;
     }
-    
-    struct p_configuration * configurations = descriptors->configurations + index;
 
-    configurations->raw = calloc(descriptor.wTotalLength, sizeof(unsigned char));
-    if (configurations->raw == NULL) {
+    if (descriptor.wTotalLength < sizeof(descriptor)) {
+      PRINT_ERROR_OTHER("bad configuration descriptor length")
+      return -1;
+    }
+
+    raw[index] = calloc(descriptor.wTotalLength, sizeof(unsigned char));
+    if (raw[index] == NULL) {
       PRINT_ERROR_ALLOC_FAILED("calloc");
       return -1;
     }
     
-    ret = libusb_control_transfer(usbdevices[device].devh, LIBUSB_ENDPOINT_IN,
-        LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_CONFIG << 8) | index, 0, configurations->raw,
-        descriptor.wTotalLength, USBASYNC_DEFAULT_TIMEOUT);
+    ret = get_descriptor_data(device, LIBUSB_ENDPOINT_IN, (LIBUSB_DT_CONFIG << 8) | index, 0, raw[index],
+        descriptor.wTotalLength);
     
     if (ret < 0) {
       PRINT_ERROR_LIBUSB("libusb_control_transfer", ret)
       return -1;
     }
+
+    // the second read may return a different length, only trust the first one
+    ((struct usb_config_descriptor *) raw[index])->wTotalLength = descriptor.wTotalLength;
   }
 
   return 0;
 }
 
+static unsigned short get_report_descriptor_length (struct usb_hid_descriptor * hid) {
+
+  unsigned char rdescIndex;
+  for (rdescIndex = 0; rdescIndex < hid->bNumDescriptors; ++ rdescIndex) {
+    if (hid->rdesc[rdescIndex].wReportDescriptorLength > 0) {
+      return hid->rdesc[rdescIndex].wReportDescriptorLength;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Compute an upper bound of the arena size, from the device descriptor and the raw configuration descriptors.
+ * All the other allocations of the tree must be accounted here.
+ */
+static size_t measure_descriptors (int device, unsigned char ** raw) {
+
+  s_usb_descriptors * descriptors = &usbdevices[device].descriptors;
+
+  size_t size = ARENA_ALIGN(descriptors->device.bNumConfigurations * sizeof(*descriptors->configurations));
+
+  unsigned int nbStrings = (descriptors->device.iManufacturer != 0) + (descriptors->device.iProduct != 0)
+      + (descriptors->device.iSerialNumber != 0);
+  unsigned int nbReports = 0;
+  unsigned int nbEndpoints = 0;
+
+  unsigned char index;
+  for (index = 0; index < descriptors->device.bNumConfigurations; ++index) {
+
+    struct usb_config_descriptor * configuration = (struct usb_config_descriptor *) raw[index];
+
+    size += ARENA_ALIGN(configuration->wTotalLength);
+    size += ARENA_ALIGN(configuration->bNumInterfaces * sizeof(*descriptors->configurations->interfaces));
+
+    nbStrings += (configuration->iConfiguration != 0);
+
+    unsigned int nbAltInterfaces = 0;
+    unsigned int nbConfigurationEndpoints = 0;
+
+    struct usb_descriptor_header * header;
+    FOR_EACH_DESCRIPTOR(configuration, header) {
+      switch (header->bDescriptorType) {
+      case LIBUSB_DT_INTERFACE:
+        ++nbAltInterfaces;
+        nbStrings += (((struct usb_interface_descriptor *) header)->iInterface != 0);
+        break;
+      case LIBUSB_DT_ENDPOINT:
+        ++nbConfigurationEndpoints;
+        break;
+      case LIBUSB_DT_HID:
+        {
+          unsigned short length = get_report_descriptor_length((struct usb_hid_descriptor *) header);
+          if (length > 0) {
+            size += ARENA_ALIGN(length);
+            ++nbReports;
+          }
+        }
+        break;
+      default:
+        break;
+      }
+    }
+
+    size += ARENA_ALIGN(nbAltInterfaces * sizeof(struct p_altInterface));
+    size += ARENA_ALIGN(nbConfigurationEndpoints * sizeof(struct usb_endpoint_descriptor *));
+    nbEndpoints += nbConfigurationEndpoints;
+  }
+
+  size += ARENA_ALIGN(nbEndpoints * sizeof(*descriptors->endpoints));
+
+  usbdevices[device].arena.maxOthers = nbStrings + nbReports;
+  size += ARENA_ALIGN(usbdevices[device].arena.maxOthers * sizeof(*descriptors->others));
+  size += nbStrings * ARENA_ALIGN(DEFAULT_STRING_BUFFER_SIZE);
+
+  return size;
+}
+
 static int add_descriptor (int device, unsigned short wValue, unsigned short wIndex, unsigned short wLength, unsigned char * data) {
 
   s_usb_descriptors * descriptors = &usbdevices[device].descriptors;
   
-  void * ptr = realloc(descriptors->others, (descriptors->nbOthers + 1) * sizeof(*descriptors->others));
-  if (ptr == NULL) {
-    PRINT_ERROR_ALLOC_FAILED("realloc");
-    free(data);
+  if (descriptors->nbOthers == usbdevices[device].arena.maxOthers) {
+    PRINT_ERROR_OTHER("too many descriptors")
     return -1;
   }
 
-  descriptors->others = ptr;
-  memset(descriptors->others + descriptors->nbOthers, 0x00, sizeof(*descriptors->others));
   descriptors->others[descriptors->nbOthers].wValue = wValue;
   descriptors->others[descriptors->nbOthers].wIndex = wIndex;
   descriptors->others[descriptors->nbOthers].wLength = wLength;
@@ -508,42 +1599,20 @@ static int get_string_descriptor (int device, unsigned char index) {
 
   s_usb_descriptors * descriptors = &usbdevices[device].descriptors;
 
-  unsigned char * data = calloc(DEFAULT_STRING_BUFFER_SIZE, sizeof(*data));
+  // a descriptor length is 8 bits, so that the buffer is always large enough
+  unsigned char * data = arena_alloc(device, DEFAULT_STRING_BUFFER_SIZE);
   if (data == NULL) {
-    PRINT_ERROR_ALLOC_FAILED("calloc");
     return -1;
   }
 
-  int ret = libusb_control_transfer(usbdevices[device].devh, LIBUSB_ENDPOINT_IN,
-      LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_STRING << 8) | index, descriptors->langId0.wData[0], data, DEFAULT_STRING_BUFFER_SIZE, USBASYNC_DEFAULT_TIMEOUT);
+  int ret = get_descriptor_data(device, LIBUSB_ENDPOINT_IN, (LIBUSB_DT_STRING << 8) | index, descriptors->langId0.wData[0],
+      data, DEFAULT_STRING_BUFFER_SIZE);
 
   if (ret < 0) {
     PRINT_ERROR_LIBUSB("libusb_control_transfer", ret)
-    free(data);
     return -1;
   }
 
-  struct usb_descriptor_header * descriptor = (struct usb_descriptor_header *)data;
-
-  if (descriptor->bLength > ret) {
-    void * ptr = realloc(data, descriptor->bLength * sizeof(*data));
-    if (ptr == NULL) {
-      PRINT_ERROR_ALLOC_FAILED("realloc");
-      free(data);
-      return -1;
-    }
-
-    data = ptr;
-
-    ret = libusb_control_transfer(usbdevices[device].devh, LIBUSB_ENDPOINT_IN,
-        LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_STRING << 8) | index, descriptors->langId0.wData[0], data, descriptor->bLength, USBASYNC_DEFAULT_TIMEOUT);
-    if (ret < 0) {
-      PRINT_ERROR_LIBUSB("libusb_control_transfer", ret)
-      free(data);
-      return -1;
-    }
-  }
-    
   return add_descriptor(device, (LIBUSB_DT_STRING << 8) | index, descriptors->langId0.wData[0], ret, data);
 }
 
@@ -558,14 +1627,7 @@ static int probe_interface (int device, unsigned char configurationIndex, struct
 
   struct p_interface * pInterface = pConfiguration->interfaces + interface->bInterfaceNumber;
 
-  void * altInterfaces = realloc(pInterface->altInterfaces, (pInterface->bNumAltInterfaces + 1) * sizeof(*pInterface->altInterfaces));
-  if(altInterfaces == NULL) {
-    PRINT_ERROR_ALLOC_FAILED("realloc");
-    return -1;
-  }
-
-  pInterface->altInterfaces = altInterfaces;
-  memset(pInterface->altInterfaces + pInterface->bNumAltInterfaces, 0x00, sizeof(*pInterface->altInterfaces));
+  // the array was sized in probe_configurations
   pInterface->altInterfaces[pInterface->bNumAltInterfaces].descriptor = interface;
   ++pInterface->bNumAltInterfaces;
 
@@ -614,16 +1676,23 @@ static int probe_hid (int device, unsigned char configurationIndex, struct usb_i
   unsigned char rdescIndex;
   for (rdescIndex = 0; rdescIndex < hid->bNumDescriptors; ++ rdescIndex) {
     if (hid->rdesc[rdescIndex].wReportDescriptorLength > 0) {
-      unsigned char * data = calloc(hid->rdesc[rdescIndex].wReportDescriptorLength, sizeof(unsigned char));
+      unsigned char * data = arena_alloc(device, hid->rdesc[rdescIndex].wReportDescriptorLength);
       if (data == NULL) {
-        PRINT_ERROR_ALLOC_FAILED("calloc")
         return -1;
       }
-      int ret = libusb_control_transfer(usbdevices[device].devh, LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_INTERFACE,
-          LIBUSB_REQUEST_GET_DESCRIPTOR, (hid->rdesc[rdescIndex].bReportDescriptorType << 8) | 0, pAltInterface->descriptor->bInterfaceNumber, data, hid->rdesc[rdescIndex].wReportDescriptorLength, USBASYNC_DEFAULT_TIMEOUT);
+      int ret;
+#ifdef USBASYNC_HIDRAW
+      if (usbdevices[device].backend_type == E_GUSB_BACKEND_HIDRAW) {
+        // the interface is owned by the kernel driver
+        libusb_device * dev = libusb_get_device(usbdevices[device].devh);
+        ret = gusbhid_get_report_descriptor(libusb_get_bus_number(dev), libusb_get_device_address(dev),
+            pAltInterface->descriptor->bInterfaceNumber, data, hid->rdesc[rdescIndex].wReportDescriptorLength);
+      } else
+#endif
+      ret = get_descriptor_data(device, LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_INTERFACE,
+          (hid->rdesc[rdescIndex].bReportDescriptorType << 8) | 0, pAltInterface->descriptor->bInterfaceNumber, data, hid->rdesc[rdescIndex].wReportDescriptorLength);
       if (ret < 0) {
         PRINT_ERROR_LIBUSB("libusb_control_transfer", ret)
-        free(data);
         return -1;
       }
       
@@ -634,26 +1703,27 @@ static int probe_hid (int device, unsigned char configurationIndex, struct usb_i
   return 0;
 }
 
-static int probe_endpoint (int device, unsigned char configurationIndex, struct usb_interface_descriptor * interface, struct usb_endpoint_descriptor * endpoint) {
+static int probe_endpoint (int device, unsigned char configurationIndex, struct usb_interface_descriptor * interface,
+    struct usb_endpoint_descriptor * endpoint, struct usb_endpoint_descriptor *** cursor) {
 
   struct p_altInterface * pAltInterface = get_interface(device, configurationIndex, interface);
   if (pAltInterface == NULL) {
     return -1;
   }
 
-  void * endpoints = realloc(pAltInterface->endpoints, (pAltInterface->bNumEndpoints + 1) * sizeof(*pAltInterface->endpoints));
-  if(endpoints == NULL) {
-    PRINT_ERROR_ALLOC_FAILED("realloc");
-    return -1;
+  // the endpoints of an alternate setting directly follow its interface descriptor
+  if (pAltInterface->bNumEndpoints == 0) {
+    pAltInterface->endpoints = *cursor;
   }
-
-  pAltInterface->endpoints = endpoints;
-  memset(pAltInterface->endpoints + pAltInterface->bNumEndpoints, 0x00, sizeof(*pAltInterface->endpoints));
-  pAltInterface->endpoints[pAltInterface->bNumEndpoints] = endpoint;
+  *(*cursor)++ = endpoint;
   ++pAltInterface->bNumEndpoints;
 
   uint16_t size = endpoint->wMaxPacketSize;
   uint8_t type = endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+  if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+    // bits 12..11 give the number of additional transactions per microframe (high speed)
+    size = (size & 0x07ff) * (1 + ((size >> 11) & 0x03));
+  }
   uint8_t endpointNumber = endpoint->bEndpointAddress & LIBUSB_ENDPOINT_ADDRESS_MASK;
   if (endpointNumber > 0) {
     if (IS_ENDPOINT_IN(endpoint->bEndpointAddress)) {
@@ -668,7 +1738,7 @@ static int probe_endpoint (int device, unsigned char configurationIndex, struct
   return 0;
 }
 
-static int probe_configurations (int device) {
+static int probe_configurations (int device, unsigned char ** raw) {
 
   s_usb_descriptors * descriptors = &usbdevices[device].descriptors;
 
@@ -676,47 +1746,78 @@ static int probe_configurations (int device) {
 
   unsigned char index;
   for (index = 0; index < descriptors->device.bNumConfigurations; ++index) {
-  
-    void * ptr = descriptors->configurations[index].raw;
 
-    descriptors->configurations[index].descriptor = ptr;
-    struct usb_config_descriptor * configuration = ptr;
+    struct usb_config_descriptor * configuration = (struct usb_config_descriptor *) raw[index];
+    struct p_configuration * pConfiguration = descriptors->configurations + index;
 
-    descriptors->configurations[index].interfaces = calloc(configuration->bNumInterfaces, sizeof(*descriptors->configurations[index].interfaces));
-    if (descriptors->configurations[index].interfaces == NULL) {
-        PRINT_ERROR_ALLOC_FAILED("calloc");
-        return -1;
+    pConfiguration->raw = arena_alloc(device, configuration->wTotalLength);
+    if (pConfiguration->raw == NULL) {
+      return -1;
+    }
+    memcpy(pConfiguration->raw, raw[index], configuration->wTotalLength);
+
+    configuration = (struct usb_config_descriptor *) pConfiguration->raw;
+    pConfiguration->descriptor = configuration;
+
+    pConfiguration->interfaces = arena_alloc(device, configuration->bNumInterfaces * sizeof(*pConfiguration->interfaces));
+    if (pConfiguration->interfaces == NULL) {
+      return -1;
     }
   
     if (configuration->iConfiguration) {
       get_string_descriptor (device, configuration->iConfiguration);
     }
-    
-    ptr += configuration->bLength;
+
+    // size the alternate setting and endpoint arrays
+    unsigned int nbAltInterfaces = 0;
+    unsigned int nbEndpoints = 0;
+    struct usb_descriptor_header * header;
+    FOR_EACH_DESCRIPTOR(configuration, header) {
+      if (header->bDescriptorType == LIBUSB_DT_INTERFACE) {
+        unsigned char number = ((struct usb_interface_descriptor *) header)->bInterfaceNumber;
+        if (number < configuration->bNumInterfaces) {
+          ++pConfiguration->interfaces[number].bNumAltInterfaces;
+          ++nbAltInterfaces;
+        }
+      } else if (header->bDescriptorType == LIBUSB_DT_ENDPOINT) {
+        ++nbEndpoints;
+      }
+    }
+
+    struct p_altInterface * altInterfaces = arena_alloc(device, nbAltInterfaces * sizeof(*altInterfaces));
+    struct usb_endpoint_descriptor ** endpoints = arena_alloc(device, nbEndpoints * sizeof(*endpoints));
+    if (altInterfaces == NULL || endpoints == NULL) {
+      return -1;
+    }
+
+    unsigned char interfaceIndex;
+    for (interfaceIndex = 0; interfaceIndex < configuration->bNumInterfaces; ++interfaceIndex) {
+      struct p_interface * pInterface = pConfiguration->interfaces + interfaceIndex;
+      pInterface->altInterfaces = altInterfaces;
+      altInterfaces += pInterface->bNumAltInterfaces;
+      pInterface->bNumAltInterfaces = 0; // counted again by probe_interface
+    }
 
     struct usb_interface_descriptor * interface = NULL;
   
-    while (ptr < (void *)configuration + configuration->wTotalLength) {
-      
-      struct usb_descriptor_header * header = ptr;
+    FOR_EACH_DESCRIPTOR(configuration, header) {
       
       switch (header->bDescriptorType) {
-      break;
       case LIBUSB_DT_INTERFACE:
-      interface = ptr;
-      ret = probe_interface(device, index, ptr);
+      interface = (struct usb_interface_descriptor *) header;
+      ret = probe_interface(device, index, interface);
       if (ret < 0) {
         return -1;
       }
       break;
       case LIBUSB_DT_ENDPOINT:
-      ret = probe_endpoint(device, index, interface, ptr);
+      ret = probe_endpoint(device, index, interface, (struct usb_endpoint_descriptor *) header, &endpoints);
       if (ret < 0) {
         return -1;
       }
       break;
       case LIBUSB_DT_HID:
-        ret = probe_hid(device, index, interface, ptr);
+        ret = probe_hid(device, index, interface, (struct usb_hid_descriptor *) header);
         if (ret < 0) {
           return -1;
         }
@@ -730,27 +1831,77 @@ static int probe_configurations (int device) {
       fprintf(stderr, "unhandled descriptor type: 0x%02x\n", header->bDescriptorType);
       break;
       }
-      
-      ptr += header->bLength;
     }
   }
   
   return 0;
 }
 
+/*
+ * Build the flat endpoint index, in the same order as a walk of the tree.
+ */
+static int index_endpoints (int device) {
+
+  s_usb_descriptors * descriptors = &usbdevices[device].descriptors;
+
+  unsigned int pass;
+  for (pass = 0; pass < 2; ++pass) {
+    unsigned int nbEndpoints = 0;
+    unsigned char configurationIndex;
+    for (configurationIndex = 0; configurationIndex < descriptors->device.bNumConfigurations; ++configurationIndex) {
+      struct p_configuration * pConfiguration = descriptors->configurations + configurationIndex;
+      unsigned char interfaceIndex;
+      for (interfaceIndex = 0; interfaceIndex < pConfiguration->descriptor->bNumInterfaces; ++interfaceIndex) {
+        struct p_interface * pInterface = pConfiguration->interfaces + interfaceIndex;
+        unsigned char altInterfaceIndex;
+        for (altInterfaceIndex = 0; altInterfaceIndex < pInterface->bNumAltInterfaces; ++altInterfaceIndex) {
+          struct p_altInterface * pAltInterface = pInterface->altInterfaces + altInterfaceIndex;
+          unsigned char endpointIndex;
+          for (endpointIndex = 0; endpointIndex < pAltInterface->bNumEndpoints; ++endpointIndex) {
+            if (pass == 1) {
+              struct p_endpoint * pEndpoint = descriptors->endpoints + nbEndpoints;
+              pEndpoint->configurationIndex = configurationIndex;
+              pEndpoint->interfaceIndex = interfaceIndex;
+              pEndpoint->altInterfaceIndex = altInterfaceIndex;
+              pEndpoint->descriptor = pAltInterface->endpoints[endpointIndex];
+            }
+            ++nbEndpoints;
+          }
+        }
+      }
+    }
+    if (pass == 0) {
+      descriptors->endpoints = arena_alloc(device, nbEndpoints * sizeof(*descriptors->endpoints));
+      if (descriptors->endpoints == NULL) {
+        return -1;
+      }
+    } else {
+      descriptors->nbEndpoints = nbEndpoints;
+    }
+  }
+
+  return 0;
+}
+
 static int get_device (int device) {
 
   struct usb_device_descriptor * descriptor = &usbdevices[device].descriptors.device;
   
-  int ret = libusb_control_transfer(usbdevices[device].devh, LIBUSB_ENDPOINT_IN,
-      LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_DEVICE << 8) | 0, 0, (unsigned char *)descriptor,
-      sizeof(*descriptor), USBASYNC_DEFAULT_TIMEOUT);
+  int ret = get_descriptor_data(device, LIBUSB_ENDPOINT_IN, (LIBUSB_DT_DEVICE << 8) | 0, 0, (unsigned char *)descriptor,
+      sizeof(*descriptor));
   
   if (ret < 0) {
     PRINT_ERROR_LIBUSB("libusb_control_transfer", ret)
     return -1;
   }
-  
+
+  return 0;
+}
+
+static void get_device_strings (int device) {
+
+  struct usb_device_descriptor * descriptor = &usbdevices[device].descriptors.device;
+
   if (descriptor->iManufacturer) {
     get_string_descriptor (device, descriptor->iManufacturer);
   }
@@ -762,43 +1913,75 @@ static int get_device (int device) {
   if (descriptor->iSerialNumber) {
     get_string_descriptor (device, descriptor->iSerialNumber);
   }
-
-  return 0;
 }
 
 static void get_lang_id_0 (int device) {
 
   struct usb_string_descriptor * descriptor = &usbdevices[device].descriptors.langId0;
 
-  int ret = libusb_control_transfer(usbdevices[device].devh, LIBUSB_ENDPOINT_IN,
-      LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_STRING << 8) | 0, 0, (unsigned char *)descriptor,
-      sizeof(*descriptor), USBASYNC_DEFAULT_TIMEOUT);
+  int ret = get_descriptor_data(device, LIBUSB_ENDPOINT_IN, (LIBUSB_DT_STRING << 8) | 0, 0, (unsigned char *)descriptor,
+      sizeof(*descriptor));
   
   if (ret < 0) {
     PRINT_ERROR_LIBUSB("libusb_control_transfer", ret)
   }
 }
 
+/*
+ * The descriptor tree is stored in a single arena, which is sized before being filled,
+ * so that the pointers into it never move, and that it is freed at once.
+ */
 static int get_descriptors (int device) {
 
+  s_usb_descriptors * descriptors = &usbdevices[device].descriptors;
+
   get_lang_id_0(device);
   
   int ret = get_device(device);
   if (ret < 0) {
     return -1;
   }
-  
-  if(usbdevices[device].descriptors.device.bNumConfigurations == 0) {
-    PRINT_ERROR_OTHER("device has no configuration")
-    return -1;
+  
+  if(descriptors->device.bNumConfigurations == 0) {
+    PRINT_ERROR_OTHER("device has no configuration")
+    return -1;
+  }
+  
+  unsigned char * raw[UCHAR_MAX] = { };
+
+  ret = get_configurations(device, raw);
+  if (ret == 0) {
+    descriptors->arenaSize = measure_descriptors(device, raw);
+    descriptors->arena = calloc(descriptors->arenaSize, sizeof(unsigned char));
+    if (descriptors->arena == NULL) {
+      PRINT_ERROR_ALLOC_FAILED("calloc")
+      ret = -1;
+    }
+  }
+
+  if (ret == 0) {
+    descriptors->configurations = arena_alloc(device, descriptors->device.bNumConfigurations * sizeof(*descriptors->configurations));
+    descriptors->others = arena_alloc(device, usbdevices[device].arena.maxOthers * sizeof(*descriptors->others));
+    if (descriptors->configurations == NULL || descriptors->others == NULL) {
+      ret = -1;
+    }
+  }
+
+  if (ret == 0) {
+    get_device_strings(device);
+    ret = probe_configurations(device, raw);
+  }
+
+  if (ret == 0) {
+    ret = index_endpoints(device);
   }
-  
-  ret = get_configurations(device);
-  if (ret < 0) {
-    return -1;
+
+  unsigned char index;
+  for (index = 0; index < descriptors->device.bNumConfigurations; ++index) {
+    free(raw[index]);
   }
-  
-  return probe_configurations(device);
+
+  return ret;
 }
 
 static int handle_interfaces(int device, int claim) {
@@ -848,7 +2031,26 @@ static int handle_interfaces(int device, int claim) {
   return 0;
 }
 
-static int claim_device(int device, libusb_device * dev, struct libusb_device_descriptor * desc) {
+/*
+ * Return the number of microseconds since *start, and reset *start to the current time.
+ */
+static unsigned int lap_time(struct timeval * start) {
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  unsigned int elapsed = (now.tv_sec - start->tv_sec) * 1000000 + now.tv_usec - start->tv_usec;
+  *start = now;
+  return elapsed;
+}
+
+static int claim_device(int device, libusb_device * dev, struct libusb_device_descriptor * desc, e_gusb_backend backend) {
+
+  s_gusb_attach_times * times = &usbdevices[device].attach_times;
+  memset(times, 0x00, sizeof(*times));
+
+  struct timeval start, lap;
+  gettimeofday(&start, NULL);
+  lap = start;
 
   int ret = libusb_open(dev, &usbdevices[device].devh);
   if (ret != LIBUSB_SUCCESS) {
@@ -856,6 +2058,24 @@ static int claim_device(int device, libusb_device * dev, struct libusb_device_de
     return -1;
   }
 
+  times->open = lap_time(&lap);
+
+  usbdevices[device].backend_type = backend;
+
+#ifdef USBASYNC_HIDRAW
+  if (backend == E_GUSB_BACKEND_HIDRAW) {
+    // the kernel driver stays attached, and the device is neither reset nor configured
+    ret = hidraw_open(device, dev);
+    if (ret == 0) {
+      init_stats(device, dev);
+    }
+    times->descriptors = lap_time(&lap);
+    times->total = lap_time(&start);
+    return ret;
+  }
+#endif
+
+  // with auto detach, the kernel drivers are only detached from the claimed interfaces
 #if defined(LIBUSB_API_VERSION) || defined(LIBUSBX_API_VERSION)
   libusb_set_auto_detach_kernel_driver(usbdevices[device].devh, 1);
 #else
@@ -878,294 +2098,744 @@ static int claim_device(int device, libusb_device * dev, struct libusb_device_de
 #endif
 #endif
 
-  ret = libusb_reset_device(usbdevices[device].devh);
-  if (ret != LIBUSB_SUCCESS) {
-    PRINT_ERROR_LIBUSB("libusb_reset_device", ret)
+  int configuration;
+
+  if (fast_attach) {
+    ret = libusb_get_configuration(usbdevices[device].devh, &configuration);
+    if (ret != LIBUSB_SUCCESS) {
+      PRINT_ERROR_LIBUSB("libusb_get_configuration", ret)
+      return -1;
+    }
+    // the reset can only be skipped if the device is already in the first configuration
+    times->fast = (configuration == 1);
+    if (!times->fast) {
+      fprintf(stderr, "fast attach is not possible (configuration is %d)\n", configuration);
+    }
+  }
+
+  if (!times->fast) {
+
+    ret = libusb_reset_device(usbdevices[device].devh);
+    if (ret != LIBUSB_SUCCESS) {
+      PRINT_ERROR_LIBUSB("libusb_reset_device", ret)
+      return -1;
+    }
+
+    times->reset = lap_time(&lap);
+
+    ret = libusb_get_configuration(usbdevices[device].devh, &configuration);
+    if (ret != LIBUSB_SUCCESS) {
+      PRINT_ERROR_LIBUSB("libusb_get_configuration", ret)
+      return -1;
+    }
+
+    if (configuration == 0) {
+      configuration = 1;
+      ret = libusb_set_configuration(usbdevices[device].devh, 1); //warning: this is a blocking function
+      if (ret != LIBUSB_SUCCESS) {
+        PRINT_ERROR_LIBUSB("libusb_set_configuration", ret)
+        return -1;
+      }
+    }
+  }
+
+  times->configuration = lap_time(&lap);
+
+  if (backend == E_GUSB_BACKEND_LIBUSB) {
+    usbdevices[device].backend = &libusb_backend;
+    ret = handle_interfaces(device, 1);
+    if(ret < 0) {
+        return -1;
+    }
+  }
+
+  times->claim = lap_time(&lap);
+
+  // Don't use libusb_get_config_descriptor: it squeezes out some parts of the descriptor!
+  ret = get_descriptors(device);
+  if(ret < 0) {
+      return -1;
+  }
+
+  times->descriptors = lap_time(&lap);
+
+#ifdef USBASYNC_USBFS
+  if (backend == E_GUSB_BACKEND_USBFS) {
+    ret = usbfs_open(device, dev);
+    if(ret < 0) {
+        return -1;
+    }
+    usbdevices[device].backend = &usbfs_backend;
+    times->claim += lap_time(&lap);
+  }
+#endif
+
+  init_stats(device, dev);
+
+  times->total = lap_time(&start);
+
+  return 0;
+}
+
+void gusb_set_fast_attach(int enable) {
+
+  fast_attach = enable;
+}
+
+int gusb_get_attach_times(int device, s_gusb_attach_times * times) {
+
+  USBASYNC_CHECK_DEVICE(device, -1)
+
+  *times = usbdevices[device].attach_times;
+
+  return 0;
+}
+
+static int add_enumerated(s_usb_dev ** usb_devs, unsigned int * nb_usb_devs, unsigned int entry) {
+
+  char * path = strdup(usb_index.entries[entry].path);
+  if (path == NULL) {
+    PRINT_ERROR_OTHER("strdup failed")
     return -1;
   }
 
-  int configuration;
-  
-  ret = libusb_get_configuration(usbdevices[device].devh, &configuration);
+  void * ptr = realloc(*usb_devs, (*nb_usb_devs + 1) * sizeof(**usb_devs));
+  if (ptr == NULL) {
+    PRINT_ERROR_ALLOC_FAILED("realloc")
+    free(path);
+    return -1;
+  }
+
+  *usb_devs = ptr;
+
+  if (*nb_usb_devs > 0) {
+    (*usb_devs)[*nb_usb_devs - 1].next = 1;
+  }
+
+  (*usb_devs)[*nb_usb_devs].path = path;
+  (*usb_devs)[*nb_usb_devs].vendor_id = usb_index.entries[entry].desc.idVendor;
+  (*usb_devs)[*nb_usb_devs].product_id = usb_index.entries[entry].desc.idProduct;
+  (*usb_devs)[*nb_usb_devs].next = 0;
+
+  ++*nb_usb_devs;
+
+  return 0;
+}
+
+s_usb_dev * gusb_enumerate(unsigned short vendor, unsigned short product) {
+
+  s_usb_dev * usb_devs = NULL;
+  unsigned int nb_usb_devs = 0;
+
+  if (refresh_index() < 0) {
+    return NULL;
+  }
+
+  INDEX_LOCK()
+
+  if (vendor && product) {
+    unsigned int link;
+    for (link = usb_index.ids_buckets[hash_ids(vendor, product)]; link != 0; link = usb_index.entries[link - 1].next_ids) {
+      if (usb_index.entries[link - 1].desc.idVendor == vendor && usb_index.entries[link - 1].desc.idProduct == product) {
+        add_enumerated(&usb_devs, &nb_usb_devs, link - 1);
+      }
+    }
+  } else {
+    unsigned int entry;
+    for (entry = 0; entry < USBASYNC_INDEX_SIZE; ++entry) {
+      if (usb_index.entries[entry].dev == NULL) {
+        continue;
+      }
+      if (vendor && usb_index.entries[entry].desc.idVendor != vendor) {
+        continue;
+      }
+      add_enumerated(&usb_devs, &nb_usb_devs, entry);
+    }
+  }
+
+  INDEX_UNLOCK()
+
+  return usb_devs;
+}
+
+void gusb_free_enumeration(s_usb_dev * usb_devs) {
+
+  s_usb_dev * current;
+  for (current = usb_devs; current != NULL; ++current) {
+
+    free(current->path);
+
+    if (current->next == 0) {
+      break;
+    }
+  }
+  free(usb_devs);
+}
+
+int gusb_open_ids(unsigned short vendor, unsigned short product) {
+
+  struct {
+    libusb_device * dev;
+    struct libusb_device_descriptor desc;
+    char path[USBASYNC_PATH_SIZE];
+  } candidates[USBASYNC_INDEX_SIZE];
+  unsigned int nb_candidates = 0;
+
+  if (refresh_index() < 0) {
+    return -1;
+  }
+
+  // the devices are referenced, so that they can be claimed outside of the lock
+  INDEX_LOCK()
+
+  unsigned int link;
+  for (link = usb_index.ids_buckets[hash_ids(vendor, product)]; link != 0; link = usb_index.entries[link - 1].next_ids) {
+    if (usb_index.entries[link - 1].desc.idVendor == vendor && usb_index.entries[link - 1].desc.idProduct == product) {
+      candidates[nb_candidates].dev = libusb_ref_device(usb_index.entries[link - 1].dev);
+      candidates[nb_candidates].desc = usb_index.entries[link - 1].desc;
+      strcpy(candidates[nb_candidates].path, usb_index.entries[link - 1].path);
+      ++nb_candidates;
+    }
+  }
+
+  INDEX_UNLOCK()
+
+  int device = -1;
+
+  unsigned int candidate;
+  for (candidate = 0; candidate < nb_candidates; ++candidate) {
+
+    if (device < 0) {
+      device = add_device(candidates[candidate].path, 0);
+      if (device >= 0 && claim_device(device, candidates[candidate].dev, &candidates[candidate].desc, E_GUSB_BACKEND_LIBUSB) == -1) {
+        gusb_close(device);
+        device = -1;
+      }
+    }
+
+    libusb_unref_device(candidates[candidate].dev);
+  }
+
+  return device;
+}
+
+int gusb_open_path(const char * path) {
+
+  return gusb_open_path_backend(path, E_GUSB_BACKEND_LIBUSB);
+}
+
+int gusb_open_path_backend(const char * path, e_gusb_backend backend) {
+
+  if (path == NULL) {
+    PRINT_ERROR_OTHER("path is NULL");
+    return -1;
+  }
+
+#ifndef USBASYNC_USBFS
+  if (backend == E_GUSB_BACKEND_USBFS) {
+    PRINT_ERROR_OTHER("the usbfs backend is not supported on this platform");
+    return -1;
+  }
+#endif
+#ifndef USBASYNC_HIDRAW
+  if (backend == E_GUSB_BACKEND_HIDRAW) {
+    PRINT_ERROR_OTHER("the hidraw backend is not supported on this platform");
+    return -1;
+  }
+#endif
+#ifndef USBASYNC_SIM
+  if (backend == E_GUSB_BACKEND_SIM) {
+    PRINT_ERROR_OTHER("the simulated backend is not supported on this platform");
+    return -1;
+  }
+#else
+  if (backend == E_GUSB_BACKEND_SIM) {
+    return sim_open(path);
+  }
+#endif
+
+  if (refresh_index() < 0) {
+    return -1;
+  }
+
+  libusb_device * dev = NULL;
+  struct libusb_device_descriptor desc;
+
+  // the device is referenced, so that it can be claimed outside of the lock
+  INDEX_LOCK()
+
+  int entry = index_find_path(path);
+  if (entry >= 0) {
+    dev = libusb_ref_device(usb_index.entries[entry].dev);
+    desc = usb_index.entries[entry].desc;
+  }
+
+  INDEX_UNLOCK()
+
+  if (dev == NULL) {
+    return -1;
+  }
+
+  int device = add_device(path, 0);
+  if (device >= 0 && claim_device(device, dev, &desc, backend) == -1) {
+    gusb_close(device);
+    device = -1;
+  }
+
+  libusb_unref_device(dev);
+
+  return device;
+}
+
+s_usb_descriptors * gusb_get_usb_descriptors(int device) {
+
+  USBASYNC_CHECK_DEVICE(device, NULL)
+
+  return &usbdevices[device].descriptors;
+}
+
+/*
+ * Select an alternate setting of a claimed interface, which isochronous endpoints usually need to get bandwidth.
+ */
+int gusb_set_alt_setting(int device, unsigned char interface, unsigned char altSetting) {
+
+  USBASYNC_CHECK_DEVICE(device, -1)
+
+  if (usbdevices[device].backend_type != E_GUSB_BACKEND_LIBUSB) {
+    PRINT_ERROR_OTHER("alternate settings can only be selected with the libusb backend")
+    return -1;
+  }
+
+  int ret = libusb_set_interface_alt_setting(usbdevices[device].devh, interface, altSetting);
   if (ret != LIBUSB_SUCCESS) {
-    PRINT_ERROR_LIBUSB("libusb_get_configuration", ret)
+    PRINT_ERROR_LIBUSB("libusb_set_interface_alt_setting", ret)
+    return -1;
+  }
+
+  return 0;
+}
+
+static int init_pools(int device) {
+
+  if (init_pool(&usbdevices[device].control_pool, USBASYNC_CONTROL_BUFFER_SIZE) < 0) {
     return -1;
   }
 
-  if (configuration == 0) {
-    configuration = 1;
-    ret = libusb_set_configuration(usbdevices[device].devh, 1); //warning: this is a blocking function
-    if (ret != LIBUSB_SUCCESS) {
-      PRINT_ERROR_LIBUSB("libusb_set_configuration", ret)
-      return -1;
-    }
+  unsigned char endpointIndex;
+  for (endpointIndex = 0; endpointIndex < LIBUSB_ENDPOINT_ADDRESS_MASK; ++endpointIndex) {
+    if (usbdevices[device].endpoints[endpointIndex].in.type != 0
+        && usbdevices[device].endpoints[endpointIndex].in.type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+      if (init_pool(&usbdevices[device].endpoints[endpointIndex].in.pool, usbdevices[device].endpoints[endpointIndex].in.size) < 0) {
+        return -1;
+      }
+    }
+    if (usbdevices[device].endpoints[endpointIndex].out.type != 0
+        && usbdevices[device].endpoints[endpointIndex].out.type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+      if (init_pool(&usbdevices[device].endpoints[endpointIndex].out.pool, usbdevices[device].endpoints[endpointIndex].out.size) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static void clean_pools(int device) {
+
+  clean_pool(&usbdevices[device].control_pool);
+
+  unsigned char endpointIndex;
+  for (endpointIndex = 0; endpointIndex < LIBUSB_ENDPOINT_ADDRESS_MASK; ++endpointIndex) {
+    clean_pool(&usbdevices[device].endpoints[endpointIndex].in.pool);
+    clean_pool(&usbdevices[device].endpoints[endpointIndex].out.pool);
+  }
+}
+
+static int close_callback(int device) {
+
+  USBASYNC_CHECK_DEVICE(device, -1)
+
+  return usbdevices[device].callback.fp_close(usbdevices[device].callback.user);
+}
+
+static int libusb_register_fds(int device, GPOLL_REGISTER_FD fp_register) {
+
+  int ret = 0;
+
+#ifdef USBASYNC_EVENT_THREAD
+  if (event_thread.running) {
+    ret = fp_register(event_thread.fd, device, drain_completions, NULL, close_callback);
+    if (ret != -1) {
+      ret = init_pools(device);
+    }
+    return ret;
+  }
+#endif
+
+  const struct libusb_pollfd** pfd_usb = libusb_get_pollfds(ctx);
+  int poll_i;
+  for (poll_i = 0; pfd_usb[poll_i] != NULL && ret != -1; ++poll_i) {
+
+    ret = fp_register(pfd_usb[poll_i]->fd, device, gusb_handle_events, gusb_handle_events, close_callback);
   }
+  free(pfd_usb);
 
-  ret = handle_interfaces(device, 1);
-  if(ret < 0) {
-      return -1;
+  if (ret != -1) {
+    ret = init_pools(device);
   }
 
-  // Don't use libusb_get_config_descriptor: it squeezes out some parts of the descriptor!
-  ret = get_descriptors(device);
-  if(ret < 0) {
-      return -1;
+  return ret;
+}
+
+int gusb_register(int device, int user, USBASYNC_READ_CALLBACK fp_read, USBASYNC_WRITE_CALLBACK fp_write,
+    USBASYNC_CLOSE_CALLBACK fp_close, GPOLL_REGISTER_FD fp_register) {
+
+  USBASYNC_CHECK_DEVICE(device, -1)
+
+  int ret = usbdevices[device].backend->register_fds(device, fp_register);
+
+  if (ret != -1) {
+    usbdevices[device].callback.user = user;
+    usbdevices[device].callback.fp_read = fp_read;
+    usbdevices[device].callback.fp_write = fp_write;
+    usbdevices[device].callback.fp_close = fp_close;
   }
 
-  return 0;
+  return ret;
 }
 
-s_usb_dev * gusb_enumerate(unsigned short vendor, unsigned short product) {
+/*
+ * Cancel all pending tranfers for a given device.
+ */
+static void cancel_transfers(int device) {
+  unsigned int i;
+  for (i = 0; i < usbdevices[device].pending.nb_slots; ++i) {
 
-  s_usb_dev * usb_devs = NULL;
-  unsigned int nb_usb_devs = 0;
+    if (usbdevices[device].pending.slots[i] != NULL) {
 
-  int ret = -1;
+      libusb_cancel_transfer(usbdevices[device].pending.slots[i]);
+    }
+  }
 
-  static libusb_device** devs = NULL;
-  static ssize_t cnt = 0;
-  int dev_i;
+  while (usbdevices[device].pending_transfers) {
 
-  if (!ctx) {
-    PRINT_ERROR_OTHER("no libusb context")
-    return NULL;
-  }
+#ifdef USBASYNC_EVENT_THREAD
+    if (event_thread.running) {
+      if (wait_completions() < 0) {
+        break;
+      }
+      continue;
+    }
+#endif
+    if (libusb_handle_events(ctx) != LIBUSB_SUCCESS) {
 
-  cnt = libusb_get_device_list(ctx, &devs);
-  if (cnt < 0) {
-    PRINT_ERROR_LIBUSB("libusb_get_device_list", cnt)
-    return NULL;
+      break;
+    }
   }
+}
 
-  for (dev_i = 0; dev_i < cnt; ++dev_i) {
-    struct libusb_device_descriptor desc;
-    ret = libusb_get_device_descriptor(devs[dev_i], &desc);
-    if (!ret) {
-      if (vendor) {
-        if (desc.idVendor != vendor) {
-          continue;
-        }
-        if (product) {
-          if (desc.idProduct != product) {
-            continue;
-          }
-        }
-      }
+static void libusb_close_device(int device) {
 
-      const char * spath = make_path(devs[dev_i]);
-      if (spath == NULL) {
-        continue;
-      }
+  cancel_transfers(device);
 
-      char * path = strdup(spath);
-      if (path == NULL) {
-        PRINT_ERROR_OTHER("strdup failed")
-        continue;
-      }
+  handle_interfaces(device, 0); //warning: this is a blocking function
+}
 
-      void * ptr = realloc(usb_devs, (nb_usb_devs + 1) * sizeof(*usb_devs));
-      if (ptr == NULL) {
-        PRINT_ERROR_ALLOC_FAILED("realloc")
-        free(path);
-        continue;
-      }
+static const s_backend libusb_backend = {
+  .submit = libusb_submit,
+  .transfer_timeout = libusb_transfer_timeout,
+  .register_fds = libusb_register_fds,
+  .close = libusb_close_device,
+};
 
-      usb_devs = ptr;
+#ifdef USBASYNC_USBFS
+static void usbfs_complete(int device, unsigned char endpoint, const void * buf, int status, const struct timeval * submitted,
+    const struct timeval * reaped) {
 
-      if (nb_usb_devs > 0) {
-        usb_devs[nb_usb_devs - 1].next = 1;
-      }
+  if (usbasync_check_device(device, __FILE__, __LINE__, __func__) < 0) {
+    return;
+  }
 
-      usb_devs[nb_usb_devs].path = path;
-      usb_devs[nb_usb_devs].vendor_id = desc.idVendor;
-      usb_devs[nb_usb_devs].product_id = desc.idProduct;
-      usb_devs[nb_usb_devs].next = 0;
+  reap_time = *reaped;
 
-      ++nb_usb_devs;
-    }
+  record_completion(device, endpoint, status, 0, submitted);
+
+  if (buf != NULL) {
+    usbdevices[device].callback.fp_read(usbdevices[device].callback.user, endpoint, buf, status);
+  } else {
+    usbdevices[device].callback.fp_write(usbdevices[device].callback.user, endpoint, status);
   }
+}
 
-  libusb_free_device_list(devs, 1);
+static int usbfs_submit(int device, unsigned char type, unsigned char endpoint, const void * buf, unsigned int count, unsigned int size) {
 
-  return usb_devs;
+  if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+    PRINT_ERROR_OTHER("isochronous endpoints are not supported by the usbfs backend")
+    return -1;
+  }
+
+  return gusbfs_submit(device, type, endpoint, buf, count, size);
 }
 
-void gusb_free_enumeration(s_usb_dev * usb_devs) {
+static int usbfs_transfer_timeout(int device, unsigned char type, unsigned char endpoint, void * buf, unsigned int count, unsigned int timeout) {
 
-  s_usb_dev * current;
-  for (current = usb_devs; current != NULL; ++current) {
+  return gusbfs_transfer_timeout(device, endpoint, buf, count, timeout);
+}
 
-    free(current->path);
+static int usbfs_register_fds(int device, GPOLL_REGISTER_FD fp_register) {
 
-    if (current->next == 0) {
-      break;
-    }
-  }
-  free(usb_devs);
+  return gusbfs_register(device, close_callback, fp_register);
 }
 
-int gusb_open_ids(unsigned short vendor, unsigned short product) {
+static void usbfs_close_device(int device) {
 
-  int ret = -1;
+  gusbfs_close(device);
+}
 
-  static libusb_device** devs = NULL;
-  static ssize_t cnt = 0;
-  int dev_i;
+static const s_backend usbfs_backend = {
+  .submit = usbfs_submit,
+  .transfer_timeout = usbfs_transfer_timeout,
+  .register_fds = usbfs_register_fds,
+  .close = usbfs_close_device,
+};
 
-  if (!ctx) {
-    PRINT_ERROR_OTHER("no libusb context")
+/*
+ * The usbfs backend claims the interfaces of the first configuration on its own file descriptor,
+ * libusb is only used to open the device and to get the descriptors.
+ */
+static int usbfs_open(int device, libusb_device * dev) {
+
+  struct p_configuration * pConfiguration = usbdevices[device].descriptors.configurations;
+  if (pConfiguration == NULL) {
+    PRINT_ERROR_OTHER("missing configuration")
     return -1;
   }
 
-  cnt = libusb_get_device_list(ctx, &devs);
-  if (cnt < 0) {
-    PRINT_ERROR_LIBUSB("libusb_get_device_list", cnt)
-    return -1;
+  unsigned char interfaces[GUSBFS_MAX_INTERFACES];
+  unsigned char nbInterfaces = 0;
+  unsigned char interfaceIndex;
+  for (interfaceIndex = 0; interfaceIndex < pConfiguration->descriptor->bNumInterfaces && nbInterfaces < GUSBFS_MAX_INTERFACES; ++interfaceIndex) {
+    struct p_interface * pInterface = pConfiguration->interfaces + interfaceIndex;
+    if (pInterface->bNumAltInterfaces) {
+      interfaces[nbInterfaces++] = pInterface->altInterfaces[0].descriptor->bInterfaceNumber;
+    }
   }
 
-  for (dev_i = 0; dev_i < cnt; ++dev_i) {
-    struct libusb_device_descriptor desc;
-    ret = libusb_get_device_descriptor(devs[dev_i], &desc);
-    if (!ret) {
-      if (desc.idVendor == vendor && desc.idProduct == product) {
+  return gusbfs_open(device, libusb_get_bus_number(dev), libusb_get_device_address(dev), interfaces, nbInterfaces, usbfs_complete);
+}
+#endif
 
-        const char * spath = make_path(devs[dev_i]);
-        if (spath == NULL) {
-          continue;
-        }
+#ifdef USBASYNC_HIDRAW
+static void hidraw_complete(int device, unsigned char endpoint, const void * buf, int status, const struct timeval * submitted) {
 
-        int device = add_device(spath, 0);
-        if (device < 0) {
-          continue;
-        }
+  if (usbasync_check_device(device, __FILE__, __LINE__, __func__) < 0) {
+    return;
+  }
 
-        if (claim_device(device, devs[dev_i], &desc) != -1) {
-          libusb_free_device_list(devs, 1);
-          return device;
-        } else {
-          gusb_close(device);
-        }
-      }
-    }
+  gettimeofday(&reap_time, NULL);
+
+  record_completion(device, endpoint, status, 0, submitted);
+
+  if (buf != NULL) {
+    usbdevices[device].callback.fp_read(usbdevices[device].callback.user, endpoint, buf, status);
+  } else {
+    usbdevices[device].callback.fp_write(usbdevices[device].callback.user, endpoint, status);
   }
+}
 
-  libusb_free_device_list(devs, 1);
+/*
+ * HID class requests and reports go through hidraw, other control requests still go through libusb.
+ */
+static int hidraw_submit(int device, unsigned char type, unsigned char endpoint, const void * buf, unsigned int count, unsigned int size) {
 
-  return -1;
+  if (endpoint == 0) {
+    if (gusbhid_is_hid_request(device, buf)) {
+      return gusbhid_control(device, buf, count);
+    }
+    return libusb_submit(device, type, endpoint, buf, count, size);
+  }
+
+  if (IS_ENDPOINT_IN(endpoint)) {
+    return gusbhid_poll(device, endpoint);
+  }
+  return gusbhid_write(device, endpoint, buf, count);
 }
 
-int gusb_open_path(const char * path) {
+static int hidraw_transfer_timeout(int device, unsigned char type, unsigned char endpoint, void * buf, unsigned int count, unsigned int timeout) {
 
-  int ret = -1;
+  return gusbhid_transfer_timeout(device, endpoint, buf, count, timeout);
+}
 
-  static libusb_device** devs = NULL;
-  static ssize_t cnt = 0;
-  int dev_i;
+static int hidraw_register_fds(int device, GPOLL_REGISTER_FD fp_register) {
 
-  if (path == NULL) {
-    PRINT_ERROR_OTHER("path is NULL");
+  if (libusb_register_fds(device, fp_register) < 0) {
     return -1;
   }
 
-  if (!ctx) {
-    PRINT_ERROR_OTHER("no libusb context")
+  return gusbhid_register(device, close_callback, fp_register);
+}
+
+static void hidraw_close_device(int device) {
+
+  cancel_transfers(device);
+
+  gusbhid_close(device);
+}
+
+static const s_backend hidraw_backend = {
+  .submit = hidraw_submit,
+  .transfer_timeout = hidraw_transfer_timeout,
+  .register_fds = hidraw_register_fds,
+  .close = hidraw_close_device,
+};
+
+/*
+ * Open the hidraw nodes of the HID interfaces of the first configuration.
+ */
+static int hidraw_open(int device, libusb_device * dev) {
+
+  // Don't use libusb_get_config_descriptor: it squeezes out some parts of the descriptor!
+  if (get_descriptors(device) < 0) {
     return -1;
   }
 
-  cnt = libusb_get_device_list(ctx, &devs);
-  if (cnt < 0) {
-    PRINT_ERROR_LIBUSB("libusb_get_device_list", cnt)
+  struct p_configuration * pConfiguration = usbdevices[device].descriptors.configurations;
+  if (pConfiguration == NULL) {
+    PRINT_ERROR_OTHER("missing configuration")
     return -1;
   }
 
-  for (dev_i = 0; dev_i < cnt; ++dev_i) {
-    const char * spath = make_path(devs[dev_i]);
-    if (spath == NULL || strcmp(spath, path)) {
+  s_gusbhid_interface interfaces[GUSBHID_MAX_INTERFACES] = { };
+  unsigned char nbInterfaces = 0;
+  unsigned char interfaceIndex;
+  for (interfaceIndex = 0; interfaceIndex < pConfiguration->descriptor->bNumInterfaces && nbInterfaces < GUSBHID_MAX_INTERFACES; ++interfaceIndex) {
+    struct p_interface * pInterface = pConfiguration->interfaces + interfaceIndex;
+    if (pInterface->bNumAltInterfaces == 0 || pInterface->altInterfaces[0].hidDescriptor == NULL) {
       continue;
     }
-    struct libusb_device_descriptor desc;
-    ret = libusb_get_device_descriptor(devs[dev_i], &desc);
-    if (!ret) {
-
-      int device = add_device(path, 0);
-      if (device < 0) {
+    struct p_altInterface * pAltInterface = pInterface->altInterfaces;
+    s_gusbhid_interface * interface = interfaces + nbInterfaces++;
+    interface->number = pAltInterface->descriptor->bInterfaceNumber;
+    unsigned char endpointIndex;
+    for (endpointIndex = 0; endpointIndex < pAltInterface->bNumEndpoints; ++endpointIndex) {
+      struct usb_endpoint_descriptor * endpoint = pAltInterface->endpoints[endpointIndex];
+      if ((endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_INTERRUPT) {
         continue;
       }
-
-      if (claim_device(device, devs[dev_i], &desc) != -1) {
-        libusb_free_device_list(devs, 1);
-        return device;
+      if (IS_ENDPOINT_IN(endpoint->bEndpointAddress)) {
+        interface->in = endpoint->bEndpointAddress;
+        interface->inSize = endpoint->wMaxPacketSize;
       } else {
-        gusb_close(device);
+        interface->out = endpoint->bEndpointAddress;
       }
     }
   }
 
-  libusb_free_device_list(devs, 1);
+  if (nbInterfaces == 0) {
+    PRINT_ERROR_OTHER("no HID interface")
+    return -1;
+  }
 
-  return -1;
+  if (gusbhid_open(device, libusb_get_bus_number(dev), libusb_get_device_address(dev), interfaces, nbInterfaces, hidraw_complete) < 0) {
+    return -1;
+  }
+
+  usbdevices[device].backend = &hidraw_backend;
+
+  return 0;
 }
+#endif
 
-s_usb_descriptors * gusb_get_usb_descriptors(int device) {
+#ifdef USBASYNC_SIM
+static void sim_complete(int device, unsigned char endpoint, const void * buf, int status, const struct timeval * submitted) {
 
-  USBASYNC_CHECK_DEVICE(device, NULL)
+  if (usbasync_check_device(device, __FILE__, __LINE__, __func__) < 0) {
+    return;
+  }
 
-  return &usbdevices[device].descriptors;
+  gettimeofday(&reap_time, NULL);
+
+  record_completion(device, endpoint, status, 0, submitted);
+
+  if (buf != NULL) {
+    usbdevices[device].callback.fp_read(usbdevices[device].callback.user, endpoint, buf, status);
+  } else {
+    usbdevices[device].callback.fp_write(usbdevices[device].callback.user, endpoint, status);
+  }
 }
 
-static int close_callback(int device) {
+static int sim_submit(int device, unsigned char type, unsigned char endpoint, const void * buf, unsigned int count, unsigned int size) {
 
-  USBASYNC_CHECK_DEVICE(device, -1)
+  if (endpoint == 0) {
+    return gusbsim_control(device, buf, count);
+  }
 
-  return usbdevices[device].callback.fp_close(usbdevices[device].callback.user);
+  if (IS_ENDPOINT_IN(endpoint)) {
+    return gusbsim_poll(device, endpoint);
+  }
+  return gusbsim_write(device, endpoint, buf, count);
 }
 
-int gusb_register(int device, int user, USBASYNC_READ_CALLBACK fp_read, USBASYNC_WRITE_CALLBACK fp_write,
-    USBASYNC_CLOSE_CALLBACK fp_close, GPOLL_REGISTER_FD fp_register) {
-
-  USBASYNC_CHECK_DEVICE(device, -1)
+static int sim_transfer_timeout(int device, unsigned char type, unsigned char endpoint, void * buf, unsigned int count, unsigned int timeout) {
 
-  int ret = 0;
+  return gusbsim_transfer_timeout(device, endpoint, buf, count, timeout);
+}
 
-  const struct libusb_pollfd** pfd_usb = libusb_get_pollfds(ctx);
-  int poll_i;
-  for (poll_i = 0; pfd_usb[poll_i] != NULL && ret != -1; ++poll_i) {
+static int sim_register_fds(int device, GPOLL_REGISTER_FD fp_register) {
 
-    ret = fp_register(pfd_usb[poll_i]->fd, device, gusb_handle_events, gusb_handle_events, close_callback);
-  }
-  free(pfd_usb);
+  return gusbsim_register(device, close_callback, fp_register);
+}
 
-  if (ret != -1) {
-    usbdevices[device].callback.user = user;
-    usbdevices[device].callback.fp_read = fp_read;
-    usbdevices[device].callback.fp_write = fp_write;
-    usbdevices[device].callback.fp_close = fp_close;
-  }
+static void sim_close_device(int device) {
 
-  return ret;
+  gusbsim_close(device);
 }
 
+static const s_backend sim_backend = {
+  .submit = sim_submit,
+  .transfer_timeout = sim_transfer_timeout,
+  .register_fds = sim_register_fds,
+  .close = sim_close_device,
+};
+
 /*
- * Cancel all pending tranfers for a given device.
+ * A simulated device has no libusb handle: its descriptors and its data path come from its script.
  */
-static void cancel_transfers(int device) {
-  unsigned int i;
-  for (i = 0; i < transfers_nb; ++i) {
+static int sim_open(const char * path) {
 
-    if ((intptr_t) (transfers[i]->user_data) == (intptr_t) device) {
-
-      libusb_cancel_transfer(transfers[i]);
-    }
+  int device = add_device(path, 1);
+  if (device < 0) {
+    return -1;
   }
 
-  while (usbdevices[device].pending_transfers) {
+  s_gusb_attach_times * times = &usbdevices[device].attach_times;
+  memset(times, 0x00, sizeof(*times));
 
-    if (libusb_handle_events(ctx) != LIBUSB_SUCCESS) {
+  struct timeval start;
+  gettimeofday(&start, NULL);
 
-      break;
-    }
+  usbdevices[device].backend_type = E_GUSB_BACKEND_SIM;
+
+  if (gusbsim_open(device, path, sim_complete) < 0) {
+    gusb_close(device);
+    return -1;
+  }
+
+  usbdevices[device].backend = &sim_backend;
+
+  if (get_descriptors(device) < 0) {
+    gusb_close(device);
+    return -1;
   }
+
+  init_stats(device, NULL);
+
+  times->descriptors = lap_time(&start);
+  times->total = times->descriptors;
+
+  return device;
 }
+#endif
 
 int gusb_close(int device) {
 
@@ -1174,13 +2844,14 @@ int gusb_close(int device) {
     return -1;
   }
 
-  if (usbdevices[device].devh) {
+  if (usbdevices[device].backend != NULL) {
 
     usbdevices[device].closing = 1;
 
-    cancel_transfers(device);
+    usbdevices[device].backend->close(device);
+  }
 
-    handle_interfaces(device, 0); //warning: this is a blocking function
+  if (usbdevices[device].devh) {
 #if !defined(LIBUSB_API_VERSION) && !defined(LIBUSBX_API_VERSION)
 #ifndef WIN32
         libusb_attach_kernel_driver(usbdevices[device].devh, 0);
@@ -1189,33 +2860,14 @@ int gusb_close(int device) {
     libusb_close(usbdevices[device].devh);
   }
 
+  clean_pools(device);
+
+  free(usbdevices[device].pending.slots);
+  free(usbdevices[device].pending.free_slots);
+  free(usbdevices[device].pending.submitted);
+
   free(usbdevices[device].path);
-  if (usbdevices[device].descriptors.configurations != NULL) {
-    unsigned char configurationIndex;
-    for (configurationIndex = 0; configurationIndex < usbdevices[device].descriptors.device.bNumConfigurations; ++configurationIndex) {
-      struct p_configuration * pConfiguration = usbdevices[device].descriptors.configurations + configurationIndex;
-      if (pConfiguration->descriptor != NULL) {
-        unsigned char interfaceIndex;
-        for (interfaceIndex = 0; interfaceIndex < pConfiguration->descriptor->bNumInterfaces; ++interfaceIndex) {
-          struct p_interface * pInterface = pConfiguration->interfaces + interfaceIndex;
-          unsigned char altInterfaceIndex;
-          for (altInterfaceIndex = 0; altInterfaceIndex < pInterface->bNumAltInterfaces; ++altInterfaceIndex) {
-            struct p_altInterface * pAltInterface = pInterface->altInterfaces + altInterfaceIndex;
-            free(pAltInterface->endpoints);
-          }
-          free(pInterface->altInterfaces);
-        }
-        free(pConfiguration->interfaces);
-      }
-      free(pConfiguration->raw);
-    }
-    free(usbdevices[device].descriptors.configurations);
-  }
-  unsigned int othersIndex;
-  for (othersIndex = 0; othersIndex < usbdevices[device].descriptors.nbOthers; ++othersIndex) {
-    free(usbdevices[device].descriptors.others[othersIndex].data);
-  }
-  free(usbdevices[device].descriptors.others);
+  free(usbdevices[device].descriptors.arena);
 
   memset(usbdevices + device, 0x00, sizeof(*usbdevices));
 
@@ -1226,6 +2878,10 @@ int gusb_write(int device, unsigned char endpoint, const void * buf, unsigned in
 
   USBASYNC_CHECK_DEVICE(device, -1)
 
+  unsigned char type = LIBUSB_TRANSFER_TYPE_CONTROL;
+
+  unsigned int size = count;
+
   if (endpoint != 0) {
 
     unsigned char endpointIndex = GET_ENDPOINT(device, endpoint, LIBUSB_ENDPOINT_OUT, 0)
@@ -1233,12 +2889,16 @@ int gusb_write(int device, unsigned char endpoint, const void * buf, unsigned in
 
       return -1;
     }
+
+    type = usbdevices[device].endpoints[endpointIndex].out.type;
   } else {
 
     struct libusb_control_setup * control_setup = (struct libusb_control_setup *)buf;
     if(control_setup->bmRequestType & LIBUSB_ENDPOINT_IN) {
 
-      count += control_setup->wLength;
+      // only the setup packet is provided, the buffer also has to hold the data stage
+      size = LIBUSB_CONTROL_SETUP_SIZE + control_setup->wLength;
+      count = LIBUSB_CONTROL_SETUP_SIZE;
     }
   }
 
@@ -1248,32 +2908,10 @@ int gusb_write(int device, unsigned char endpoint, const void * buf, unsigned in
     return -1;
   }
 
-  unsigned char * buffer = malloc(count * sizeof(unsigned char));
-  if (buffer == NULL) {
-
-    PRINT_ERROR_ALLOC_FAILED("calloc")
-    return -1;
-  }
-
-  memcpy(buffer, buf, count);
-
-  struct libusb_transfer * transfer = libusb_alloc_transfer(0);
-  if (transfer == NULL) {
-
-    PRINT_ERROR_ALLOC_FAILED("libusb_alloc_transfer")
-    free(buffer);
-    return -1;
-  }
-
-  if (endpoint == 0) {
-
-    libusb_fill_control_transfer(transfer, usbdevices[device].devh,
-        buffer, (libusb_transfer_cb_fn) usb_callback, (void *) (intptr_t) device, 50);
-  } else {
-
-    libusb_fill_interrupt_transfer(transfer, usbdevices[device].devh, endpoint,
-        buffer, count, (libusb_transfer_cb_fn) usb_callback, (void *) (intptr_t) device, USBASYNC_OUT_TIMEOUT);
+  int ret = usbdevices[device].backend->submit(device, type, endpoint, buf, count, size);
+  // isochronous packets are counted when their transfers are submitted
+  if (ret >= 0 && type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+    record_submission(device, endpoint, 1);
   }
-
-  return submit_transfer(transfer);
+  return ret;
 }
@@ -0,0 +1,33 @@
+/*
+ Copyright (c) 2016 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#ifndef GUSBFS_H_
+#define GUSBFS_H_
+
+#include <gusb.h>
+
+#define GUSBFS_MAX_INTERFACES 32
+
+/*
+ * Direct usbfs backend, used by gusb for the data path of the devices opened with E_GUSB_BACKEND_USBFS.
+ * The device is still opened with libusb, for the enumeration and the descriptors.
+ */
+
+/*
+ * Called for each completed transfer: buf points to the received data (the data stage for control transfers)
+ * for IN transfers, and is NULL for OUT transfers. submitted and reaped are the submission and completion times.
+ */
+typedef void (* GUSBFS_COMPLETE_CALLBACK)(int device, unsigned char endpoint, const void * buf, int status,
+    const struct timeval * submitted, const struct timeval * reaped);
+
+int gusbfs_open(int device, unsigned char bus, unsigned char address, const unsigned char * interfaces,
+    unsigned char nbInterfaces, GUSBFS_COMPLETE_CALLBACK fp_complete);
+int gusbfs_register(int device, GPOLL_CLOSE_CALLBACK fp_close, GPOLL_REGISTER_FD fp_register);
+int gusbfs_submit(int device, unsigned char type, unsigned char endpoint, const void * buf, unsigned int count,
+    unsigned int size);
+int gusbfs_transfer_timeout(int device, unsigned char endpoint, void * buf, unsigned int count, unsigned int timeout);
+int gusbfs_close(int device);
+
+#endif /* GUSBFS_H_ */
@@ -0,0 +1,47 @@
+/*
+ Copyright (c) 2016 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#ifndef GUSBHID_H_
+#define GUSBHID_H_
+
+#include <gusb.h>
+
+/*
+ * hidraw backend, used by gusb for the HID interfaces of the devices opened with E_GUSB_BACKEND_HIDRAW.
+ * The kernel driver stays attached: reports go through the /dev/hidrawN nodes of the interfaces,
+ * and HID class requests are translated into hidraw ioctls.
+ */
+
+#define GUSBHID_MAX_INTERFACES 32
+
+typedef struct {
+  unsigned char number; // bInterfaceNumber
+  unsigned char in; // interrupt IN endpoint address, 0 if none
+  unsigned short inSize;
+  unsigned char out; // interrupt OUT endpoint address, 0 if none
+  const char * node; // hidraw node, NULL to find it from the bus, the address and the interface number
+} s_gusbhid_interface;
+
+/*
+ * Called for each completed transfer: buf points to the received data for IN transfers, and is NULL for OUT transfers.
+ * submitted is the submission time of the transfer.
+ * Completions are always reported from gpoll, never from the submitting call.
+ */
+typedef void (* GUSBHID_COMPLETE_CALLBACK)(int device, unsigned char endpoint, const void * buf, int status,
+    const struct timeval * submitted);
+
+int gusbhid_get_report_descriptor(unsigned char bus, unsigned char address, unsigned char interface,
+    unsigned char * data, unsigned int size);
+int gusbhid_open(int device, unsigned char bus, unsigned char address, const s_gusbhid_interface * interfaces,
+    unsigned char nbInterfaces, GUSBHID_COMPLETE_CALLBACK fp_complete);
+int gusbhid_register(int device, GPOLL_CLOSE_CALLBACK fp_close, GPOLL_REGISTER_FD fp_register);
+int gusbhid_is_hid_request(int device, const void * setup);
+int gusbhid_poll(int device, unsigned char endpoint);
+int gusbhid_write(int device, unsigned char endpoint, const void * buf, unsigned int count);
+int gusbhid_control(int device, const void * buf, unsigned int count);
+int gusbhid_transfer_timeout(int device, unsigned char endpoint, void * buf, unsigned int count, unsigned int timeout);
+int gusbhid_close(int device);
+
+#endif /* GUSBHID_H_ */
@@ -0,0 +1,52 @@
+/*
+ Copyright (c) 2016 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#ifndef GUSBSIM_H_
+#define GUSBSIM_H_
+
+#include <gusb.h>
+
+/*
+ * Simulated device backend, used by gusb for the devices opened with E_GUSB_BACKEND_SIM.
+ * The device is described by a script, whose path is given instead of the device path.
+ * Each line holds a keyword followed by its arguments, numbers are hexadecimal unless noted,
+ * lines starting with a blank continue the data of the previous line, and '#' starts a comment:
+ *
+ * device <bytes>                          device descriptor
+ * configuration <bytes>                   configuration descriptor with all its interfaces and endpoints,
+ *                                         wTotalLength is computed (one line per configuration, in order)
+ * string <index> <text>                   string descriptor (text up to the end of the line, langId 0x0409)
+ * report <interface> <bytes>              HID report descriptor
+ * in <endpoint> <period> <size>           IN endpoint producing a report of size bytes (decimal) every period
+ *                                         microseconds (decimal, 0: always ready), the first 4 bytes hold
+ *                                         a little-endian sequence number
+ * control <bmRequestType> <bRequest> <wValue> <wIndex> <bytes | stall>
+ *                                         reply of a control request
+ *
+ * OUT endpoints accept any packet. Control requests without a reply complete if they are standard requests
+ * without a data stage, and are stalled otherwise. IN endpoints without a report are never ready.
+ */
+
+#define GUSBSIM_MAX_ENDPOINTS 16
+
+/*
+ * Called for each completed transfer: buf points to the received data for IN transfers, and is NULL for OUT transfers.
+ * submitted is the submission time of the transfer.
+ * Completions are always reported from gpoll, never from the submitting call.
+ */
+typedef void (* GUSBSIM_COMPLETE_CALLBACK)(int device, unsigned char endpoint, const void * buf, int status,
+    const struct timeval * submitted);
+
+int gusbsim_open(int device, const char * script, GUSBSIM_COMPLETE_CALLBACK fp_complete);
+int gusbsim_get_descriptor(int device, unsigned char bmRequestType, unsigned short wValue, unsigned short wIndex,
+    unsigned char * data, unsigned int size);
+int gusbsim_register(int device, GPOLL_CLOSE_CALLBACK fp_close, GPOLL_REGISTER_FD fp_register);
+int gusbsim_poll(int device, unsigned char endpoint);
+int gusbsim_write(int device, unsigned char endpoint, const void * buf, unsigned int count);
+int gusbsim_control(int device, const void * buf, unsigned int count);
+int gusbsim_transfer_timeout(int device, unsigned char endpoint, void * buf, unsigned int count, unsigned int timeout);
+int gusbsim_close(int device);
+
+#endif /* GUSBSIM_H_ */
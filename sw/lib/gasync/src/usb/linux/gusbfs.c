@@ -0,0 +1,377 @@
+/*
+ Copyright (c) 2016 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#include "../gusbfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <linux/usbdevice_fs.h>
+
+#define GUSBFS_MAX_DEVICES 256
+
+// maximum number of pending URBs per device
+#define GUSBFS_MAX_URBS 64
+
+// initial buffer size of the URBs, buffers only grow when a larger transfer is submitted
+#define GUSBFS_BUFFER_SIZE (sizeof(struct usb_ctrlrequest) + 256)
+
+#define PRINT_ERROR_ERRNO(msg) fprintf(stderr, "%s:%d %s: %s failed with error: %m\n", __FILE__, __LINE__, __func__, msg);
+#define PRINT_ERROR_OTHER(msg) fprintf(stderr, "%s:%d %s: %s\n", __FILE__, __LINE__, __func__, msg);
+
+typedef struct {
+  struct usbdevfs_urb urb;
+  unsigned int capacity;
+  unsigned int index;
+  unsigned char pending;
+  struct timeval submitted;
+} s_urb;
+
+static struct {
+  int fd;
+  unsigned char interfaces[GUSBFS_MAX_INTERFACES]; // claimed interfaces
+  unsigned char nbInterfaces;
+  GUSBFS_COMPLETE_CALLBACK fp_complete;
+  s_urb * urbs; // GUSBFS_MAX_URBS elements, allocated at open time
+  unsigned int free_urbs[GUSBFS_MAX_URBS]; // stack of the free URB indexes
+  unsigned int nb_free_urbs;
+} devices[GUSBFS_MAX_DEVICES] = { };
+
+void gusbfs_init(void) __attribute__((constructor (101)));
+void gusbfs_init(void) {
+  unsigned int i;
+  for (i = 0; i < sizeof(devices) / sizeof(*devices); ++i) {
+    devices[i].fd = -1;
+  }
+}
+
+#define CHECK_DEVICE(DEVICE,RETVALUE) \
+  if (DEVICE < 0 || DEVICE >= GUSBFS_MAX_DEVICES || devices[DEVICE].fd < 0) { \
+    PRINT_ERROR_OTHER("invalid device") \
+    return RETVALUE; \
+  }
+
+static s_urb * acquire_urb(int device, unsigned int size) {
+
+  if (devices[device].nb_free_urbs == 0) {
+    PRINT_ERROR_OTHER("no URB available")
+    return NULL;
+  }
+
+  s_urb * urb = devices[device].urbs + devices[device].free_urbs[devices[device].nb_free_urbs - 1];
+
+  if (urb->capacity < size) {
+    void * ptr = realloc(urb->urb.buffer, size);
+    if (ptr == NULL) {
+      PRINT_ERROR_OTHER("realloc failed")
+      return NULL;
+    }
+    urb->urb.buffer = ptr;
+    urb->capacity = size;
+  }
+
+  --devices[device].nb_free_urbs;
+  urb->pending = 1;
+
+  return urb;
+}
+
+static void release_urb(int device, s_urb * urb) {
+
+  urb->pending = 0;
+  devices[device].free_urbs[devices[device].nb_free_urbs++] = urb->index;
+}
+
+static int get_status(const struct usbdevfs_urb * urb) {
+
+  switch (urb->status) {
+  case 0:
+    return urb->actual_length;
+  case -ETIMEDOUT:
+    return E_TRANSFER_TIMED_OUT;
+  case -EPIPE:
+    return E_TRANSFER_STALL;
+  default:
+    return E_TRANSFER_ERROR;
+  }
+}
+
+static int is_urb_in(const s_urb * urb) {
+
+  if (urb->urb.type == USBDEVFS_URB_TYPE_CONTROL) {
+    return ((struct usb_ctrlrequest *) urb->urb.buffer)->bRequestType & USB_DIR_IN;
+  }
+  return urb->urb.endpoint & USB_DIR_IN;
+}
+
+/*
+ * The usbfs fd gets writable when URBs are completed: reap them all without blocking.
+ */
+static int reap_urbs(int device) {
+
+  CHECK_DEVICE(device, -1)
+
+  struct timeval reaped;
+  gettimeofday(&reaped, NULL);
+
+  struct usbdevfs_urb * purb;
+  while (ioctl(devices[device].fd, USBDEVFS_REAPURBNDELAY, &purb) == 0) {
+
+    s_urb * urb = purb->usercontext;
+
+    // the URB is reaped, the callback may close the device
+    urb->pending = 0;
+
+    if (urb->urb.status != -ENOENT && urb->urb.status != -ECONNRESET) { // not cancelled
+      int status = get_status(&urb->urb);
+      const void * buf = NULL;
+      if (is_urb_in(urb)) {
+        buf = urb->urb.buffer;
+        if (urb->urb.type == USBDEVFS_URB_TYPE_CONTROL) {
+          buf = (unsigned char *) urb->urb.buffer + sizeof(struct usb_ctrlrequest);
+        }
+      }
+      devices[device].fp_complete(device, urb->urb.type == USBDEVFS_URB_TYPE_CONTROL ? 0 : urb->urb.endpoint,
+          buf, status, &urb->submitted, &reaped);
+    }
+
+    // the device may have been closed by the callback
+    if (devices[device].fd < 0) {
+      return 0;
+    }
+
+    release_urb(device, urb);
+  }
+
+  if (errno != EAGAIN) {
+    PRINT_ERROR_ERRNO("ioctl USBDEVFS_REAPURBNDELAY")
+    return -1;
+  }
+
+  return 0;
+}
+
+static int claim_interfaces(int device, const unsigned char * interfaces, unsigned char nbInterfaces) {
+
+  unsigned char i;
+  for (i = 0; i < nbInterfaces; ++i) {
+
+    struct usbdevfs_disconnect_claim claim = {
+      .interface = interfaces[i],
+      .flags = USBDEVFS_DISCONNECT_CLAIM_EXCEPT_DRIVER,
+      .driver = "usbfs",
+    };
+    if (ioctl(devices[device].fd, USBDEVFS_DISCONNECT_CLAIM, &claim) < 0) {
+      PRINT_ERROR_ERRNO("ioctl USBDEVFS_DISCONNECT_CLAIM")
+      return -1;
+    }
+    devices[device].interfaces[devices[device].nbInterfaces++] = interfaces[i];
+  }
+
+  return 0;
+}
+
+static void release_interfaces(int device) {
+
+  unsigned char i;
+  for (i = 0; i < devices[device].nbInterfaces; ++i) {
+
+    unsigned int interface = devices[device].interfaces[i];
+    if (ioctl(devices[device].fd, USBDEVFS_RELEASEINTERFACE, &interface) < 0) {
+      PRINT_ERROR_ERRNO("ioctl USBDEVFS_RELEASEINTERFACE")
+      continue;
+    }
+
+    // give the interface back to the kernel driver
+    struct usbdevfs_ioctl command = { .ifno = interface, .ioctl_code = USBDEVFS_CONNECT, .data = NULL };
+    if (ioctl(devices[device].fd, USBDEVFS_IOCTL, &command) < 0 && errno != ENODATA) {
+      PRINT_ERROR_ERRNO("ioctl USBDEVFS_CONNECT")
+    }
+  }
+}
+
+int gusbfs_open(int device, unsigned char bus, unsigned char address, const unsigned char * interfaces,
+    unsigned char nbInterfaces, GUSBFS_COMPLETE_CALLBACK fp_complete) {
+
+  if (device < 0 || device >= GUSBFS_MAX_DEVICES || devices[device].fd >= 0) {
+    PRINT_ERROR_OTHER("invalid device")
+    return -1;
+  }
+
+  if (nbInterfaces > GUSBFS_MAX_INTERFACES) {
+    PRINT_ERROR_OTHER("too many interfaces")
+    return -1;
+  }
+
+  char path[sizeof("/dev/bus/usb/000/000")];
+  snprintf(path, sizeof(path), "/dev/bus/usb/%03hhu/%03hhu", bus, address);
+
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    PRINT_ERROR_ERRNO("open")
+    return -1;
+  }
+
+  s_urb * urbs = calloc(GUSBFS_MAX_URBS, sizeof(*urbs));
+  if (urbs == NULL) {
+    PRINT_ERROR_OTHER("calloc failed")
+    close(fd);
+    return -1;
+  }
+
+  devices[device].fd = fd;
+  devices[device].fp_complete = fp_complete;
+  devices[device].urbs = urbs;
+
+  unsigned int i;
+  for (i = 0; i < GUSBFS_MAX_URBS; ++i) {
+    urbs[i].index = i;
+    urbs[i].urb.usercontext = urbs + i;
+    urbs[i].urb.buffer = calloc(GUSBFS_BUFFER_SIZE, sizeof(unsigned char));
+    if (urbs[i].urb.buffer == NULL) {
+      PRINT_ERROR_OTHER("calloc failed")
+      gusbfs_close(device);
+      return -1;
+    }
+    urbs[i].capacity = GUSBFS_BUFFER_SIZE;
+    devices[device].free_urbs[devices[device].nb_free_urbs++] = GUSBFS_MAX_URBS - 1 - i;
+  }
+
+  if (claim_interfaces(device, interfaces, nbInterfaces) < 0) {
+    gusbfs_close(device);
+    return -1;
+  }
+
+  return 0;
+}
+
+int gusbfs_register(int device, GPOLL_CLOSE_CALLBACK fp_close, GPOLL_REGISTER_FD fp_register) {
+
+  CHECK_DEVICE(device, -1)
+
+  return fp_register(devices[device].fd, device, NULL, reap_urbs, fp_close);
+}
+
+/*
+ * Submit a URB. size is the buffer size, which includes the setup packet for control transfers,
+ * and count the number of bytes to copy from buf.
+ * There is no timeout: pending URBs are discarded when the device is closed.
+ */
+int gusbfs_submit(int device, unsigned char type, unsigned char endpoint, const void * buf, unsigned int count,
+    unsigned int size) {
+
+  CHECK_DEVICE(device, -1)
+
+  unsigned char urbType;
+  switch (type) {
+  case USB_ENDPOINT_XFER_CONTROL:
+    urbType = USBDEVFS_URB_TYPE_CONTROL;
+    break;
+  case USB_ENDPOINT_XFER_INT:
+    urbType = USBDEVFS_URB_TYPE_INTERRUPT;
+    break;
+  case USB_ENDPOINT_XFER_BULK:
+    urbType = USBDEVFS_URB_TYPE_BULK;
+    break;
+  default:
+    PRINT_ERROR_OTHER("unsupported endpoint type")
+    return -1;
+  }
+
+  s_urb * urb = acquire_urb(device, size);
+  if (urb == NULL) {
+    return -1;
+  }
+
+  void * buffer = urb->urb.buffer;
+  void * usercontext = urb->urb.usercontext;
+  memset(&urb->urb, 0x00, sizeof(urb->urb));
+  urb->urb.type = urbType;
+  urb->urb.endpoint = endpoint;
+  urb->urb.buffer = buffer;
+  urb->urb.buffer_length = size;
+  urb->urb.usercontext = usercontext;
+
+  if (count) {
+    memcpy(buffer, buf, count);
+  }
+
+  gettimeofday(&urb->submitted, NULL);
+
+  if (ioctl(devices[device].fd, USBDEVFS_SUBMITURB, &urb->urb) < 0) {
+    PRINT_ERROR_ERRNO("ioctl USBDEVFS_SUBMITURB")
+    release_urb(device, urb);
+    return -1;
+  }
+
+  return 0;
+}
+
+int gusbfs_transfer_timeout(int device, unsigned char endpoint, void * buf, unsigned int count, unsigned int timeout) {
+
+  CHECK_DEVICE(device, -1)
+
+  struct usbdevfs_bulktransfer transfer = { .ep = endpoint, .len = count, .timeout = timeout, .data = buf };
+
+  int ret = ioctl(devices[device].fd, USBDEVFS_BULK, &transfer);
+  if (ret < 0) {
+    if (errno == ETIMEDOUT) {
+      return 0;
+    }
+    PRINT_ERROR_ERRNO("ioctl USBDEVFS_BULK")
+    return -1;
+  }
+
+  return ret;
+}
+
+/*
+ * Discard the pending URBs, wait for them, and give the interfaces back to the kernel.
+ */
+int gusbfs_close(int device) {
+
+  CHECK_DEVICE(device, -1)
+
+  int fd = devices[device].fd;
+
+  if (devices[device].urbs != NULL) {
+
+    // only the submitted URBs can be reaped, the blocking reap would wait forever for the others
+    unsigned int pending = 0;
+
+    unsigned int i;
+    for (i = 0; i < GUSBFS_MAX_URBS; ++i) {
+      if (devices[device].urbs[i].pending) {
+        ioctl(fd, USBDEVFS_DISCARDURB, &devices[device].urbs[i].urb);
+        ++pending;
+      }
+    }
+
+    struct usbdevfs_urb * purb;
+    while (pending && ioctl(fd, USBDEVFS_REAPURB, &purb) == 0) {
+      --pending;
+    }
+
+    release_interfaces(device);
+
+    for (i = 0; i < GUSBFS_MAX_URBS; ++i) {
+      free(devices[device].urbs[i].urb.buffer);
+    }
+    free(devices[device].urbs);
+  }
+
+  gpoll_remove_fd(fd);
+  close(fd);
+
+  memset(devices + device, 0x00, sizeof(*devices));
+  devices[device].fd = -1;
+
+  return 0;
+}
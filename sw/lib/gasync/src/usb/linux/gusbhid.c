@@ -0,0 +1,686 @@
+/*
+ Copyright (c) 2016 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#include "../gusbhid.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <linux/hidraw.h>
+
+#define GUSBHID_MAX_DEVICES 256
+
+// completions waiting to be reported from gpoll
+#define GUSBHID_MAX_COMPLETIONS 64
+
+// size of the control and output report buffers, including the report ID
+#define GUSBHID_REPORT_BUFFER_SIZE (HID_MAX_DESCRIPTOR_SIZE + 1)
+
+#define HID_REQ_GET_REPORT   0x01
+#define HID_REQ_GET_IDLE     0x02
+#define HID_REQ_GET_PROTOCOL 0x03
+#define HID_REQ_SET_REPORT   0x09
+#define HID_REQ_SET_IDLE     0x0a
+#define HID_REQ_SET_PROTOCOL 0x0b
+
+#define HID_REPORT_TYPE_INPUT   0x01
+#define HID_REPORT_TYPE_OUTPUT  0x02
+#define HID_REPORT_TYPE_FEATURE 0x03
+
+#define PRINT_ERROR_ERRNO(msg) fprintf(stderr, "%s:%d %s: %s failed with error: %m\n", __FILE__, __LINE__, __func__, msg);
+#define PRINT_ERROR_OTHER(msg) fprintf(stderr, "%s:%d %s: %s\n", __FILE__, __LINE__, __func__, msg);
+
+typedef struct {
+  unsigned char number;
+  int fd;
+  int reportIds; // the report descriptor declares report IDs
+  unsigned char in;
+  unsigned short inSize;
+  unsigned char out;
+  unsigned int polling; // number of pending reads
+  struct timeval polled; // start of the first pending read, reads are served one after the other
+  unsigned char * inBuffer; // inSize bytes, the read callback gets it directly
+} s_interface;
+
+static struct {
+  int fd; // eventfd signaling the completions
+  GUSBHID_COMPLETE_CALLBACK fp_complete;
+  GPOLL_CLOSE_CALLBACK fp_close;
+  GPOLL_REGISTER_FD fp_register;
+  s_interface interfaces[GUSBHID_MAX_INTERFACES];
+  unsigned char nbInterfaces;
+  struct {
+    unsigned char endpoint;
+    int status;
+    const void * buf;
+    struct timeval submitted;
+  } completions[GUSBHID_MAX_COMPLETIONS];
+  unsigned int head;
+  unsigned int tail;
+  unsigned char * control; // data stage of the HID class requests, GUSBHID_REPORT_BUFFER_SIZE bytes
+  unsigned char * out; // output report with a report ID, GUSBHID_REPORT_BUFFER_SIZE bytes
+} devices[GUSBHID_MAX_DEVICES] = { };
+
+void gusbhid_init(void) __attribute__((constructor (101)));
+void gusbhid_init(void) {
+  unsigned int i;
+  for (i = 0; i < sizeof(devices) / sizeof(*devices); ++i) {
+    devices[i].fd = -1;
+  }
+}
+
+#define CHECK_DEVICE(DEVICE,RETVALUE) \
+  if (DEVICE < 0 || DEVICE >= GUSBHID_MAX_DEVICES || devices[DEVICE].fd < 0) { \
+    PRINT_ERROR_OTHER("invalid device") \
+    return RETVALUE; \
+  }
+
+static int read_sysfs_value(const char * dir, const char * file, int base) {
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+  FILE * fp = fopen(path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+
+  char value[16] = { };
+  if (fgets(value, sizeof(value), fp) == NULL) {
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+
+  return strtol(value, NULL, base);
+}
+
+/*
+ * Find the hidraw node of a USB interface: /sys/class/hidraw/hidrawN/device links to
+ * <usb device>/<usb interface>/<hid device>.
+ */
+static int find_hidraw(unsigned char bus, unsigned char address, unsigned char interface, char * node, size_t size) {
+
+  DIR * dir = opendir("/sys/class/hidraw");
+  if (dir == NULL) {
+    PRINT_ERROR_ERRNO("opendir")
+    return -1;
+  }
+
+  int ret = -1;
+
+  struct dirent * entry;
+  while (ret < 0 && (entry = readdir(dir)) != NULL) {
+
+    if (strncmp(entry->d_name, "hidraw", sizeof("hidraw") - 1)) {
+      continue;
+    }
+
+    char link[PATH_MAX];
+    snprintf(link, sizeof(link), "/sys/class/hidraw/%s/device", entry->d_name);
+
+    char hid[PATH_MAX];
+    if (realpath(link, hid) == NULL) {
+      continue;
+    }
+
+    char * usbInterface = dirname(hid);
+    if (read_sysfs_value(usbInterface, "bInterfaceNumber", 16) != interface) {
+      continue;
+    }
+
+    char * usbDevice = dirname(usbInterface);
+    if (read_sysfs_value(usbDevice, "busnum", 10) != bus || read_sysfs_value(usbDevice, "devnum", 10) != address) {
+      continue;
+    }
+
+    snprintf(node, size, "/dev/%s", entry->d_name);
+    ret = 0;
+  }
+
+  closedir(dir);
+
+  if (ret < 0) {
+    fprintf(stderr, "%s:%d %s: no hidraw node for interface %hhu\n", __FILE__, __LINE__, __func__, interface);
+  }
+
+  return ret;
+}
+
+static int open_node(const char * node) {
+
+  int fd = open(node, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    PRINT_ERROR_ERRNO("open")
+  }
+  return fd;
+}
+
+static int open_hidraw(unsigned char bus, unsigned char address, unsigned char interface) {
+
+  char node[sizeof("/dev/") + NAME_MAX];
+  if (find_hidraw(bus, address, interface, node, sizeof(node)) < 0) {
+    return -1;
+  }
+
+  return open_node(node);
+}
+
+static int get_report_descriptor(int fd, struct hidraw_report_descriptor * rdesc) {
+
+  int size;
+  if (ioctl(fd, HIDIOCGRDESCSIZE, &size) < 0) {
+    PRINT_ERROR_ERRNO("ioctl HIDIOCGRDESCSIZE")
+    return -1;
+  }
+
+  rdesc->size = size;
+  if (ioctl(fd, HIDIOCGRDESC, rdesc) < 0) {
+    PRINT_ERROR_ERRNO("ioctl HIDIOCGRDESC")
+    return -1;
+  }
+
+  return size;
+}
+
+int gusbhid_get_report_descriptor(unsigned char bus, unsigned char address, unsigned char interface,
+    unsigned char * data, unsigned int size) {
+
+  int fd = open_hidraw(bus, address, interface);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct hidraw_report_descriptor rdesc;
+  int ret = get_report_descriptor(fd, &rdesc);
+  close(fd);
+
+  if (ret < 0) {
+    return -1;
+  }
+
+  if ((unsigned int) ret > size) {
+    ret = size;
+  }
+  memcpy(data, rdesc.value, ret);
+
+  return ret;
+}
+
+/*
+ * Look for a Report ID global item in the report descriptor.
+ */
+static int has_report_ids(const struct hidraw_report_descriptor * rdesc) {
+
+  unsigned int i = 0;
+  while (i < rdesc->size) {
+    unsigned char prefix = rdesc->value[i];
+    if (prefix == 0xfe) { // long item
+      if (i + 1 >= rdesc->size) {
+        break;
+      }
+      i += 3 + rdesc->value[i + 1];
+      continue;
+    }
+    if ((prefix & 0xfc) == 0x84) {
+      return 1;
+    }
+    unsigned char size = prefix & 0x03;
+    i += 1 + (size == 3 ? 4 : size);
+  }
+
+  return 0;
+}
+
+static s_interface * get_interface(int device, unsigned char endpoint) {
+
+  unsigned char i;
+  for (i = 0; i < devices[device].nbInterfaces; ++i) {
+    s_interface * interface = devices[device].interfaces + i;
+    if ((endpoint & USB_DIR_IN) ? interface->in == endpoint : interface->out == endpoint) {
+      return interface;
+    }
+  }
+
+  fprintf(stderr, "%s:%d %s: endpoint is not handled by the hidraw backend: 0x%02x\n", __FILE__, __LINE__, __func__, endpoint);
+  return NULL;
+}
+
+/*
+ * Queue the completion of a transfer, which is called from the submitting call.
+ */
+static int complete(int device, unsigned char endpoint, int status, const void * buf) {
+
+  if (devices[device].head - devices[device].tail == GUSBHID_MAX_COMPLETIONS) {
+    PRINT_ERROR_OTHER("too many completions")
+    return -1;
+  }
+
+  unsigned int index = devices[device].head++ % GUSBHID_MAX_COMPLETIONS;
+  devices[device].completions[index].endpoint = endpoint;
+  devices[device].completions[index].status = status;
+  devices[device].completions[index].buf = buf;
+  gettimeofday(&devices[device].completions[index].submitted, NULL);
+
+  uint64_t value = 1;
+  if (write(devices[device].fd, &value, sizeof(value)) != sizeof(value)) {
+    PRINT_ERROR_ERRNO("write")
+    return -1;
+  }
+
+  return 0;
+}
+
+static int process_completions(int device) {
+
+  CHECK_DEVICE(device, -1)
+
+  uint64_t value;
+  if (read(devices[device].fd, &value, sizeof(value)) < 0) {
+    // the completions may already have been processed
+  }
+
+  while (devices[device].tail != devices[device].head) {
+    unsigned int index = devices[device].tail++ % GUSBHID_MAX_COMPLETIONS;
+    devices[device].fp_complete(device, devices[device].completions[index].endpoint,
+        devices[device].completions[index].buf, devices[device].completions[index].status,
+        &devices[device].completions[index].submitted);
+    if (devices[device].fd < 0) {
+      break; // closed by the callback
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * An input report is available: it is read only if a read is pending.
+ * The fd is only registered while reads are pending, so that reports queue up in the kernel meanwhile.
+ */
+static int read_report(int user) {
+
+  int device = user / GUSBHID_MAX_INTERFACES;
+  CHECK_DEVICE(device, -1)
+
+  s_interface * interface = devices[device].interfaces + user % GUSBHID_MAX_INTERFACES;
+
+  ssize_t ret = read(interface->fd, interface->inBuffer, interface->inSize);
+  if (ret < 0) {
+    if (errno == EAGAIN) {
+      return 0;
+    }
+    PRINT_ERROR_ERRNO("read")
+    ret = E_TRANSFER_ERROR;
+  }
+
+  struct timeval submitted = interface->polled;
+
+  if (--interface->polling == 0) {
+    gpoll_remove_fd(interface->fd);
+  } else {
+    gettimeofday(&interface->polled, NULL);
+  }
+
+  devices[device].fp_complete(device, interface->in, interface->inBuffer, ret, &submitted);
+
+  return 0;
+}
+
+static int close_interface(int user) {
+
+  int device = user / GUSBHID_MAX_INTERFACES;
+  CHECK_DEVICE(device, -1)
+
+  return devices[device].fp_close(device);
+}
+
+int gusbhid_open(int device, unsigned char bus, unsigned char address, const s_gusbhid_interface * interfaces,
+    unsigned char nbInterfaces, GUSBHID_COMPLETE_CALLBACK fp_complete) {
+
+  if (device < 0 || device >= GUSBHID_MAX_DEVICES || devices[device].fd >= 0) {
+    PRINT_ERROR_OTHER("invalid device")
+    return -1;
+  }
+
+  if (nbInterfaces > GUSBHID_MAX_INTERFACES) {
+    PRINT_ERROR_OTHER("too many interfaces")
+    return -1;
+  }
+
+  devices[device].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (devices[device].fd < 0) {
+    PRINT_ERROR_ERRNO("eventfd")
+    return -1;
+  }
+
+  devices[device].fp_complete = fp_complete;
+
+  devices[device].control = calloc(GUSBHID_REPORT_BUFFER_SIZE, sizeof(unsigned char));
+  devices[device].out = calloc(GUSBHID_REPORT_BUFFER_SIZE, sizeof(unsigned char));
+  if (devices[device].control == NULL || devices[device].out == NULL) {
+    PRINT_ERROR_OTHER("calloc failed")
+    gusbhid_close(device);
+    return -1;
+  }
+
+  unsigned char i;
+  for (i = 0; i < nbInterfaces; ++i) {
+
+    s_interface * interface = devices[device].interfaces + i;
+    interface->number = interfaces[i].number;
+    interface->in = interfaces[i].in;
+    interface->inSize = interfaces[i].inSize;
+    interface->out = interfaces[i].out;
+    interface->fd = interfaces[i].node != NULL ? open_node(interfaces[i].node) : open_hidraw(bus, address, interfaces[i].number);
+    ++devices[device].nbInterfaces;
+
+    if (interface->fd < 0) {
+      gusbhid_close(device);
+      return -1;
+    }
+
+    struct hidraw_report_descriptor rdesc;
+    if (get_report_descriptor(interface->fd, &rdesc) < 0) {
+      gusbhid_close(device);
+      return -1;
+    }
+    interface->reportIds = has_report_ids(&rdesc);
+
+    if (interface->in) {
+      interface->inBuffer = calloc(interface->inSize, sizeof(unsigned char));
+      if (interface->inBuffer == NULL) {
+        PRINT_ERROR_OTHER("calloc failed")
+        gusbhid_close(device);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+int gusbhid_register(int device, GPOLL_CLOSE_CALLBACK fp_close, GPOLL_REGISTER_FD fp_register) {
+
+  CHECK_DEVICE(device, -1)
+
+  devices[device].fp_close = fp_close;
+  devices[device].fp_register = fp_register;
+
+  return fp_register(devices[device].fd, device, process_completions, NULL, fp_close);
+}
+
+int gusbhid_poll(int device, unsigned char endpoint) {
+
+  CHECK_DEVICE(device, -1)
+
+  s_interface * interface = get_interface(device, endpoint);
+  if (interface == NULL) {
+    return -1;
+  }
+
+  if (interface->polling++ == 0) {
+    gettimeofday(&interface->polled, NULL);
+    int ret = devices[device].fp_register(interface->fd, device * GUSBHID_MAX_INTERFACES + (interface - devices[device].interfaces),
+        read_report, NULL, close_interface);
+    if (ret < 0) {
+      --interface->polling;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Output reports start with the report ID, which has to be 0 if the device doesn't use report IDs.
+ */
+static const void * get_report(int device, const s_interface * interface, const void * buf, unsigned int * count) {
+
+  if (interface->reportIds) {
+    return buf;
+  }
+
+  if (*count >= GUSBHID_REPORT_BUFFER_SIZE) {
+    PRINT_ERROR_OTHER("report is too large")
+    return NULL;
+  }
+
+  devices[device].out[0] = 0x00;
+  memcpy(devices[device].out + 1, buf, *count);
+  ++(*count);
+
+  return devices[device].out;
+}
+
+int gusbhid_write(int device, unsigned char endpoint, const void * buf, unsigned int count) {
+
+  CHECK_DEVICE(device, -1)
+
+  s_interface * interface = get_interface(device, endpoint);
+  if (interface == NULL) {
+    return -1;
+  }
+
+  const void * report = get_report(device, interface, buf, &count);
+  if (report == NULL) {
+    return -1;
+  }
+
+  int status = 0;
+  ssize_t ret = write(interface->fd, report, count);
+  if (ret < 0) {
+    PRINT_ERROR_ERRNO("write")
+    status = E_TRANSFER_ERROR;
+  }
+
+  return complete(device, endpoint, status, NULL);
+}
+
+int gusbhid_is_hid_request(int device, const void * setup) {
+
+  const struct usb_ctrlrequest * request = setup;
+
+  if ((request->bRequestType & (USB_TYPE_MASK | USB_RECIP_MASK)) != (USB_TYPE_CLASS | USB_RECIP_INTERFACE)) {
+    return 0;
+  }
+
+  unsigned char i;
+  for (i = 0; i < devices[device].nbInterfaces; ++i) {
+    if (devices[device].interfaces[i].number == (request->wIndex & 0xff)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int get_report_ioctl(unsigned char type, unsigned int length) {
+
+  switch (type) {
+  case HID_REPORT_TYPE_FEATURE:
+    return HIDIOCGFEATURE(length);
+#ifdef HIDIOCGINPUT
+  case HID_REPORT_TYPE_INPUT:
+    return HIDIOCGINPUT(length);
+  case HID_REPORT_TYPE_OUTPUT:
+    return HIDIOCGOUTPUT(length);
+#endif
+  default:
+    return -1;
+  }
+}
+
+/*
+ * The report ID is the first byte of the buffer in hidraw ioctls, even if the device doesn't use report IDs.
+ */
+static int get_report_request(int device, s_interface * interface, const struct usb_ctrlrequest * request) {
+
+  unsigned char * data = devices[device].control;
+  unsigned int length = request->wLength + 1;
+  if (length > GUSBHID_REPORT_BUFFER_SIZE) {
+    length = GUSBHID_REPORT_BUFFER_SIZE;
+  }
+
+  int code = get_report_ioctl(request->wValue >> 8, length);
+  if (code == -1) {
+    return complete(device, 0, E_TRANSFER_STALL, data);
+  }
+
+  data[0] = request->wValue & 0xff;
+  int ret = ioctl(interface->fd, code, data);
+  if (ret < 0) {
+    PRINT_ERROR_ERRNO("ioctl HIDIOCGFEATURE")
+    return complete(device, 0, E_TRANSFER_STALL, data);
+  }
+
+  if (!interface->reportIds && ret > 0) {
+    // skip the report ID
+    return complete(device, 0, ret - 1, data + 1);
+  }
+
+  return complete(device, 0, ret > request->wLength ? request->wLength : ret, data);
+}
+
+static int set_report_request(int device, s_interface * interface, const struct usb_ctrlrequest * request, const void * buf, unsigned int count) {
+
+  const void * report = get_report(device, interface, buf, &count);
+  if (report == NULL) {
+    return complete(device, 0, E_TRANSFER_STALL, NULL);
+  }
+
+  int ret;
+  switch (request->wValue >> 8) {
+  case HID_REPORT_TYPE_FEATURE:
+    ret = ioctl(interface->fd, HIDIOCSFEATURE(count), report);
+    break;
+  case HID_REPORT_TYPE_OUTPUT:
+    ret = write(interface->fd, report, count);
+    break;
+#ifdef HIDIOCSINPUT
+  case HID_REPORT_TYPE_INPUT:
+    ret = ioctl(interface->fd, HIDIOCSINPUT(count), report);
+    break;
+#endif
+  default:
+    return complete(device, 0, E_TRANSFER_STALL, NULL);
+  }
+
+  if (ret < 0) {
+    PRINT_ERROR_ERRNO("set report")
+    return complete(device, 0, E_TRANSFER_STALL, NULL);
+  }
+
+  return complete(device, 0, 0, NULL);
+}
+
+/*
+ * Translate a HID class request: reports are forwarded to hidraw, and the idle rate and the protocol,
+ * which belong to the kernel driver, are acknowledged with default values.
+ */
+int gusbhid_control(int device, const void * buf, unsigned int count) {
+
+  CHECK_DEVICE(device, -1)
+
+  const struct usb_ctrlrequest * request = buf;
+
+  s_interface * interface = NULL;
+  unsigned char i;
+  for (i = 0; i < devices[device].nbInterfaces; ++i) {
+    if (devices[device].interfaces[i].number == (request->wIndex & 0xff)) {
+      interface = devices[device].interfaces + i;
+    }
+  }
+  if (interface == NULL) {
+    PRINT_ERROR_OTHER("no such interface")
+    return -1;
+  }
+
+  unsigned char * data = devices[device].control;
+
+  switch (request->bRequest) {
+  case HID_REQ_GET_REPORT:
+    return get_report_request(device, interface, request);
+  case HID_REQ_SET_REPORT:
+    return set_report_request(device, interface, request, (const unsigned char *) buf + sizeof(*request), count - sizeof(*request));
+  case HID_REQ_GET_IDLE:
+    data[0] = 0; // infinite
+    return complete(device, 0, request->wLength ? 1 : 0, data);
+  case HID_REQ_GET_PROTOCOL:
+    data[0] = 1; // report protocol
+    return complete(device, 0, request->wLength ? 1 : 0, data);
+  case HID_REQ_SET_IDLE:
+  case HID_REQ_SET_PROTOCOL:
+    return complete(device, 0, 0, NULL);
+  default:
+    return complete(device, 0, E_TRANSFER_STALL, (request->bRequestType & USB_DIR_IN) ? data : NULL);
+  }
+}
+
+int gusbhid_transfer_timeout(int device, unsigned char endpoint, void * buf, unsigned int count, unsigned int timeout) {
+
+  CHECK_DEVICE(device, -1)
+
+  s_interface * interface = get_interface(device, endpoint);
+  if (interface == NULL) {
+    return -1;
+  }
+
+  if (!(endpoint & USB_DIR_IN)) {
+    const void * report = get_report(device, interface, buf, &count);
+    if (report == NULL || write(interface->fd, report, count) < 0) {
+      PRINT_ERROR_ERRNO("write")
+      return -1;
+    }
+    return interface->reportIds ? count : count - 1;
+  }
+
+  struct pollfd pfd = { .fd = interface->fd, .events = POLLIN };
+  int ret = poll(&pfd, 1, timeout);
+  if (ret <= 0) {
+    return ret;
+  }
+
+  ret = read(interface->fd, buf, count);
+  if (ret < 0) {
+    PRINT_ERROR_ERRNO("read")
+  }
+  return ret;
+}
+
+int gusbhid_close(int device) {
+
+  CHECK_DEVICE(device, -1)
+
+  unsigned char i;
+  for (i = 0; i < devices[device].nbInterfaces; ++i) {
+    s_interface * interface = devices[device].interfaces + i;
+    if (interface->fd >= 0) {
+      gpoll_remove_fd(interface->fd);
+      close(interface->fd);
+    }
+    free(interface->inBuffer);
+  }
+
+  free(devices[device].control);
+  free(devices[device].out);
+
+  gpoll_remove_fd(devices[device].fd);
+  close(devices[device].fd);
+
+  memset(devices + device, 0x00, sizeof(*devices));
+  devices[device].fd = -1;
+
+  return 0;
+}
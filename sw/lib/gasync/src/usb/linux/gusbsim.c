@@ -0,0 +1,763 @@
+/*
+ Copyright (c) 2016 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#include "../gusbsim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#define GUSBSIM_MAX_DEVICES 256
+
+// completions waiting to be reported from gpoll
+#define GUSBSIM_MAX_COMPLETIONS 64
+
+#define GUSBSIM_MAX_LINE 4096
+
+#define GUSBSIM_LANG_ID 0x0409 // English (United States)
+
+#define HID_DT_REPORT 0x22
+
+#define PRINT_ERROR_ERRNO(msg) fprintf(stderr, "%s:%d %s: %s failed with error: %m\n", __FILE__, __LINE__, __func__, msg);
+#define PRINT_ERROR_OTHER(msg) fprintf(stderr, "%s:%d %s: %s\n", __FILE__, __LINE__, __func__, msg);
+
+/*
+ * Descriptors are replies to GET_DESCRIPTOR requests, so that they are looked up like the scripted control replies.
+ */
+typedef struct {
+  unsigned char bmRequestType;
+  unsigned char bRequest;
+  unsigned short wValue;
+  unsigned short wIndex;
+  int stall;
+  unsigned char * data;
+  unsigned int length;
+} s_reply;
+
+typedef struct {
+  unsigned char address;
+  int fd; // timerfd producing the reports, -1 if period is 0
+  unsigned int period; // microseconds
+  unsigned int size;
+  int ready; // a report was produced and not read yet
+  unsigned int polling; // number of pending reads
+  struct timeval polled; // start of the first pending read, reads are served one after the other
+  uint32_t sequence;
+  unsigned char * buffer; // size bytes, the read callback gets it directly
+} s_endpoint;
+
+static struct {
+  int fd; // eventfd signaling the completions
+  GUSBSIM_COMPLETE_CALLBACK fp_complete;
+  GPOLL_CLOSE_CALLBACK fp_close;
+  GPOLL_REGISTER_FD fp_register;
+  s_reply * replies;
+  unsigned int nbReplies;
+  unsigned char nbConfigurations;
+  s_endpoint endpoints[GUSBSIM_MAX_ENDPOINTS];
+  unsigned char nbEndpoints;
+  struct {
+    unsigned char endpoint;
+    int status;
+    const void * buf;
+    s_endpoint * report; // the report is built when the completion is reported
+    struct timeval submitted;
+  } completions[GUSBSIM_MAX_COMPLETIONS];
+  unsigned int head;
+  unsigned int tail;
+  unsigned char control[2]; // data stage of the standard requests without a reply
+} devices[GUSBSIM_MAX_DEVICES] = { };
+
+void gusbsim_init(void) __attribute__((constructor (101)));
+void gusbsim_init(void) {
+  unsigned int i;
+  for (i = 0; i < sizeof(devices) / sizeof(*devices); ++i) {
+    devices[i].fd = -1;
+  }
+}
+
+#define CHECK_DEVICE(DEVICE,RETVALUE) \
+  if (DEVICE < 0 || DEVICE >= GUSBSIM_MAX_DEVICES || devices[DEVICE].fd < 0) { \
+    PRINT_ERROR_OTHER("invalid device") \
+    return RETVALUE; \
+  }
+
+static s_reply * add_reply(int device, unsigned char bmRequestType, unsigned char bRequest, unsigned short wValue,
+    unsigned short wIndex) {
+
+  void * ptr = realloc(devices[device].replies, (devices[device].nbReplies + 1) * sizeof(*devices[device].replies));
+  if (ptr == NULL) {
+    PRINT_ERROR_OTHER("realloc failed")
+    return NULL;
+  }
+  devices[device].replies = ptr;
+
+  s_reply * reply = devices[device].replies + devices[device].nbReplies++;
+  memset(reply, 0x00, sizeof(*reply));
+  reply->bmRequestType = bmRequestType;
+  reply->bRequest = bRequest;
+  reply->wValue = wValue;
+  reply->wIndex = wIndex;
+
+  return reply;
+}
+
+static const s_reply * find_reply(int device, unsigned char bmRequestType, unsigned char bRequest, unsigned short wValue,
+    unsigned short wIndex) {
+
+  unsigned int i;
+  for (i = 0; i < devices[device].nbReplies; ++i) {
+    const s_reply * reply = devices[device].replies + i;
+    if (reply->bmRequestType == bmRequestType && reply->bRequest == bRequest && reply->wValue == wValue
+        && reply->wIndex == wIndex) {
+      return reply;
+    }
+  }
+
+  return NULL;
+}
+
+static int append_data(s_reply * reply, const unsigned char * data, unsigned int length) {
+
+  void * ptr = realloc(reply->data, reply->length + length);
+  if (ptr == NULL) {
+    PRINT_ERROR_OTHER("realloc failed")
+    return -1;
+  }
+  reply->data = ptr;
+
+  memcpy(reply->data + reply->length, data, length);
+  reply->length += length;
+
+  return 0;
+}
+
+/*
+ * Append the hexadecimal bytes of a line to a reply.
+ */
+static int append_bytes(s_reply * reply, char * str) {
+
+  unsigned char data[GUSBSIM_MAX_LINE / 2];
+  unsigned int length = 0;
+
+  char * token;
+  for (token = strtok(str, " \t"); token != NULL; token = strtok(NULL, " \t")) {
+    char * end;
+    unsigned long value = strtoul(token, &end, 16);
+    if (*end != '\0' || value > UCHAR_MAX) {
+      fprintf(stderr, "%s:%d %s: bad byte: %s\n", __FILE__, __LINE__, __func__, token);
+      return -1;
+    }
+    data[length++] = value;
+  }
+
+  return append_data(reply, data, length);
+}
+
+static int add_string(int device, unsigned char index, const char * text) {
+
+  s_reply * reply = add_reply(device, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, (USB_DT_STRING << 8) | index,
+      index ? GUSBSIM_LANG_ID : 0);
+  if (reply == NULL) {
+    return -1;
+  }
+
+  size_t length = strlen(text);
+  if (length > (UCHAR_MAX - 2) / 2) {
+    length = (UCHAR_MAX - 2) / 2;
+  }
+
+  unsigned char data[UCHAR_MAX];
+  data[0] = 2 + 2 * length;
+  data[1] = USB_DT_STRING;
+  size_t i;
+  for (i = 0; i < length; ++i) {
+    data[2 + 2 * i] = text[i];
+    data[3 + 2 * i] = 0x00;
+  }
+
+  return append_data(reply, data, data[0]);
+}
+
+static int add_endpoint(int device, unsigned char address, unsigned int period, unsigned int size) {
+
+  if (devices[device].nbEndpoints == GUSBSIM_MAX_ENDPOINTS) {
+    PRINT_ERROR_OTHER("too many endpoints")
+    return -1;
+  }
+
+  if (!(address & USB_DIR_IN) || size == 0) {
+    fprintf(stderr, "%s:%d %s: bad IN endpoint: 0x%02x\n", __FILE__, __LINE__, __func__, address);
+    return -1;
+  }
+
+  s_endpoint * endpoint = devices[device].endpoints + devices[device].nbEndpoints++;
+  endpoint->address = address;
+  endpoint->period = period;
+  endpoint->size = size;
+  endpoint->fd = -1;
+
+  endpoint->buffer = calloc(size, sizeof(unsigned char));
+  if (endpoint->buffer == NULL) {
+    PRINT_ERROR_OTHER("calloc failed")
+    return -1;
+  }
+
+  return 0;
+}
+
+static int parse_line(int device, char * line, s_reply ** last) {
+
+  char * keyword = strtok(line, " \t");
+
+  if (!strcmp(keyword, "device")) {
+    *last = add_reply(device, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0);
+  } else if (!strcmp(keyword, "configuration")) {
+    *last = add_reply(device, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, (USB_DT_CONFIG << 8) | devices[device].nbConfigurations++, 0);
+  } else if (!strcmp(keyword, "report")) {
+    char * interface = strtok(NULL, " \t");
+    if (interface == NULL) {
+      return -1;
+    }
+    *last = add_reply(device, USB_DIR_IN | USB_RECIP_INTERFACE, USB_REQ_GET_DESCRIPTOR, HID_DT_REPORT << 8,
+        strtoul(interface, NULL, 16));
+  } else if (!strcmp(keyword, "control")) {
+    char * fields[4];
+    unsigned int i;
+    for (i = 0; i < sizeof(fields) / sizeof(*fields); ++i) {
+      fields[i] = strtok(NULL, " \t");
+      if (fields[i] == NULL) {
+        return -1;
+      }
+    }
+    *last = add_reply(device, strtoul(fields[0], NULL, 16), strtoul(fields[1], NULL, 16), strtoul(fields[2], NULL, 16),
+        strtoul(fields[3], NULL, 16));
+  } else if (!strcmp(keyword, "string")) {
+    *last = NULL;
+    char * index = strtok(NULL, " \t");
+    char * text = strtok(NULL, "");
+    if (index == NULL) {
+      return -1;
+    }
+    return add_string(device, strtoul(index, NULL, 16), text != NULL ? text : "");
+  } else if (!strcmp(keyword, "in")) {
+    *last = NULL;
+    char * address = strtok(NULL, " \t");
+    char * period = strtok(NULL, " \t");
+    char * size = strtok(NULL, " \t");
+    if (address == NULL || period == NULL || size == NULL) {
+      return -1;
+    }
+    return add_endpoint(device, strtoul(address, NULL, 16), strtoul(period, NULL, 10), strtoul(size, NULL, 10));
+  } else {
+    fprintf(stderr, "%s:%d %s: unknown keyword: %s\n", __FILE__, __LINE__, __func__, keyword);
+    return -1;
+  }
+
+  if (*last == NULL) {
+    return -1;
+  }
+
+  char * data = strtok(NULL, "");
+  if (data != NULL && !strncmp(data, "stall", sizeof("stall") - 1)) {
+    (*last)->stall = 1;
+    *last = NULL;
+    return 0;
+  }
+
+  return data != NULL ? append_bytes(*last, data) : 0;
+}
+
+static int parse_script(int device, const char * script) {
+
+  FILE * fp = fopen(script, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "%s:%d %s: can't open %s: %m\n", __FILE__, __LINE__, __func__, script);
+    return -1;
+  }
+
+  int ret = 0;
+  unsigned int number = 0;
+  s_reply * last = NULL;
+  char line[GUSBSIM_MAX_LINE];
+
+  while (ret == 0 && fgets(line, sizeof(line), fp) != NULL) {
+
+    ++number;
+
+    char * comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    size_t length = strlen(line);
+    while (length > 0 && isspace((unsigned char) line[length - 1])) {
+      line[--length] = '\0';
+    }
+
+    char * start = line + strspn(line, " \t");
+    if (*start == '\0') {
+      continue;
+    }
+
+    if (start != line) {
+      // continuation of the data of the previous line
+      if (last == NULL) {
+        ret = -1;
+      } else {
+        ret = append_bytes(last, start);
+      }
+    } else {
+      ret = parse_line(device, line, &last);
+    }
+
+    if (ret < 0) {
+      fprintf(stderr, "%s:%d %s: %s: bad line %u\n", __FILE__, __LINE__, __func__, script, number);
+    }
+  }
+
+  fclose(fp);
+
+  return ret;
+}
+
+/*
+ * Fill the lengths that the script doesn't have to compute, and add the language IDs if the device has strings.
+ */
+static int fix_descriptors(int device) {
+
+  int hasStrings = 0;
+
+  unsigned int i;
+  for (i = 0; i < devices[device].nbReplies; ++i) {
+    s_reply * reply = devices[device].replies + i;
+    if (reply->bRequest != USB_REQ_GET_DESCRIPTOR || reply->bmRequestType != USB_DIR_IN || reply->stall) {
+      continue;
+    }
+    switch (reply->wValue >> 8) {
+    case USB_DT_CONFIG:
+      if (reply->length >= USB_DT_CONFIG_SIZE) {
+        reply->data[2] = reply->length & 0xff;
+        reply->data[3] = reply->length >> 8;
+      }
+      break;
+    case USB_DT_STRING:
+      hasStrings = 1;
+      break;
+    }
+  }
+
+  if (hasStrings && find_reply(device, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_STRING << 8, 0) == NULL) {
+    s_reply * reply = add_reply(device, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_STRING << 8, 0);
+    unsigned char data[] = { 4, USB_DT_STRING, GUSBSIM_LANG_ID & 0xff, GUSBSIM_LANG_ID >> 8 };
+    if (reply == NULL || append_data(reply, data, sizeof(data)) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * The reports must fit in wMaxPacketSize, as the read callbacks rely on it.
+ */
+static void check_report_sizes(int device) {
+
+  unsigned int i;
+  for (i = 0; i < devices[device].nbReplies; ++i) {
+    const s_reply * reply = devices[device].replies + i;
+    if (reply->bRequest != USB_REQ_GET_DESCRIPTOR || reply->bmRequestType != USB_DIR_IN
+        || (reply->wValue >> 8) != USB_DT_CONFIG) {
+      continue;
+    }
+    unsigned int offset = 0;
+    while (offset + 1 < reply->length && reply->data[offset] > 0) {
+      const unsigned char * descriptor = reply->data + offset;
+      if (descriptor[1] == USB_DT_ENDPOINT && offset + USB_DT_ENDPOINT_SIZE <= reply->length) {
+        unsigned short wMaxPacketSize = (descriptor[4] | (descriptor[5] << 8)) & 0x07ff;
+        unsigned char j;
+        for (j = 0; j < devices[device].nbEndpoints; ++j) {
+          s_endpoint * endpoint = devices[device].endpoints + j;
+          if (endpoint->address == descriptor[2] && endpoint->size > wMaxPacketSize) {
+            fprintf(stderr, "%s:%d %s: report size of endpoint 0x%02x reduced to %hu\n", __FILE__, __LINE__, __func__,
+                endpoint->address, wMaxPacketSize);
+            endpoint->size = wMaxPacketSize;
+          }
+        }
+      }
+      offset += descriptor[0];
+    }
+  }
+}
+
+static int start_timers(int device) {
+
+  unsigned char i;
+  for (i = 0; i < devices[device].nbEndpoints; ++i) {
+
+    s_endpoint * endpoint = devices[device].endpoints + i;
+    if (endpoint->period == 0) {
+      continue;
+    }
+
+    endpoint->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (endpoint->fd < 0) {
+      PRINT_ERROR_ERRNO("timerfd_create")
+      return -1;
+    }
+
+    struct timespec period = { .tv_sec = endpoint->period / 1000000, .tv_nsec = (endpoint->period % 1000000) * 1000 };
+    struct itimerspec value = { .it_interval = period, .it_value = period };
+    if (timerfd_settime(endpoint->fd, 0, &value, NULL) < 0) {
+      PRINT_ERROR_ERRNO("timerfd_settime")
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int gusbsim_open(int device, const char * script, GUSBSIM_COMPLETE_CALLBACK fp_complete) {
+
+  if (device < 0 || device >= GUSBSIM_MAX_DEVICES || devices[device].fd >= 0) {
+    PRINT_ERROR_OTHER("invalid device")
+    return -1;
+  }
+
+  devices[device].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (devices[device].fd < 0) {
+    PRINT_ERROR_ERRNO("eventfd")
+    return -1;
+  }
+
+  devices[device].fp_complete = fp_complete;
+
+  if (parse_script(device, script) < 0 || fix_descriptors(device) < 0) {
+    gusbsim_close(device);
+    return -1;
+  }
+
+  check_report_sizes(device);
+
+  if (start_timers(device) < 0) {
+    gusbsim_close(device);
+    return -1;
+  }
+
+  return 0;
+}
+
+int gusbsim_get_descriptor(int device, unsigned char bmRequestType, unsigned short wValue, unsigned short wIndex,
+    unsigned char * data, unsigned int size) {
+
+  CHECK_DEVICE(device, -1)
+
+  const s_reply * reply = find_reply(device, bmRequestType, USB_REQ_GET_DESCRIPTOR, wValue, wIndex);
+  if (reply == NULL || reply->stall) {
+    return -1;
+  }
+
+  unsigned int length = reply->length < size ? reply->length : size;
+  memcpy(data, reply->data, length);
+
+  return length;
+}
+
+static s_endpoint * get_endpoint(int device, unsigned char address) {
+
+  unsigned char i;
+  for (i = 0; i < devices[device].nbEndpoints; ++i) {
+    if (devices[device].endpoints[i].address == address) {
+      return devices[device].endpoints + i;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Queue the completion of a transfer, which is called from the submitting call.
+ */
+static int complete(int device, unsigned char endpoint, int status, const void * buf, s_endpoint * report) {
+
+  if (devices[device].head - devices[device].tail == GUSBSIM_MAX_COMPLETIONS) {
+    PRINT_ERROR_OTHER("too many completions")
+    return -1;
+  }
+
+  unsigned int index = devices[device].head++ % GUSBSIM_MAX_COMPLETIONS;
+  devices[device].completions[index].endpoint = endpoint;
+  devices[device].completions[index].status = status;
+  devices[device].completions[index].buf = buf;
+  devices[device].completions[index].report = report;
+  gettimeofday(&devices[device].completions[index].submitted, NULL);
+
+  uint64_t value = 1;
+  if (write(devices[device].fd, &value, sizeof(value)) != sizeof(value)) {
+    PRINT_ERROR_ERRNO("write")
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * The first bytes of a report hold its sequence number, so that lost or duplicated reports can be spotted.
+ */
+static void fill_report(s_endpoint * endpoint, unsigned char * buf, unsigned int length) {
+
+  uint32_t sequence = endpoint->sequence++;
+
+  memset(buf, 0x00, length);
+  unsigned int i;
+  for (i = 0; i < sizeof(sequence) && i < length; ++i) {
+    buf[i] = sequence >> (8 * i);
+  }
+}
+
+static void report(int device, s_endpoint * endpoint, const struct timeval * submitted) {
+
+  fill_report(endpoint, endpoint->buffer, endpoint->size);
+
+  devices[device].fp_complete(device, endpoint->address, endpoint->buffer, endpoint->size, submitted);
+}
+
+static int process_completions(int device) {
+
+  CHECK_DEVICE(device, -1)
+
+  uint64_t value;
+  if (read(devices[device].fd, &value, sizeof(value)) < 0) {
+    // the completions may already have been processed
+  }
+
+  // the completions queued by the callbacks are reported at the next iteration,
+  // else an endpoint that is always ready would never give control back to gpoll
+  unsigned int head = devices[device].head;
+
+  while (devices[device].tail != head) {
+    unsigned int index = devices[device].tail++ % GUSBSIM_MAX_COMPLETIONS;
+    if (devices[device].completions[index].report != NULL) {
+      report(device, devices[device].completions[index].report, &devices[device].completions[index].submitted);
+    } else {
+      devices[device].fp_complete(device, devices[device].completions[index].endpoint,
+          devices[device].completions[index].buf, devices[device].completions[index].status,
+          &devices[device].completions[index].submitted);
+    }
+    if (devices[device].fd < 0) {
+      break; // closed by the callback
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * The period of an endpoint elapsed: the report goes to a pending read, or waits for the next one.
+ * Like a device, the endpoint holds a single report, so that the reports produced meanwhile are lost.
+ */
+static int produce_report(int user) {
+
+  int device = user / GUSBSIM_MAX_ENDPOINTS;
+  CHECK_DEVICE(device, -1)
+
+  s_endpoint * endpoint = devices[device].endpoints + user % GUSBSIM_MAX_ENDPOINTS;
+
+  uint64_t expirations;
+  if (read(endpoint->fd, &expirations, sizeof(expirations)) < 0) {
+    if (errno == EAGAIN) {
+      return 0;
+    }
+    PRINT_ERROR_ERRNO("read")
+    return -1;
+  }
+
+  if (endpoint->polling > 0) {
+    struct timeval submitted = endpoint->polled;
+    if (--endpoint->polling > 0) {
+      gettimeofday(&endpoint->polled, NULL);
+    }
+    report(device, endpoint, &submitted);
+  } else {
+    endpoint->ready = 1;
+  }
+
+  return 0;
+}
+
+static int close_endpoint(int user) {
+
+  int device = user / GUSBSIM_MAX_ENDPOINTS;
+  CHECK_DEVICE(device, -1)
+
+  return devices[device].fp_close(device);
+}
+
+int gusbsim_register(int device, GPOLL_CLOSE_CALLBACK fp_close, GPOLL_REGISTER_FD fp_register) {
+
+  CHECK_DEVICE(device, -1)
+
+  devices[device].fp_close = fp_close;
+  devices[device].fp_register = fp_register;
+
+  unsigned char i;
+  for (i = 0; i < devices[device].nbEndpoints; ++i) {
+    s_endpoint * endpoint = devices[device].endpoints + i;
+    if (endpoint->fd >= 0 && fp_register(endpoint->fd, device * GUSBSIM_MAX_ENDPOINTS + i, produce_report, NULL, close_endpoint) < 0) {
+      return -1;
+    }
+  }
+
+  return fp_register(devices[device].fd, device, process_completions, NULL, fp_close);
+}
+
+/*
+ * A read completes as soon as a report is ready, else it stays pending until the next period.
+ * Endpoints without a report are never ready, like an endpoint that always NAKs.
+ */
+int gusbsim_poll(int device, unsigned char endpoint) {
+
+  CHECK_DEVICE(device, -1)
+
+  s_endpoint * pEndpoint = get_endpoint(device, endpoint);
+  if (pEndpoint == NULL) {
+    return 0;
+  }
+
+  if (pEndpoint->period == 0 || pEndpoint->ready) {
+    pEndpoint->ready = 0;
+    return complete(device, endpoint, 0, NULL, pEndpoint);
+  }
+
+  if (pEndpoint->polling++ == 0) {
+    gettimeofday(&pEndpoint->polled, NULL);
+  }
+
+  return 0;
+}
+
+int gusbsim_write(int device, unsigned char endpoint, const void * buf __attribute__((unused)), unsigned int count) {
+
+  CHECK_DEVICE(device, -1)
+
+  return complete(device, endpoint, count, NULL, NULL);
+}
+
+/*
+ * Reply to a standard request that has no scripted reply.
+ * Returns the length of the data stage, or -1 if the request has to be stalled.
+ */
+static int get_standard_reply(int device, const struct usb_ctrlrequest * request) {
+
+  if ((request->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD) {
+    return -1;
+  }
+
+  if (!(request->bRequestType & USB_DIR_IN)) {
+    return request->wLength == 0 ? 0 : -1;
+  }
+
+  unsigned char * data = devices[device].control;
+
+  switch (request->bRequest) {
+  case USB_REQ_GET_STATUS:
+    data[0] = 0x00;
+    data[1] = 0x00;
+    return 2;
+  case USB_REQ_GET_CONFIGURATION:
+    data[0] = 1;
+    return 1;
+  case USB_REQ_GET_INTERFACE:
+    data[0] = 0;
+    return 1;
+  default:
+    return -1;
+  }
+}
+
+int gusbsim_control(int device, const void * buf, unsigned int count) {
+
+  CHECK_DEVICE(device, -1)
+
+  const struct usb_ctrlrequest * request = buf;
+  const void * data = (request->bRequestType & USB_DIR_IN) ? devices[device].control : NULL;
+
+  const s_reply * reply = find_reply(device, request->bRequestType, request->bRequest, request->wValue, request->wIndex);
+  if (reply == NULL) {
+    int length = get_standard_reply(device, request);
+    if (length < 0) {
+      return complete(device, 0, E_TRANSFER_STALL, data, NULL);
+    }
+    return complete(device, 0, length < request->wLength ? length : request->wLength, data, NULL);
+  }
+
+  if (reply->stall) {
+    return complete(device, 0, E_TRANSFER_STALL, data, NULL);
+  }
+
+  if (!(request->bRequestType & USB_DIR_IN)) {
+    return complete(device, 0, count - sizeof(*request), NULL, NULL);
+  }
+
+  return complete(device, 0, reply->length < request->wLength ? reply->length : request->wLength, reply->data, NULL);
+}
+
+/*
+ * OUT transfers always succeed, IN transfers get a report right away if the endpoint produces reports.
+ */
+int gusbsim_transfer_timeout(int device, unsigned char endpoint, void * buf, unsigned int count,
+    unsigned int timeout __attribute__((unused))) {
+
+  CHECK_DEVICE(device, -1)
+
+  if (!(endpoint & USB_DIR_IN)) {
+    return count;
+  }
+
+  s_endpoint * pEndpoint = get_endpoint(device, endpoint);
+  if (pEndpoint == NULL) {
+    return 0;
+  }
+
+  unsigned int length = pEndpoint->size < count ? pEndpoint->size : count;
+  fill_report(pEndpoint, buf, length);
+
+  return length;
+}
+
+int gusbsim_close(int device) {
+
+  CHECK_DEVICE(device, -1)
+
+  unsigned char i;
+  for (i = 0; i < devices[device].nbEndpoints; ++i) {
+    s_endpoint * endpoint = devices[device].endpoints + i;
+    if (endpoint->fd >= 0) {
+      gpoll_remove_fd(endpoint->fd);
+      close(endpoint->fd);
+    }
+    free(endpoint->buffer);
+  }
+
+  unsigned int j;
+  for (j = 0; j < devices[device].nbReplies; ++j) {
+    free(devices[device].replies[j].data);
+  }
+  free(devices[device].replies);
+
+  gpoll_remove_fd(devices[device].fd);
+  close(devices[device].fd);
+
+  memset(devices + device, 0x00, sizeof(*devices));
+  devices[device].fd = -1;
+
+  return 0;
+}
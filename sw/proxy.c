@@ -10,10 +10,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <gpoll.h>
 #include <gtimer.h>
 #include <names.h>
 #include <prio.h>
+#include <fwclock.h>
 #include <sys/time.h>
 
 #define ENDPOINT_MAX_NUMBER USB_ENDPOINT_NUMBER_MASK
@@ -29,19 +31,118 @@
 static int usb = -1;
 static int adapter = -1;
 static int init_timer = -1;
+static int resync_timer = -1;
 
 static s_usb_descriptors * descriptors = NULL;
 static unsigned char desc[MAX_DESCRIPTORS_SIZE] = {};
 static unsigned char * pDesc = desc;
+// size of the descriptor buffer of the firmware, given in its hash reply
+static uint16_t descriptorsSize = MAX_DESCRIPTORS_SIZE;
 static s_descriptorIndex descIndex[MAX_DESCRIPTORS] = {};
 static s_descriptorIndex * pDescIndex = descIndex;
 static s_endpointConfig endpoints[MAX_ENDPOINTS] = {};
 static s_endpointConfig * pEndpoints = endpoints;
 
-static uint8_t descIndexSent = 0;
-static uint8_t endpointsSent = 0;
+/*
+ * Descriptors that are not uploaded to the firmware are requested on demand through the control endpoint,
+ * and served from the host copy. In lazy mode only the hot set (device, langId0 and configuration
+ * descriptors) is uploaded, else the descriptors that don't fit into the firmware buffer are skipped.
+ * The hot set is also served on demand if it doesn't fit.
+ */
+static int lazyDescriptors = 0;
+
+static e_gusb_backend usbBackend = E_GUSB_BACKEND_LIBUSB;
+
+// script of the simulated device, which replaces the selection of a real device
+static const char * simulatedDevice = NULL;
+
+static int fastAttach = 0;
+
+// USB libusb events are handled in a dedicated thread if eventThreadCpu >= -1 (-1: no cpu affinity)
+static int eventThreadCpu = -2;
+
+/*
+ * The USB latency of control transfers, from their submission to the completion of the libusb transfer,
+ * which does not include the time spent processing other events.
+ */
+static struct {
+  struct timeval submitted;
+  unsigned int count;
+  unsigned long long latency; // microseconds
+  unsigned int maxLatency; // microseconds
+  struct timeval setup; // host time of the setup packet on the target side, tv_sec == 0 if unknown
+} controlLatency = {};
+
+typedef struct {
+  unsigned int count;
+  long long latency; // microseconds
+  long long maxLatency; // microseconds
+} s_wire_latency;
+
+/*
+ * The latencies between the target host and the device, based on the firmware timestamps:
+ * - in: from the completion of the IN transfer on the device side to the packet being written into the target endpoint
+ * - out: from the OUT packet being read from the target endpoint to the submission of the transfer on the device side
+ * - control: from the setup packet on the target side to the completion of the transfer on the device side
+ */
+static struct {
+  s_wire_latency in;
+  s_wire_latency out;
+  s_wire_latency control;
+} wireLatency = {};
+
+/*
+ * The totals of the statistics reported by the firmware.
+ */
+static struct {
+  unsigned int reports;
+  unsigned long long framingErrors;
+  unsigned long long overrunErrors;
+  unsigned long long parityErrors;
+  unsigned long long rxOverflows;
+  unsigned long long droppedInPackets;
+  unsigned long long controlTimeouts;
+  unsigned int maxLoopTime; // microseconds
+  unsigned long long naks[2][ENDPOINT_MAX_NUMBER]; // per serial endpoint
+} firmwareStats = {};
+
+// host time of the event carried by the packet being processed, tv_sec == 0 if the packet has no timestamp
+static struct timeval firmwareTime = {};
+
+/*
+ * The timing of the control requests as measured by the firmware, from the setup packet to the end of the status stage.
+ */
+static struct {
+  unsigned int count[E_CONTROL_ABORTED + 1]; // per e_controlStatus
+  unsigned long long reply; // microseconds
+  unsigned int maxReply; // microseconds
+  unsigned long long total; // microseconds
+  unsigned int maxTotal; // microseconds
+} controlTiming = {};
+
+static struct {
+  struct timeval start; // reception of the pending request, tv_sec == 0 if none
+  unsigned int count;
+  unsigned long long bytes;
+  unsigned long long latency; // microseconds
+  unsigned int maxLatency; // microseconds
+} onDemandDescriptors = {};
 
-static uint8_t inPending = 0;
+/*
+ * The session with the firmware goes through the descriptors/index/endpoints handshake,
+ * and gets back to the beginning each time the firmware announces a (re)start.
+ */
+typedef enum {
+  E_SESSION_IDLE,
+  E_SESSION_HASH,        // hash sent, waiting for the firmware to tell if it has the descriptors
+  E_SESSION_DESCRIPTORS, // descriptors sent, waiting for the ack
+  E_SESSION_INDEX,       // index sent, waiting for the ack
+  E_SESSION_ENDPOINTS,   // endpoints sent, waiting for the ack
+  E_SESSION_STARTED,
+  E_SESSION_RESETTING,   // reset requested, waiting for the firmware to announce its start
+} e_sessionState;
+
+static e_sessionState sessionState = E_SESSION_IDLE;
 
 static uint8_t serialToUsbEndpoint[2][ENDPOINT_MAX_NUMBER] = {};
 static uint8_t usbToSerialEndpoint[2][ENDPOINT_MAX_NUMBER] = {};
@@ -51,14 +152,63 @@ static uint8_t usbToSerialEndpoint[2][ENDPOINT_MAX_NUMBER] = {};
 #define S2U_ENDPOINT(ENDPOINT) serialToUsbEndpoint[ENDPOINT_DIR_TO_INDEX(ENDPOINT)][ENDPOINT_ADDR_TO_INDEX(ENDPOINT)]
 #define U2S_ENDPOINT(ENDPOINT) usbToSerialEndpoint[ENDPOINT_DIR_TO_INDEX(ENDPOINT)][ENDPOINT_ADDR_TO_INDEX(ENDPOINT)]
 
-static struct {
-  uint16_t length;
-  s_endpointPacket packet;
-} inPackets[ENDPOINT_MAX_NUMBER] = {};
+// number of packets that can be pending or queued for a bulk IN endpoint
+#define BULK_IN_QUEUE_DEPTH 4
+
+// the serial link carries 10 bits per byte (8 data bits, start and stop bits)
+#define LINK_BUDGET_PER_SECOND (USART_BAUDRATE / 10)
 
-static uint8_t inEpFifo[MAX_ENDPOINTS] = {};
+#define LINK_TIMER_PERIOD 10000 // microseconds
+
+#define LINK_BUDGET_PER_PERIOD (LINK_BUDGET_PER_SECOND / (1000000 / LINK_TIMER_PERIOD))
+
+static struct {
+  uint8_t type; // USB_ENDPOINT_XFER_INT or USB_ENDPOINT_XFER_BULK
+  uint8_t polling; // number of pending read transfers
+  uint8_t head;
+  uint8_t nbPackets;
+  uint8_t inFlight; // a packet was sent to the firmware and is waiting for an ack
+  struct timeval inFlightReaped; // completion time of the IN transfer of the packet waiting for an ack
+  struct {
+    struct timeval reaped; // completion time of the IN transfer
+    uint16_t length;
+    s_endpointPacket packet;
+  } packets[BULK_IN_QUEUE_DEPTH];
+} inEndpoints[ENDPOINT_MAX_NUMBER] = {};
+
+static uint8_t inEpFifo[MAX_ENDPOINTS * BULK_IN_QUEUE_DEPTH] = {};
 static uint8_t nbInEpFifo = 0;
 
+// number of packets sent to the firmware and waiting for an ack, at most one per endpoint
+static uint8_t nbInFlight = 0;
+
+/*
+ * The number of bytes the serial link can still carry towards the firmware in the current period.
+ * It is refilled periodically, and bulk IN endpoints are only polled while it is positive.
+ */
+static int linkBudget = LINK_BUDGET_PER_PERIOD;
+
+static struct {
+  struct timeval start;
+  unsigned long long bytes[2][ENDPOINT_MAX_NUMBER];
+} throughput = {};
+
+// control transfers exceeding a packet are split into fragments of whole control endpoint packets
+#define CONTROL_FRAGMENT_SIZE ((MAX_PACKET_VALUE_SIZE / MAX_PACKET_SIZE_EP0) * MAX_PACKET_SIZE_EP0)
+
+// the control request being received from the firmware (setup + data stage)
+static struct {
+  unsigned char data[sizeof(struct usb_ctrlrequest) + USHRT_MAX];
+  unsigned int length;
+} controlRequest = {};
+
+// the data stage of the control IN transfer being sent to the firmware
+static struct {
+  unsigned char data[USHRT_MAX];
+  unsigned int length;
+  unsigned int offset;
+} controlReply = {};
+
 static volatile int done;
 
 #define EP_PROP_IN    (1 << 0)
@@ -72,32 +222,49 @@ static volatile int done;
 /*
  * the atmega32u4 supports up to 6 non-control endpoints
  * that can be IN or OUT (not BIDIR),
- * and only the INTERRUPT type is supported.
+ * and only the INTERRUPT and BULK types are supported.
  */
 static uint8_t targetProperties[ENDPOINT_MAX_NUMBER] = {
-  EP_PROP_IN | EP_PROP_OUT | EP_PROP_INT,
-  EP_PROP_IN | EP_PROP_OUT | EP_PROP_INT,
-  EP_PROP_IN | EP_PROP_OUT | EP_PROP_INT,
-  EP_PROP_IN | EP_PROP_OUT | EP_PROP_INT,
-  EP_PROP_IN | EP_PROP_OUT | EP_PROP_INT,
-  EP_PROP_IN | EP_PROP_OUT | EP_PROP_INT,
+  EP_PROP_IN | EP_PROP_OUT | EP_PROP_INT | EP_PROP_BLK,
+  EP_PROP_IN | EP_PROP_OUT | EP_PROP_INT | EP_PROP_BLK,
+  EP_PROP_IN | EP_PROP_OUT | EP_PROP_INT | EP_PROP_BLK,
+  EP_PROP_IN | EP_PROP_OUT | EP_PROP_INT | EP_PROP_BLK,
+  EP_PROP_IN | EP_PROP_OUT | EP_PROP_INT | EP_PROP_BLK,
+  EP_PROP_IN | EP_PROP_OUT | EP_PROP_INT | EP_PROP_BLK,
 };
 
+/*
+ * Send the oldest queued packets of the endpoints that have no packet waiting for an ack,
+ * as long as the firmware has free IN slots.
+ */
 static int send_next_in_packet() {
 
-  if (inPending) {
+  if (sessionState != E_SESSION_STARTED) {
     return 0;
   }
 
-  if (nbInEpFifo > 0) {
-    uint8_t inPacketIndex = ENDPOINT_ADDR_TO_INDEX(inEpFifo[0]);
-    int ret = adapter_send(adapter, E_TYPE_IN, (const void *)&inPackets[inPacketIndex].packet, inPackets[inPacketIndex].length);
+  uint8_t i = 0;
+  while (i < nbInEpFifo && nbInFlight < IN_SLOTS) {
+    uint8_t inPacketIndex = ENDPOINT_ADDR_TO_INDEX(inEpFifo[i]);
+    if (inEndpoints[inPacketIndex].inFlight) {
+      ++i;
+      continue;
+    }
+    uint8_t head = inEndpoints[inPacketIndex].head;
+    uint16_t length = inEndpoints[inPacketIndex].packets[head].length;
+    int ret = adapter_send(adapter, E_TYPE_IN, (const void *)&inEndpoints[inPacketIndex].packets[head].packet, length);
     if(ret < 0) {
       return -1;
     }
-    inPending = inEpFifo[0];
+    linkBudget -= sizeof(s_header) + length;
+    throughput.bytes[ENDPOINT_DIR_TO_INDEX(USB_DIR_IN)][inPacketIndex] += length - 1;
+    inEndpoints[inPacketIndex].head = (head + 1) % BULK_IN_QUEUE_DEPTH;
+    --inEndpoints[inPacketIndex].nbPackets;
+    inEndpoints[inPacketIndex].inFlight = 1;
+    inEndpoints[inPacketIndex].inFlightReaped = inEndpoints[inPacketIndex].packets[head].reaped;
+    ++nbInFlight;
     --nbInEpFifo;
-    memmove(inEpFifo, inEpFifo + 1, nbInEpFifo * sizeof(*inEpFifo));
+    memmove(inEpFifo + i, inEpFifo + i + 1, (nbInEpFifo - i) * sizeof(*inEpFifo));
   }
 
   return 0;
@@ -105,15 +272,20 @@ static int send_next_in_packet() {
 
 static int queue_in_packet(unsigned char endpoint, const void * buf, int transfered) {
 
-  if (nbInEpFifo == sizeof(inEpFifo) / sizeof(*inEpFifo)) {
+  uint8_t inPacketIndex = ENDPOINT_ADDR_TO_INDEX(endpoint);
+
+  if (nbInEpFifo == sizeof(inEpFifo) / sizeof(*inEpFifo)
+      || inEndpoints[inPacketIndex].nbPackets == BULK_IN_QUEUE_DEPTH) {
     PRINT_ERROR_OTHER("no more space in inEpFifo")
     return -1;
   }
 
-  uint8_t inPacketIndex = ENDPOINT_ADDR_TO_INDEX(endpoint);
-  inPackets[inPacketIndex].packet.endpoint = U2S_ENDPOINT(endpoint);
-  memcpy(inPackets[inPacketIndex].packet.data, buf, transfered);
-  inPackets[inPacketIndex].length = transfered + 1;
+  uint8_t tail = (inEndpoints[inPacketIndex].head + inEndpoints[inPacketIndex].nbPackets) % BULK_IN_QUEUE_DEPTH;
+  inEndpoints[inPacketIndex].packets[tail].packet.endpoint = U2S_ENDPOINT(endpoint);
+  memcpy(inEndpoints[inPacketIndex].packets[tail].packet.data, buf, transfered);
+  inEndpoints[inPacketIndex].packets[tail].length = transfered + 1;
+  gusb_get_reap_time(&inEndpoints[inPacketIndex].packets[tail].reaped);
+  ++inEndpoints[inPacketIndex].nbPackets;
   inEpFifo[nbInEpFifo] = endpoint;
   ++nbInEpFifo;
 
@@ -124,8 +296,105 @@ static int queue_in_packet(unsigned char endpoint, const void * buf, int transfe
   return 0;
 }
 
+/*
+ * The latency of an on-demand descriptor is measured from the reception of the request
+ * to the transmission of the last part of the reply, including the acks of the fragments.
+ */
+static void end_descriptor_request() {
+
+  if (onDemandDescriptors.start.tv_sec == 0) {
+    return;
+  }
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  unsigned int latency = (now.tv_sec - onDemandDescriptors.start.tv_sec) * 1000000 + now.tv_usec - onDemandDescriptors.start.tv_usec;
+
+  ++onDemandDescriptors.count;
+  onDemandDescriptors.latency += latency;
+  if (latency > onDemandDescriptors.maxLatency) {
+    onDemandDescriptors.maxLatency = latency;
+  }
+  onDemandDescriptors.start.tv_sec = 0;
+}
+
+/*
+ * Send the next fragment of the control reply: all fragments but the last one are acked by the firmware.
+ */
+static int send_control_fragment() {
+
+  unsigned int remaining = controlReply.length - controlReply.offset;
+
+  unsigned char type = E_TYPE_CONTROL_DATA;
+  if (remaining <= MAX_PACKET_VALUE_SIZE) {
+    type = E_TYPE_CONTROL;
+  } else {
+    remaining = CONTROL_FRAGMENT_SIZE;
+  }
+
+  int ret = adapter_send(adapter, type, controlReply.data + controlReply.offset, remaining);
+  controlReply.offset += remaining;
+  if (type == E_TYPE_CONTROL) {
+    controlReply.length = 0;
+    controlReply.offset = 0;
+    end_descriptor_request();
+  }
+  return ret;
+}
+
+static int send_control_reply(const void * buf, unsigned int length) {
+
+  if (length <= MAX_PACKET_VALUE_SIZE) {
+    int ret = adapter_send(adapter, E_TYPE_CONTROL, buf, length);
+    end_descriptor_request();
+    return ret;
+  }
+
+  memcpy(controlReply.data, buf, length);
+  controlReply.length = length;
+  controlReply.offset = 0;
+
+  return send_control_fragment();
+}
+
+static void update_wire_latency(s_wire_latency * wire, const struct timeval * from, const struct timeval * to) {
+
+  if (from->tv_sec == 0) {
+    return;
+  }
+
+  long long latency = (to->tv_sec - from->tv_sec) * 1000000LL + to->tv_usec - from->tv_usec;
+
+  ++wire->count;
+  wire->latency += latency;
+  if (latency > wire->maxLatency) {
+    wire->maxLatency = latency;
+  }
+}
+
+static void update_control_latency() {
+
+  struct timeval reaped;
+  gusb_get_reap_time(&reaped);
+
+  update_wire_latency(&wireLatency.control, &controlLatency.setup, &reaped);
+  controlLatency.setup.tv_sec = 0;
+
+  unsigned int latency = (reaped.tv_sec - controlLatency.submitted.tv_sec) * 1000000 + reaped.tv_usec - controlLatency.submitted.tv_usec;
+
+  ++controlLatency.count;
+  controlLatency.latency += latency;
+  if (latency > controlLatency.maxLatency) {
+    controlLatency.maxLatency = latency;
+  }
+}
+
 int usb_read_callback(int user, unsigned char endpoint, const void * buf, int status) {
 
+  if (endpoint != 0) {
+    --inEndpoints[ENDPOINT_ADDR_TO_INDEX(endpoint)].polling;
+  }
+
   switch (status) {
   case E_TRANSFER_TIMED_OUT:
     PRINT_TRANSFER_READ_ERROR(endpoint, "TIMEOUT")
@@ -141,7 +410,14 @@ int usb_read_callback(int user, unsigned char endpoint, const void * buf, int st
 
   if (endpoint == 0) {
 
-    if (status > (int)MAX_PACKET_VALUE_SIZE) {
+    update_control_latency();
+
+    if (sessionState != E_SESSION_STARTED) {
+      printf("drop control reply (firmware restarted)\n");
+      return 0;
+    }
+
+    if (status > USHRT_MAX) {
       PRINT_ERROR_OTHER("too many bytes transfered")
       done = 1;
       return -1;
@@ -149,7 +425,7 @@ int usb_read_callback(int user, unsigned char endpoint, const void * buf, int st
 
     int ret;
     if (status >= 0) {
-      ret = adapter_send(adapter, E_TYPE_CONTROL, buf, status);
+      ret = send_control_reply(buf, status);
     } else {
       ret = adapter_send(adapter, E_TYPE_CONTROL_STALL, NULL, 0);
     }
@@ -185,6 +461,15 @@ int usb_read_callback(int user, unsigned char endpoint, const void * buf, int st
 
 int usb_write_callback(int user, unsigned char endpoint, int status) {
 
+  if (endpoint == 0) {
+    update_control_latency();
+  }
+
+  if (endpoint == 0 && sessionState != E_SESSION_STARTED) {
+    printf("drop control reply (firmware restarted)\n");
+    return 0;
+  }
+
   switch (status) {
   case E_TRANSFER_TIMED_OUT:
     PRINT_TRANSFER_WRITE_ERROR(endpoint, "TIMEOUT")
@@ -309,38 +594,31 @@ void print_endpoint_properties(uint8_t epProps[ENDPOINT_MAX_NUMBER]) {
 
 void get_endpoint_properties(unsigned char configurationIndex, uint8_t epProps[ENDPOINT_MAX_NUMBER]) {
 
-  struct p_configuration * pConfiguration = descriptors->configurations + configurationIndex;
-  unsigned char interfaceIndex;
-  for (interfaceIndex = 0; interfaceIndex < pConfiguration->descriptor->bNumInterfaces; ++interfaceIndex) {
-    struct p_interface * pInterface = pConfiguration->interfaces + interfaceIndex;
-    unsigned char altInterfaceIndex;
-    for (altInterfaceIndex = 0; altInterfaceIndex < pInterface->bNumAltInterfaces; ++altInterfaceIndex) {
-      struct p_altInterface * pAltInterface = pInterface->altInterfaces + altInterfaceIndex;
-      unsigned char endpointIndex;
-      for (endpointIndex = 0; endpointIndex < pAltInterface->bNumEndpoints; ++endpointIndex) {
-        struct usb_endpoint_descriptor * endpoint =
-            descriptors->configurations[configurationIndex].interfaces[interfaceIndex].altInterfaces[altInterfaceIndex].endpoints[endpointIndex];
-        uint8_t epIndex = ENDPOINT_ADDR_TO_INDEX(endpoint->bEndpointAddress);
-        switch (endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) {
-        case USB_ENDPOINT_XFER_INT:
-          epProps[epIndex] |= EP_PROP_INT;
-          break;
-        case USB_ENDPOINT_XFER_BULK:
-          epProps[epIndex] |= EP_PROP_BLK;
-          break;
-        case USB_ENDPOINT_XFER_ISOC:
-          epProps[epIndex] |= EP_PROP_ISO;
-          break;
-        }
-        if ((endpoint->bEndpointAddress & USB_ENDPOINT_DIR_MASK) == USB_DIR_IN) {
-          epProps[epIndex] |= EP_PROP_IN;
-        } else {
-          epProps[epIndex] |= EP_PROP_OUT;
-        }
-        if ((epProps[epIndex] & (EP_PROP_IN | EP_PROP_OUT)) == (EP_PROP_IN | EP_PROP_OUT)) {
-          epProps[epIndex] |= EP_PROP_BIDIR;
-        }
-      }
+  unsigned int i;
+  for (i = 0; i < descriptors->nbEndpoints; ++i) {
+    if (descriptors->endpoints[i].configurationIndex != configurationIndex) {
+      continue;
+    }
+    struct usb_endpoint_descriptor * endpoint = descriptors->endpoints[i].descriptor;
+    uint8_t epIndex = ENDPOINT_ADDR_TO_INDEX(endpoint->bEndpointAddress);
+    switch (endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) {
+    case USB_ENDPOINT_XFER_INT:
+      epProps[epIndex] |= EP_PROP_INT;
+      break;
+    case USB_ENDPOINT_XFER_BULK:
+      epProps[epIndex] |= EP_PROP_BLK;
+      break;
+    case USB_ENDPOINT_XFER_ISOC:
+      epProps[epIndex] |= EP_PROP_ISO;
+      break;
+    }
+    if ((endpoint->bEndpointAddress & USB_ENDPOINT_DIR_MASK) == USB_DIR_IN) {
+      epProps[epIndex] |= EP_PROP_IN;
+    } else {
+      epProps[epIndex] |= EP_PROP_OUT;
+    }
+    if ((epProps[epIndex] & (EP_PROP_IN | EP_PROP_OUT)) == (EP_PROP_IN | EP_PROP_OUT)) {
+      epProps[epIndex] |= EP_PROP_BIDIR;
     }
   }
 }
@@ -373,71 +651,74 @@ void fix_endpoints() {
     unsigned char endpointNumber = 0;
     struct p_configuration * pConfiguration = descriptors->configurations + configurationIndex;
     printf("configuration: %hhu\n", pConfiguration->descriptor->bConfigurationValue);
-    unsigned char interfaceIndex;
-    for (interfaceIndex = 0; interfaceIndex < pConfiguration->descriptor->bNumInterfaces; ++interfaceIndex) {
-      struct p_interface * pInterface = pConfiguration->interfaces + interfaceIndex;
-      unsigned char altInterfaceIndex;
-      for (altInterfaceIndex = 0; altInterfaceIndex < pInterface->bNumAltInterfaces; ++altInterfaceIndex) {
-        struct p_altInterface * pAltInterface = pInterface->altInterfaces + altInterfaceIndex;
+    struct p_altInterface * pAltInterface = NULL;
+    unsigned int i;
+    for (i = 0; i < descriptors->nbEndpoints; ++i) {
+      struct p_endpoint * pEndpoint = descriptors->endpoints + i;
+      if (pEndpoint->configurationIndex != configurationIndex) {
+        continue;
+      }
+      struct p_altInterface * pEndpointAltInterface = pConfiguration->interfaces[pEndpoint->interfaceIndex].altInterfaces + pEndpoint->altInterfaceIndex;
+      if (pEndpointAltInterface != pAltInterface) {
+        pAltInterface = pEndpointAltInterface;
         printf("  interface: %hhu:%hhu\n", pAltInterface->descriptor->bInterfaceNumber, pAltInterface->descriptor->bAlternateSetting);
-        unsigned char endpointIndex;
-        for (endpointIndex = 0; endpointIndex < pAltInterface->bNumEndpoints; ++endpointIndex) {
-          struct usb_endpoint_descriptor * endpoint =
-              descriptors->configurations[configurationIndex].interfaces[interfaceIndex].altInterfaces[altInterfaceIndex].endpoints[endpointIndex];
-          uint8_t originalEndpoint = endpoint->bEndpointAddress;
-          if (renumber) {
-            ++endpointNumber;
-            endpoint->bEndpointAddress = (endpoint->bEndpointAddress & USB_ENDPOINT_DIR_MASK) | endpointNumber;
-          }
-          printf("    endpoint:");
-          printf(" %s", ((endpoint->bEndpointAddress & USB_ENDPOINT_DIR_MASK) == USB_DIR_IN) ? "IN" : "OUT");
-          printf(" %s",
-              (endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT ? "INTERRUPT" :
-              (endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_BULK ? "BULK" :
-              (endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_ISOC ?
-                  "ISOCHRONOUS" : "UNKNOWN");
-          printf(" %hu", originalEndpoint & USB_ENDPOINT_NUMBER_MASK);
-          if (originalEndpoint != endpoint->bEndpointAddress) {
-            printf(KRED" -> %hu"KNRM, endpointNumber);
-          }
-          printf("\n");
-          if ((originalEndpoint & USB_ENDPOINT_NUMBER_MASK) == 0) {
-            PRINT_ERROR_OTHER("invalid endpoint number")
-            continue;
-          }
-          if (configurationIndex > 0) {
-            continue;
-          }
-          if ((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) != USB_ENDPOINT_XFER_INT) {
-            printf("      endpoint %hu won't be configured (not an INTERRUPT endpoint)\n", endpoint->bEndpointAddress & USB_ENDPOINT_NUMBER_MASK);
-            continue;
-          }
-          if (endpoint->wMaxPacketSize > MAX_PAYLOAD_SIZE_EP) {
-            printf("      endpoint %hu won't be configured (max packet size %hu > %hu)\n", endpoint->bEndpointAddress & USB_ENDPOINT_NUMBER_MASK, endpoint->wMaxPacketSize, MAX_PAYLOAD_SIZE_EP);
-            continue;
-          }
-          if (endpointNumber > MAX_ENDPOINTS) {
-            printf("      endpoint %hu won't be configured (endpoint number %hhu > %hhu)\n", endpoint->bEndpointAddress & USB_ENDPOINT_NUMBER_MASK, endpointNumber, MAX_ENDPOINTS);
-            continue;
-          }
-          U2S_ENDPOINT(originalEndpoint) = endpoint->bEndpointAddress;
-          S2U_ENDPOINT(endpoint->bEndpointAddress) = originalEndpoint;
-          pEndpoints->number = endpoint->bEndpointAddress;
-          pEndpoints->type = endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK;
-          pEndpoints->size = endpoint->wMaxPacketSize;
-          ++pEndpoints;
-        }
       }
+      struct usb_endpoint_descriptor * endpoint = pEndpoint->descriptor;
+      uint8_t originalEndpoint = endpoint->bEndpointAddress;
+      if (renumber) {
+        ++endpointNumber;
+        endpoint->bEndpointAddress = (endpoint->bEndpointAddress & USB_ENDPOINT_DIR_MASK) | endpointNumber;
+      }
+      printf("    endpoint:");
+      printf(" %s", ((endpoint->bEndpointAddress & USB_ENDPOINT_DIR_MASK) == USB_DIR_IN) ? "IN" : "OUT");
+      printf(" %s",
+          (endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT ? "INTERRUPT" :
+          (endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_BULK ? "BULK" :
+          (endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_ISOC ?
+              "ISOCHRONOUS" : "UNKNOWN");
+      printf(" %hu", originalEndpoint & USB_ENDPOINT_NUMBER_MASK);
+      if (originalEndpoint != endpoint->bEndpointAddress) {
+        printf(KRED" -> %hu"KNRM, endpointNumber);
+      }
+      printf("\n");
+      if ((originalEndpoint & USB_ENDPOINT_NUMBER_MASK) == 0) {
+        PRINT_ERROR_OTHER("invalid endpoint number")
+        continue;
+      }
+      if (configurationIndex > 0) {
+        continue;
+      }
+      if ((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) != USB_ENDPOINT_XFER_INT
+          && (endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) != USB_ENDPOINT_XFER_BULK) {
+        printf("      endpoint %hu won't be configured (not an INTERRUPT or BULK endpoint)\n", endpoint->bEndpointAddress & USB_ENDPOINT_NUMBER_MASK);
+        continue;
+      }
+      if (endpoint->wMaxPacketSize > MAX_PAYLOAD_SIZE_EP) {
+        printf("      endpoint %hu won't be configured (max packet size %hu > %hu)\n", endpoint->bEndpointAddress & USB_ENDPOINT_NUMBER_MASK, endpoint->wMaxPacketSize, MAX_PAYLOAD_SIZE_EP);
+        continue;
+      }
+      if (endpointNumber > MAX_ENDPOINTS) {
+        printf("      endpoint %hu won't be configured (endpoint number %hhu > %hhu)\n", endpoint->bEndpointAddress & USB_ENDPOINT_NUMBER_MASK, endpointNumber, MAX_ENDPOINTS);
+        continue;
+      }
+      U2S_ENDPOINT(originalEndpoint) = endpoint->bEndpointAddress;
+      S2U_ENDPOINT(endpoint->bEndpointAddress) = originalEndpoint;
+      if ((originalEndpoint & USB_ENDPOINT_DIR_MASK) == USB_DIR_IN) {
+        inEndpoints[ENDPOINT_ADDR_TO_INDEX(originalEndpoint)].type = endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK;
+      }
+      pEndpoints->number = endpoint->bEndpointAddress;
+      pEndpoints->type = endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK;
+      pEndpoints->size = endpoint->wMaxPacketSize;
+      ++pEndpoints;
     }
   }
 }
 
 static int add_descriptor(uint16_t wValue, uint16_t wIndex, uint16_t wLength, void * data) {
 
-  if (pDesc + wLength > desc + MAX_DESCRIPTORS_SIZE || pDescIndex >= descIndex + MAX_DESCRIPTORS) {
-    fprintf(stderr, "%s:%d %s: unable to add descriptor wValue=0x%04x wIndex=0x%04x wLength=%u (available=%u)\n",
-        __FILE__, __LINE__, __func__, wValue, wIndex, wLength, (unsigned int)(MAX_DESCRIPTORS_SIZE - (pDesc - desc)));
-    return -1;
+  if (pDesc + wLength > desc + descriptorsSize || pDescIndex >= descIndex + MAX_DESCRIPTORS) {
+    printf("descriptor wValue=0x%04x wIndex=0x%04x wLength=%u will be served on demand\n", wValue, wIndex, wLength);
+    return 0;
   }
 
   pDescIndex->offset = pDesc - desc;
@@ -451,10 +732,25 @@ static int add_descriptor(uint16_t wValue, uint16_t wIndex, uint16_t wLength, vo
   return 0;
 }
 
-int send_descriptors() {
+/*
+ * Descriptors outside the hot set are not uploaded in lazy mode.
+ */
+static int add_other_descriptor(uint16_t wValue, uint16_t wIndex, uint16_t wLength, void * data) {
+
+  if (lazyDescriptors) {
+    return 0;
+  }
+
+  return add_descriptor(wValue, wIndex, wLength, data);
+}
+
+static int build_descriptors() {
 
   int ret;
 
+  pDesc = desc;
+  pDescIndex = descIndex;
+
   ret = add_descriptor((USB_DT_DEVICE << 8), 0, sizeof(descriptors->device), &descriptors->device);
   if (ret < 0) {
     return -1;
@@ -476,127 +772,602 @@ int send_descriptors() {
 
   for(descNumber = 0; descNumber < descriptors->nbOthers; ++descNumber) {
 
-    ret = add_descriptor(descriptors->others[descNumber].wValue, descriptors->others[descNumber].wIndex, descriptors->others[descNumber].wLength, descriptors->others[descNumber].data);
+    ret = add_other_descriptor(descriptors->others[descNumber].wValue, descriptors->others[descNumber].wIndex, descriptors->others[descNumber].wLength, descriptors->others[descNumber].data);
     if (ret < 0) {
       return -1;
     }
   }
 
-  ret = adapter_send(adapter, E_TYPE_DESCRIPTORS, desc, pDesc - desc);
-  if (ret < 0) {
-    return -1;
+  return 0;
+}
+
+/*
+ * Look for a descriptor in the host copy, where the endpoint numbers are the ones the target host sees.
+ * The firmware only forwards the requests for the descriptors it doesn't hold.
+ * Returns the length of the descriptor, or -1 if it is not in the host copy.
+ */
+static int find_descriptor(uint16_t wValue, uint16_t wIndex, const void ** data) {
+
+  if (wValue == (USB_DT_DEVICE << 8) && wIndex == 0) {
+    *data = &descriptors->device;
+    return sizeof(descriptors->device);
   }
 
-  return 0;
+  if (wValue == (USB_DT_STRING << 8) && wIndex == 0) {
+    *data = &descriptors->langId0;
+    return sizeof(descriptors->langId0);
+  }
+
+  unsigned int descNumber;
+  for(descNumber = 0; descNumber < descriptors->device.bNumConfigurations; ++descNumber) {
+    if (wValue == ((USB_DT_CONFIG << 8) | descNumber) && wIndex == 0) {
+      *data = descriptors->configurations[descNumber].raw;
+      return descriptors->configurations[descNumber].descriptor->wTotalLength;
+    }
+  }
+
+  for(descNumber = 0; descNumber < descriptors->nbOthers; ++descNumber) {
+    struct p_other * other = descriptors->others + descNumber;
+    if (other->wValue == wValue && other->wIndex == wIndex) {
+      *data = other->data;
+      return other->wLength;
+    }
+  }
+
+  return -1;
+}
+
+static uint32_t fnv1a(uint32_t hash, const void * data, size_t size) {
+
+  const unsigned char * bytes = data;
+  size_t i;
+  for (i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * Send the hash of the descriptors, the index and the endpoints, so that the firmware
+ * can skip the upload if it saved the same set.
+ */
+static uint32_t get_descriptors_hash() {
+
+  uint16_t sizes[] = { pDesc - desc, (pDescIndex - descIndex) * sizeof(*descIndex), (pEndpoints - endpoints) * sizeof(*endpoints) };
+
+  uint32_t hash = 2166136261u;
+  hash = fnv1a(hash, sizes, sizeof(sizes));
+  hash = fnv1a(hash, desc, sizes[0]);
+  hash = fnv1a(hash, descIndex, sizes[1]);
+  hash = fnv1a(hash, endpoints, sizes[2]);
+  return hash;
+}
+
+static int send_hash() {
+
+  uint32_t hash = get_descriptors_hash();
+
+  sessionState = E_SESSION_HASH;
+
+  return adapter_send(adapter, E_TYPE_HASH, (unsigned char *)&hash, sizeof(hash));
+}
+
+/*
+ * The descriptors are acked once per packet, only the first ack moves the session forward.
+ */
+static int send_descriptors() {
+
+  sessionState = E_SESSION_DESCRIPTORS;
+
+  return adapter_send(adapter, E_TYPE_DESCRIPTORS, desc, pDesc - desc);
 }
 
 static int send_index() {
 
-  if (descIndexSent) {
+  if (sessionState != E_SESSION_DESCRIPTORS) {
     return 0;
   }
 
-  descIndexSent = 1;
+  sessionState = E_SESSION_INDEX;
 
   return adapter_send(adapter, E_TYPE_INDEX, (unsigned char *)&descIndex, (pDescIndex - descIndex) * sizeof(*descIndex));
 }
 
 static int send_endpoints() {
 
-  if (endpointsSent) {
+  if (sessionState != E_SESSION_INDEX) {
     return 0;
   }
 
-  endpointsSent = 1;
+  sessionState = E_SESSION_ENDPOINTS;
 
   return adapter_send(adapter, E_TYPE_ENDPOINTS, (unsigned char *)&endpoints, (pEndpoints - endpoints) * sizeof(*endpoints));
 }
 
-static int poll_all_endpoints() {
+static int poll_endpoint(uint8_t endpoint) {
 
-  int ret = 0;
-  unsigned char i;
-  for (i = 0; i < sizeof(*serialToUsbEndpoint) / sizeof(**serialToUsbEndpoint) && ret >= 0; ++i) {
-    uint8_t endpoint = S2U_ENDPOINT(USB_DIR_IN | i);
-    if (endpoint) {
-      ret = gusb_poll(usb, endpoint);
-    }
+  int ret = gusb_poll(usb, endpoint);
+  if (ret != -1) {
+    ++inEndpoints[ENDPOINT_ADDR_TO_INDEX(endpoint)].polling;
   }
   return ret;
 }
 
-static int send_out_packet(s_packet * packet) {
+/*
+ * An interrupt IN endpoint is polled again once its packet is acked by the firmware.
+ * A bulk IN endpoint keeps up to BULK_IN_QUEUE_DEPTH packets pending or queued,
+ * as long as the serial link budget is not exhausted.
+ */
+static int poll_in_endpoint(uint8_t endpoint) {
 
-  s_endpointPacket * epPacket = (s_endpointPacket *)packet->value;
+  uint8_t inPacketIndex = ENDPOINT_ADDR_TO_INDEX(endpoint);
+
+  uint8_t depth = (inEndpoints[inPacketIndex].type == USB_ENDPOINT_XFER_BULK) ? BULK_IN_QUEUE_DEPTH : 1;
+
+  while (inEndpoints[inPacketIndex].polling + inEndpoints[inPacketIndex].nbPackets < depth) {
+    if (inEndpoints[inPacketIndex].type == USB_ENDPOINT_XFER_BULK && linkBudget <= 0) {
+      break;
+    }
+    if (poll_endpoint(endpoint) == -1) {
+      return -1;
+    }
+  }
 
-  return gusb_write(usb, S2U_ENDPOINT(epPacket->endpoint), epPacket->data, packet->header.length - 1);
+  return 0;
 }
 
-static int send_control_packet(s_packet * packet) {
+/*
+ * Poll the IN endpoints that have neither a pending transfer nor a queued packet.
+ * After a firmware restart, transfers submitted during the previous session are still pending.
+ */
+static int poll_all_endpoints(int bulkOnly) {
 
-  struct usb_ctrlrequest * setup = (struct usb_ctrlrequest *)packet->value;
-  if ((setup->bRequestType & USB_RECIP_MASK) == USB_RECIP_ENDPOINT) {
-    if (setup->wIndex != 0) {
-      setup->wIndex = S2U_ENDPOINT(setup->wIndex);
+  int ret = 0;
+  unsigned char i;
+  for (i = 1; i <= ENDPOINT_MAX_NUMBER && ret >= 0; ++i) {
+    uint8_t endpoint = S2U_ENDPOINT(USB_DIR_IN | i);
+    if (endpoint == 0) {
+      continue;
+    }
+    if (bulkOnly && inEndpoints[ENDPOINT_ADDR_TO_INDEX(endpoint)].type != USB_ENDPOINT_XFER_BULK) {
+      continue;
     }
+    ret = poll_in_endpoint(endpoint);
   }
+  return ret;
+}
 
-  if (setup->bRequestType == USB_DIR_IN
-      && setup->bRequest == USB_REQ_GET_DESCRIPTOR
-      && (setup->wValue >> 8) == USB_DT_DEVICE_QUALIFIER) {
-    // device qualifier descriptor is for high speed devices
-    printf("force stall for get device qualifier\n");
-    return adapter_send(adapter, E_TYPE_CONTROL_STALL, NULL, 0);
-  }
+static int resync_timer_read(int user) {
 
-  return gusb_write(usb, 0, packet->value, packet->header.length);
-}
+  gtimer_close(resync_timer);
+  resync_timer = -1;
 
-static void dump(unsigned char * data, unsigned char length)
-{
-  int i;
-  for (i = 0; i < length; ++i) {
-    if(i && !(i % 8)) {
-      printf("\n");
+  if (sessionState != E_SESSION_STARTED) {
+    printf("firmware restart timeout: forcing a reset\n");
+    sessionState = E_SESSION_RESETTING;
+    if (adapter_send(adapter, E_TYPE_RESET, NULL, 0) < 0) {
+      done = 1;
+      return 1;
     }
-    printf("0x%02x ", data[i]);
   }
-  printf("\n");
+
+  return 0;
 }
 
-static int process_packet(int user, s_packet * packet)
-{
-  unsigned char type = packet->header.type;
+static int resync_timer_close(int user) {
+  done = 1;
+  return 1;
+}
 
-  int ret = 0;
+/*
+ * The firmware announces each start with a reset packet.
+ *
+ * If the handshake was complete, the firmware got restarted (watchdog reset or target host power cycle)
+ * and waits for the descriptors: upload them again, without touching the USB device.
+ * If the handshake was in progress, it is not known which part of it the firmware received:
+ * request a reset to restart from a clean state.
+ */
+static int process_firmware_start() {
 
-  switch (packet->header.type) {
-  case E_TYPE_DESCRIPTORS:
-    ret = send_index();
-    break;
-  case E_TYPE_INDEX:
-    ret = send_endpoints();
-    break;
-  case E_TYPE_ENDPOINTS:
-    gtimer_close(init_timer);
-    init_timer = -1;
-    printf("Proxy started successfully. Press ctrl+c to stop it.\n");
-    ret = poll_all_endpoints();
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  /*
+   * The packets that were waiting for an ack are lost: the endpoints will be polled again
+   * once the session is restarted.
+   */
+  unsigned char i;
+  for (i = 0; i < ENDPOINT_MAX_NUMBER; ++i) {
+    inEndpoints[i].inFlight = 0;
+  }
+  nbInFlight = 0;
+
+  // the firmware time restarts from 0
+  fwclock_reset();
+
+  controlRequest.length = 0;
+  controlReply.length = 0;
+  controlReply.offset = 0;
+  onDemandDescriptors.start.tv_sec = 0;
+
+  switch (sessionState) {
+  case E_SESSION_IDLE:
+    return 0;
+  case E_SESSION_STARTED:
+  case E_SESSION_RESETTING:
+    printf("%ld.%06ld firmware started, sending the descriptors hash\n", tv.tv_sec, tv.tv_usec);
+    if (send_hash() < 0) {
+      return -1;
+    }
     break;
-  case E_TYPE_IN:
-    if (inPending > 0) {
-      ret = gusb_poll(usb, inPending);
-      inPending = 0;
-      if (ret != -1) {
-        ret = send_next_in_packet();
-      }
+  case E_SESSION_HASH:
+  case E_SESSION_DESCRIPTORS:
+  case E_SESSION_INDEX:
+  case E_SESSION_ENDPOINTS:
+    printf("%ld.%06ld firmware started during the initialization, resetting it\n", tv.tv_sec, tv.tv_usec);
+    sessionState = E_SESSION_RESETTING;
+    if (adapter_send(adapter, E_TYPE_RESET, NULL, 0) < 0) {
+      return -1;
+    }
+    break;
+  }
+
+  if (init_timer < 0 && resync_timer < 0) {
+    resync_timer = gtimer_start(0, 1000000, resync_timer_read, resync_timer_close, gpoll_register_fd);
+    if (resync_timer < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int process_firmware_started() {
+
+  if (sessionState != E_SESSION_ENDPOINTS) {
+    return 0;
+  }
+
+  sessionState = E_SESSION_STARTED;
+
+  if (init_timer >= 0) {
+    gtimer_close(init_timer);
+    init_timer = -1;
+    printf("Proxy started successfully. Press ctrl+c to stop it.\n");
+  } else {
+    if (resync_timer >= 0) {
+      gtimer_close(resync_timer);
+      resync_timer = -1;
+    }
+    printf("Proxy restarted successfully.\n");
+  }
+
+  if (throughput.start.tv_sec == 0) {
+    gettimeofday(&throughput.start, NULL);
+  }
+
+  int ret = poll_all_endpoints(0);
+  if (ret != -1) {
+    ret = send_next_in_packet();
+  }
+  return ret;
+}
+
+static int process_hash_packet(s_packet * packet) {
+
+  if (sessionState != E_SESSION_HASH) {
+    return 0;
+  }
+
+  if (packet->header.length >= 1 && packet->value[0]) {
+    printf("firmware loaded the descriptors from its EEPROM\n");
+    sessionState = E_SESSION_ENDPOINTS;
+    return process_firmware_started();
+  }
+
+  // older firmwares don't tell the size of their descriptor buffer
+  if (packet->header.length >= sizeof(s_hashReply)) {
+    s_hashReply * reply = (s_hashReply *)packet->value;
+    if (reply->descriptorsSize < pDesc - desc) {
+      printf("the firmware holds %hu bytes of descriptors, building a smaller set\n", reply->descriptorsSize);
+      descriptorsSize = reply->descriptorsSize;
+      if (build_descriptors() < 0) {
+        return -1;
+      }
+      return send_hash();
+    }
+  }
+
+  return send_descriptors();
+}
+
+static int send_out_packet(s_packet * packet) {
+
+  s_endpointPacket * epPacket = (s_endpointPacket *)packet->value;
+
+  throughput.bytes[ENDPOINT_DIR_TO_INDEX(USB_DIR_OUT)][ENDPOINT_ADDR_TO_INDEX(S2U_ENDPOINT(epPacket->endpoint))] += packet->header.length - 1;
+
+  int ret = gusb_write(usb, S2U_ENDPOINT(epPacket->endpoint), epPacket->data, packet->header.length - 1);
+  if (ret != -1) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    update_wire_latency(&wireLatency.out, &firmwareTime, &now);
+  }
+  return ret;
+}
+
+static int send_control_request() {
+
+  struct usb_ctrlrequest * setup = (struct usb_ctrlrequest *)controlRequest.data;
+  if ((setup->bRequestType & USB_RECIP_MASK) == USB_RECIP_ENDPOINT) {
+    if (setup->wIndex != 0) {
+      setup->wIndex = S2U_ENDPOINT(setup->wIndex);
+    }
+  }
+
+  if (setup->bRequestType == USB_DIR_IN
+      && setup->bRequest == USB_REQ_GET_DESCRIPTOR
+      && (setup->wValue >> 8) == USB_DT_DEVICE_QUALIFIER) {
+    // device qualifier descriptor is for high speed devices
+    printf("force stall for get device qualifier\n");
+    return adapter_send(adapter, E_TYPE_CONTROL_STALL, NULL, 0);
+  }
+
+  if ((setup->bRequestType == (USB_DIR_IN | USB_RECIP_DEVICE) || setup->bRequestType == (USB_DIR_IN | USB_RECIP_INTERFACE))
+      && setup->bRequest == USB_REQ_GET_DESCRIPTOR) {
+    const void * data;
+    int length = find_descriptor(setup->wValue, setup->wIndex, &data);
+    if (length >= 0) {
+      gettimeofday(&onDemandDescriptors.start, NULL);
+      if (length > setup->wLength) {
+        length = setup->wLength;
+      }
+      onDemandDescriptors.bytes += length;
+      return send_control_reply(data, length);
+    }
+  }
+
+  gettimeofday(&controlLatency.submitted, NULL);
+
+  return gusb_write(usb, 0, controlRequest.data, controlRequest.length);
+}
+
+/*
+ * The data stage of a control OUT transfer may follow the setup packet in E_TYPE_CONTROL_DATA packets.
+ */
+static int is_control_request_complete() {
+
+  struct usb_ctrlrequest * setup = (struct usb_ctrlrequest *)controlRequest.data;
+
+  if (controlRequest.length < sizeof(*setup)) {
+    return 0;
+  }
+
+  if (setup->bRequestType & USB_DIR_IN) {
+    return 1;
+  }
+
+  return controlRequest.length >= sizeof(*setup) + setup->wLength;
+}
+
+static int process_control_packet(s_packet * packet) {
+
+  // a new control request cancels the reply in progress
+  controlReply.length = 0;
+  controlReply.offset = 0;
+
+  memcpy(controlRequest.data, packet->value, packet->header.length);
+  controlRequest.length = packet->header.length;
+  controlLatency.setup = firmwareTime;
+
+  if (!is_control_request_complete()) {
+    return 0;
+  }
+
+  return send_control_request();
+}
+
+static int process_control_timing_packet(s_packet * packet) {
+
+  if (packet->header.length != sizeof(s_controlTiming)) {
+    PRINT_ERROR_OTHER("invalid control timing packet")
+    return 0;
+  }
+
+  s_controlTiming * timing = (s_controlTiming *) packet->value;
+
+  if (timing->status > E_CONTROL_ABORTED) {
+    PRINT_ERROR_OTHER("invalid control status")
+    return 0;
+  }
+
+  ++controlTiming.count[timing->status];
+
+  unsigned int reply = timing->reply * TIMER_TICK_US;
+  unsigned int total = timing->total * TIMER_TICK_US;
+
+  controlTiming.reply += reply;
+  if (reply > controlTiming.maxReply) {
+    controlTiming.maxReply = reply;
+  }
+  controlTiming.total += total;
+  if (total > controlTiming.maxTotal) {
+    controlTiming.maxTotal = total;
+  }
+
+  if (timing->status == E_CONTROL_TIMEOUT) {
+    PRINT_ERROR_OTHER("control request timed out in the firmware")
+    printf("bmRequestType: 0x%02x bRequest: 0x%02x\n", timing->bmRequestType, timing->bRequest);
+  }
+
+  return 0;
+}
+
+static int process_stats_packet(s_packet * packet) {
+
+  if (packet->header.length != sizeof(s_firmwareStats)) {
+    PRINT_ERROR_OTHER("invalid stats packet")
+    return 0;
+  }
+
+  s_firmwareStats * stats = (s_firmwareStats *) packet->value;
+
+  ++firmwareStats.reports;
+  firmwareStats.framingErrors += stats->framingErrors;
+  firmwareStats.overrunErrors += stats->overrunErrors;
+  firmwareStats.parityErrors += stats->parityErrors;
+  firmwareStats.rxOverflows += stats->rxOverflows;
+  firmwareStats.droppedInPackets += stats->droppedInPackets;
+  firmwareStats.controlTimeouts += stats->controlTimeouts;
+
+  unsigned int maxLoopTime = stats->maxLoopTime * TIMER_TICK_US;
+  if (maxLoopTime > firmwareStats.maxLoopTime) {
+    firmwareStats.maxLoopTime = maxLoopTime;
+  }
+
+  unsigned int i;
+  for (i = 0; i < MAX_ENDPOINTS; ++i) {
+    uint8_t endpoint = stats->naks[i].endpoint;
+    if (endpoint != 0) {
+      firmwareStats.naks[ENDPOINT_DIR_TO_INDEX(endpoint)][ENDPOINT_ADDR_TO_INDEX(endpoint)] += stats->naks[i].count;
+    }
+  }
+
+  // the link errors are reported right away, as they explain the misbehaviours
+  if (stats->framingErrors || stats->overrunErrors || stats->parityErrors || stats->rxOverflows || stats->droppedInPackets) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    fprintf(stderr, "%ld.%06ld firmware link errors: %hu framing, %hu overrun, %hu parity, %hu bytes dropped, %hu IN packets dropped\n",
+        tv.tv_sec, tv.tv_usec, stats->framingErrors, stats->overrunErrors, stats->parityErrors, stats->rxOverflows,
+        stats->droppedInPackets);
+  }
+
+  return 0;
+}
+
+static int process_control_data_packet(s_packet * packet) {
+
+  if (controlReply.offset < controlReply.length) {
+    // the firmware acked the previous fragment
+    return send_control_fragment();
+  }
+
+  if (is_control_request_complete()) {
+    PRINT_ERROR_OTHER("unexpected control data")
+    return 0;
+  }
+
+  if (controlRequest.length + packet->header.length > sizeof(controlRequest.data)) {
+    PRINT_ERROR_OTHER("control request is too large")
+    return -1;
+  }
+
+  memcpy(controlRequest.data + controlRequest.length, packet->value, packet->header.length);
+  controlRequest.length += packet->header.length;
+
+  if (!is_control_request_complete()) {
+    return 0;
+  }
+
+  return send_control_request();
+}
+
+static void dump(unsigned char * data, unsigned char length)
+{
+  int i;
+  for (i = 0; i < length; ++i) {
+    if(i && !(i % 8)) {
+      printf("\n");
+    }
+    printf("0x%02x ", data[i]);
+  }
+  printf("\n");
+}
+
+/*
+ * Remove the timestamp from the packets that have one, and get the host time of the event.
+ */
+static int process_timestamp(s_packet * packet) {
+
+  firmwareTime.tv_sec = 0;
+
+  switch (packet->header.type) {
+  case E_TYPE_OUT:
+  case E_TYPE_CONTROL:
+  case E_TYPE_IN:
+    break;
+  default:
+    return 0;
+  }
+
+  s_timestamp timestamp;
+  if (packet->header.length < sizeof(timestamp)) {
+    PRINT_ERROR_OTHER("missing timestamp")
+    return -1;
+  }
+
+  memcpy(&timestamp, packet->value, sizeof(timestamp));
+  packet->header.length -= sizeof(timestamp);
+  memmove(packet->value, packet->value + sizeof(timestamp), packet->header.length);
+
+  struct timeval arrival;
+  gettimeofday(&arrival, NULL);
+  fwclock_add_sample(timestamp, &arrival);
+
+  return fwclock_to_host(timestamp, &firmwareTime);
+}
+
+static int process_packet(int user, s_packet * packet)
+{
+  unsigned char type = packet->header.type;
+
+  int ret = process_timestamp(packet);
+  if (ret < 0) {
+    return -1;
+  }
+
+  switch (packet->header.type) {
+  case E_TYPE_DESCRIPTORS:
+    ret = send_index();
+    break;
+  case E_TYPE_INDEX:
+    ret = send_endpoints();
+    break;
+  case E_TYPE_ENDPOINTS:
+    ret = process_firmware_started();
+    break;
+  case E_TYPE_HASH:
+    ret = process_hash_packet(packet);
+    break;
+  case E_TYPE_STATS:
+    ret = process_stats_packet(packet);
+    break;
+  case E_TYPE_IN:
+    if (packet->header.length == 1) {
+      uint8_t endpoint = S2U_ENDPOINT(packet->value[0] | USB_DIR_IN);
+      if (endpoint != 0 && inEndpoints[ENDPOINT_ADDR_TO_INDEX(endpoint)].inFlight) {
+        inEndpoints[ENDPOINT_ADDR_TO_INDEX(endpoint)].inFlight = 0;
+        update_wire_latency(&wireLatency.in, &inEndpoints[ENDPOINT_ADDR_TO_INDEX(endpoint)].inFlightReaped, &firmwareTime);
+        --nbInFlight;
+        ret = poll_in_endpoint(endpoint);
+        if (ret != -1) {
+          ret = send_next_in_packet();
+        }
+      }
     }
     break;
   case E_TYPE_OUT:
     ret = send_out_packet(packet);
     break;
   case E_TYPE_CONTROL:
-    ret = send_control_packet(packet);
+    ret = process_control_packet(packet);
+    break;
+  case E_TYPE_CONTROL_DATA:
+    ret = process_control_data_packet(packet);
+    break;
+  case E_TYPE_CONTROL_TIMING:
+    ret = process_control_timing_packet(packet);
     break;
   case E_TYPE_DEBUG:
     {
@@ -607,7 +1378,7 @@ static int process_packet(int user, s_packet * packet)
     }
     break;
   case E_TYPE_RESET:
-    ret = -1;
+    ret = process_firmware_start();
     break;
   default:
     {
@@ -628,14 +1399,16 @@ static int process_packet(int user, s_packet * packet)
 
 int proxy_init(char * port) {
 
-  char * path = usb_select();
+  char * path = simulatedDevice != NULL ? strdup(simulatedDevice) : usb_select();
 
   if(path == NULL) {
     fprintf(stderr, "No USB device selected!\n");
     return -1;
   }
 
-  usb = gusb_open_path(path);
+  gusb_set_fast_attach(fastAttach);
+
+  usb = gusb_open_path_backend(path, simulatedDevice != NULL ? E_GUSB_BACKEND_SIM : usbBackend);
 
   if (usb < 0) {
     free(path);
@@ -652,6 +1425,13 @@ int proxy_init(char * port) {
 
   free(path);
 
+  s_gusb_attach_times times;
+  if (gusb_get_attach_times(usb, &times) == 0) {
+    printf("Attach time: %uus (open %uus, %s %uus, configuration %uus, claim %uus, descriptors %uus)\n",
+        times.total, times.open, times.fast ? "fast, no reset" : "reset", times.reset, times.configuration, times.claim,
+        times.descriptors);
+  }
+
   if (descriptors->device.bNumConfigurations == 0) {
     PRINT_ERROR_OTHER("missing configuration")
     return -1;
@@ -678,6 +1458,18 @@ static int timer_close(int user) {
 }
 
 static int timer_read(int user) {
+
+  linkBudget += LINK_BUDGET_PER_PERIOD;
+  if (linkBudget > LINK_BUDGET_PER_PERIOD) {
+    linkBudget = LINK_BUDGET_PER_PERIOD;
+  }
+
+  if (sessionState == E_SESSION_STARTED) {
+    if (poll_all_endpoints(1) < 0) {
+      done = 1;
+    }
+  }
+
   /*
    * Returning a non-zero value will make gpoll return,
    * this allows to check the 'done' variable.
@@ -685,6 +1477,266 @@ static int timer_read(int user) {
   return 1;
 }
 
+static void print_throughput() {
+
+  if (throughput.start.tv_sec == 0) {
+    return;
+  }
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  double duration = (now.tv_sec - throughput.start.tv_sec) + (now.tv_usec - throughput.start.tv_usec) / 1000000.0;
+  if (duration <= 0) {
+    return;
+  }
+
+  unsigned char dir;
+  for (dir = 0; dir < 2; ++dir) {
+    unsigned char i;
+    for (i = 0; i < ENDPOINT_MAX_NUMBER; ++i) {
+      if (throughput.bytes[dir][i] != 0) {
+        printf("endpoint %hhu %s: %llu bytes in %.3fs (%.1f kB/s)\n", i + 1, dir ? "IN" : "OUT",
+            throughput.bytes[dir][i], duration, throughput.bytes[dir][i] / duration / 1000);
+      }
+    }
+  }
+}
+
+static void print_endpoint_stats(unsigned char endpoint, const s_gusb_endpoint_stats * stats) {
+
+  if (stats->submitted == 0) {
+    return;
+  }
+
+  printf("endpoint 0x%02x: %u submitted, %u completed (%llu bytes), %u timeouts, %u stalls, %u errors, %u cancelled\n",
+      endpoint, stats->submitted, stats->completed, stats->bytes, stats->timeouts, stats->stalls, stats->errors, stats->cancelled);
+
+  printf("  latency:");
+  unsigned int bucket;
+  for (bucket = 0; bucket < GUSB_LATENCY_BUCKETS; ++bucket) {
+    if (stats->latency[bucket] == 0) {
+      continue;
+    }
+    if (bucket < GUSB_LATENCY_BUCKETS - 1) {
+      printf(" <%uus: %u", 125u << bucket, stats->latency[bucket]);
+    } else {
+      printf(" >=%uus: %u", 125u << (bucket - 1), stats->latency[bucket]);
+    }
+  }
+  printf("\n");
+
+  if (stats->intervals > 0) {
+    printf("  interval: expected %uus, average %lluus, min %uus, max %uus, average jitter %lluus\n",
+        stats->expectedInterval, stats->intervalSum / stats->intervals, stats->minInterval, stats->maxInterval,
+        stats->jitterSum / stats->intervals);
+  }
+}
+
+static void print_usb_stats(const s_gusb_stats * stats) {
+
+  print_endpoint_stats(0x00, &stats->control);
+
+  unsigned char i;
+  for (i = 0; i < GUSB_MAX_ENDPOINTS; ++i) {
+    print_endpoint_stats(USB_DIR_IN | (i + 1), stats->in + i);
+    print_endpoint_stats(USB_DIR_OUT | (i + 1), stats->out + i);
+  }
+}
+
+static void print_control_latency() {
+
+  if (controlLatency.count == 0) {
+    return;
+  }
+
+  printf("%u control transfers, USB latency: average %lluus, max %uus\n",
+      controlLatency.count, controlLatency.latency / controlLatency.count, controlLatency.maxLatency);
+}
+
+static void print_wire_latency(const char * name, const s_wire_latency * wire) {
+
+  if (wire->count == 0) {
+    return;
+  }
+
+  printf("%s latency on the wire: %u packets, average %lldus, max %lldus\n",
+      name, wire->count, wire->latency / wire->count, wire->maxLatency);
+}
+
+static void print_firmware_clock() {
+
+  print_wire_latency("IN", &wireLatency.in);
+  print_wire_latency("OUT", &wireLatency.out);
+  print_wire_latency("control", &wireLatency.control);
+
+  if (wireLatency.in.count + wireLatency.out.count + wireLatency.control.count > 0) {
+    printf("firmware clock drift: %.1f ppm\n", fwclock_get_drift() * 1000000);
+  }
+}
+
+static void print_firmware_stats() {
+
+  if (firmwareStats.reports == 0) {
+    return;
+  }
+
+  printf("firmware: %llu framing errors, %llu overrun errors, %llu parity errors, %llu bytes dropped, %llu IN packets dropped, %llu control timeouts, max main loop iteration %uus\n",
+      firmwareStats.framingErrors, firmwareStats.overrunErrors, firmwareStats.parityErrors, firmwareStats.rxOverflows,
+      firmwareStats.droppedInPackets, firmwareStats.controlTimeouts, firmwareStats.maxLoopTime);
+
+  unsigned char dir;
+  for (dir = 0; dir < 2; ++dir) {
+    unsigned char i;
+    for (i = 0; i < ENDPOINT_MAX_NUMBER; ++i) {
+      if (firmwareStats.naks[dir][i] != 0) {
+        uint8_t endpoint = (dir ? USB_DIR_IN : USB_DIR_OUT) | (i + 1);
+        printf("endpoint 0x%02x (0x%02x on the device): NAKed in %llu ms\n",
+            endpoint, S2U_ENDPOINT(endpoint), firmwareStats.naks[dir][i]);
+      }
+    }
+  }
+}
+
+static void print_control_timing() {
+
+  unsigned int count = controlTiming.count[E_CONTROL_COMPLETED] + controlTiming.count[E_CONTROL_STALLED]
+      + controlTiming.count[E_CONTROL_TIMEOUT] + controlTiming.count[E_CONTROL_ABORTED];
+
+  if (count == 0) {
+    return;
+  }
+
+  printf("%u forwarded control requests (%u stalled, %u timeouts, %u aborted), reply: average %lluus, max %uus, total: average %lluus, max %uus\n",
+      count, controlTiming.count[E_CONTROL_STALLED], controlTiming.count[E_CONTROL_TIMEOUT], controlTiming.count[E_CONTROL_ABORTED],
+      controlTiming.reply / count, controlTiming.maxReply, controlTiming.total / count, controlTiming.maxTotal);
+}
+
+static void print_descriptor_latency() {
+
+  if (onDemandDescriptors.count == 0) {
+    return;
+  }
+
+  printf("%u descriptors (%llu bytes) served on demand, latency: average %lluus, max %uus\n",
+      onDemandDescriptors.count, onDemandDescriptors.bytes,
+      onDemandDescriptors.latency / onDemandDescriptors.count, onDemandDescriptors.maxLatency);
+}
+
+void proxy_set_lazy_descriptors(int enable) {
+
+  lazyDescriptors = enable;
+}
+
+void proxy_set_event_thread(int cpu) {
+
+  eventThreadCpu = cpu;
+}
+
+void proxy_set_fast_attach(int enable) {
+
+  fastAttach = enable;
+}
+
+void proxy_set_usb_backend(e_gusb_backend backend) {
+
+  usbBackend = backend;
+}
+
+void proxy_set_simulated_device(const char * script) {
+
+  simulatedDevice = script;
+}
+
+static void export_bytes(FILE * file, const unsigned char * data, unsigned int length) {
+
+  unsigned int i;
+  for (i = 0; i < length; ++i) {
+    fprintf(file, "%s0x%02x,", (i % 16) ? " " : "\n  ", data[i]);
+  }
+}
+
+/*
+ * The first pass writes the descriptor data, the second one writes the index.
+ */
+static void export_descriptor(FILE * file, unsigned int pass, uint16_t wValue, uint16_t wIndex, uint16_t wLength,
+    const void * data, uint16_t * offset) {
+
+  if (pass == 0) {
+    fprintf(file, "\n  // wValue=0x%04x wIndex=0x%04x wLength=%u", wValue, wIndex, wLength);
+    export_bytes(file, data, wLength);
+  } else {
+    fprintf(file, "\n  { .offset = %u, .wValue = 0x%04x, .wIndex = 0x%04x, .wLength = %u },", *offset, wValue, wIndex, wLength);
+  }
+  *offset += wLength;
+}
+
+/*
+ * Write all the descriptors and the endpoints as a C header, for the baked firmware variant.
+ * BAKED_HASH is the hash of the set that would be uploaded, so that the baked firmware can skip the upload:
+ * the export has to be made with the same options as the runs.
+ */
+int proxy_export_descriptors(const char * path) {
+
+  if (build_descriptors() < 0) {
+    return -1;
+  }
+
+  FILE * file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "%s:%d %s: fopen failed with error: %m\n", __FILE__, __LINE__, __func__);
+    return -1;
+  }
+
+  fprintf(file, "// generated by serialusb --export-descriptors, VID 0x%04x PID 0x%04x\n\n",
+      descriptors->device.idVendor, descriptors->device.idProduct);
+
+  fprintf(file, "#define BAKED_HASH 0x%08xUL\n\n", get_descriptors_hash());
+
+  unsigned int pass;
+  for (pass = 0; pass < 2; ++pass) {
+
+    uint16_t offset = 0;
+
+    if (pass == 0) {
+      fprintf(file, "static const uint8_t bakedDescriptors[] PROGMEM = {");
+    } else {
+      fprintf(file, "static const s_descriptorIndex bakedIndex[] PROGMEM = {");
+    }
+
+    export_descriptor(file, pass, (USB_DT_DEVICE << 8), 0, sizeof(descriptors->device), &descriptors->device, &offset);
+    export_descriptor(file, pass, (USB_DT_STRING << 8), 0, sizeof(descriptors->langId0), &descriptors->langId0, &offset);
+
+    unsigned int descNumber;
+    for(descNumber = 0; descNumber < descriptors->device.bNumConfigurations; ++descNumber) {
+      export_descriptor(file, pass, (USB_DT_CONFIG << 8) | descNumber, 0, descriptors->configurations[descNumber].descriptor->wTotalLength,
+          descriptors->configurations[descNumber].raw, &offset);
+    }
+
+    for(descNumber = 0; descNumber < descriptors->nbOthers; ++descNumber) {
+      export_descriptor(file, pass, descriptors->others[descNumber].wValue, descriptors->others[descNumber].wIndex,
+          descriptors->others[descNumber].wLength, descriptors->others[descNumber].data, &offset);
+    }
+
+    fprintf(file, "\n};\n\n");
+  }
+
+  fprintf(file, "static const s_endpointConfig bakedEndpoints[MAX_ENDPOINTS] PROGMEM = {");
+  s_endpointConfig * endpoint;
+  for (endpoint = endpoints; endpoint < pEndpoints; ++endpoint) {
+    fprintf(file, "\n  { .number = 0x%02x, .type = %u, .size = %u },", endpoint->number, endpoint->type, endpoint->size);
+  }
+  fprintf(file, "\n};\n");
+
+  if (fclose(file) != 0) {
+    fprintf(stderr, "%s:%d %s: fclose failed with error: %m\n", __FILE__, __LINE__, __func__);
+    return -1;
+  }
+
+  printf("Descriptors exported to %s\n", path);
+
+  return 0;
+}
+
 int proxy_start(char * port) {
 
   int ret = set_prio();
@@ -700,7 +1752,11 @@ int proxy_start(char * port) {
     return -1;
   }
 
-  if (send_descriptors() < 0) {
+  if (build_descriptors() < 0) {
+    return -1;
+  }
+
+  if (send_hash() < 0) {
     return -1;
   }
 
@@ -709,12 +1765,18 @@ int proxy_start(char * port) {
     return -1;
   }
 
+  if (eventThreadCpu >= -1) {
+    if (gusb_start_event_thread(eventThreadCpu) < 0) {
+      return -1;
+    }
+  }
+
   ret = gusb_register(usb, 0, usb_read_callback, usb_write_callback, usb_close_callback, gpoll_register_fd);
   if (ret < 0) {
     return -1;
   }
 
-  int timer = gtimer_start(0, 10000, timer_read, timer_close, gpoll_register_fd);
+  int timer = gtimer_start(0, LINK_TIMER_PERIOD, timer_read, timer_close, gpoll_register_fd);
   if (timer < 0) {
     return -1;
   }
@@ -724,9 +1786,26 @@ int proxy_start(char * port) {
   }
 
   gtimer_close(timer);
+  if (resync_timer >= 0) {
+    gtimer_close(resync_timer);
+  }
   adapter_send(adapter, E_TYPE_RESET, NULL, 0);
+
+  s_gusb_stats usbStats;
+  int usbStatsRet = gusb_get_stats(usb, &usbStats);
+
   gusb_close(usb);
 
+  print_throughput();
+  if (usbStatsRet == 0) {
+    print_usb_stats(&usbStats);
+  }
+  print_control_latency();
+  print_control_timing();
+  print_firmware_clock();
+  print_firmware_stats();
+  print_descriptor_latency();
+
   if (init_timer >= 0) {
     PRINT_ERROR_OTHER("Failed to start the proxy: initialization timeout expired!")
     gtimer_close(init_timer);
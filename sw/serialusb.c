@@ -12,10 +12,11 @@
 #include <getopt.h>
 
 static char * port = NULL;
+static char * exportPath = NULL;
 
 static void usage()
 {
-  printf("Usage: sudo serialusb --port /dev/ttyUSB0\n");
+  printf("Usage: sudo serialusb --port /dev/ttyUSB0 [--lazy-descriptors] [--event-thread[=cpu]] [--fast-attach] [--usbfs | --hidraw | --simulate script] [--export-descriptors file]\n");
 }
 
 int args_read(int argc, char *argv[]) {
@@ -28,6 +29,13 @@ int args_read(int argc, char *argv[]) {
     { "help",    no_argument,       0, 'h' },
     { "version", no_argument,       0, 'v' },
     { "port",    required_argument, 0, 'p' },
+    { "lazy-descriptors", no_argument, 0, 'l' },
+    { "event-thread", optional_argument, 0, 't' },
+    { "fast-attach", no_argument, 0, 'f' },
+    { "usbfs", no_argument, 0, 'u' },
+    { "hidraw", no_argument, 0, 'r' },
+    { "simulate", required_argument, 0, 's' },
+    { "export-descriptors", required_argument, 0, 'e' },
     { 0, 0, 0, 0 }
   };
 
@@ -35,7 +43,7 @@ int args_read(int argc, char *argv[]) {
     /* getopt_long stores the option index here. */
     int option_index = 0;
 
-    c = getopt_long(argc, argv, "hp:v", long_options, &option_index);
+    c = getopt_long(argc, argv, "e:fhlp:rs:t::uv", long_options, &option_index);
 
     /* Detect the end of the options. */
     if (c == -1)
@@ -43,15 +51,43 @@ int args_read(int argc, char *argv[]) {
 
     switch (c) {
 
+    case 'e':
+      exportPath = optarg;
+      break;
+
+    case 'f':
+      proxy_set_fast_attach(1);
+      break;
+
     case 'h':
       usage();
       exit(0);
       break;
 
+    case 'l':
+      proxy_set_lazy_descriptors(1);
+      break;
+
     case 'p':
       port = optarg;
       break;
 
+    case 's':
+      proxy_set_simulated_device(optarg);
+      break;
+
+    case 't':
+      proxy_set_event_thread(optarg != NULL ? atoi(optarg) : -1);
+      break;
+
+    case 'r':
+      proxy_set_usb_backend(E_GUSB_BACKEND_HIDRAW);
+      break;
+
+    case 'u':
+      proxy_set_usb_backend(E_GUSB_BACKEND_USBFS);
+      break;
+
     case 'v':
       printf("serialusb %s %s\n", INFO_VERSION, INFO_ARCH);
       exit(0);
@@ -90,6 +126,10 @@ int main(int argc, char * argv[]) {
 
   ret = proxy_init();
 
+  if (ret == 0 && exportPath != NULL) {
+    ret = proxy_export_descriptors(exportPath);
+  }
+
   if (ret == 0 && port != NULL) {
     ret = proxy_start(port);
   }